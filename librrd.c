@@ -25,7 +25,6 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <zlib.h>
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,52 +34,18 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
-#include "librrd.h"
-#include "parson/parson.h"
+#include "librrd_private.h"
 
-#define MAGIC "DATASOURCES"
-#define MAGIC_SIZE (sizeof (MAGIC)-1)
-#define RRD_MAX_JSON (2048 * RRD_MAX_SOURCES)
+#define RRD_JSON_PER_SOURCE RRD_STATIC_JSON
+#define RRD_JSON_WRAPPER 64     /* meta data around the sources */
 
 #ifndef __APPLE__
 #include <endian.h>
 #define htonll(x) htobe64(x)
 #endif
 
-/*
- * The type RRD_PLUGIN below is private to the implementation and entirely
- * managed by it.
- */
-
-struct rrd_plugin {
-    char           *name;       /* name of the plugin */
-    char           *path;       /* path to file */
-    RRD_SOURCE     *sources[RRD_MAX_SOURCES];
-    JSON_Value     *meta;       /* meta data for the plugin */
-    char           *buf;        /* buffer where we keep protocol data */
-    rrd_domain_t    domain;     /* domain of this plugin */
-    uint32_t        n;          /* number of used slots */
-    size_t          buf_size;   /* size of the buffer */
-    int             file;       /* where we report data */
-};
-
-
-/*
- * The struct represents the first 31 bytes in the protocol header. Fields
- * are not 4-byte or 8-byte aligned which is why we need the packed
- * attribute.
- */
-struct rrd_header {
-    uint8_t         rrd_magic[MAGIC_SIZE];
-    uint32_t        rrd_checksum_value;
-    uint32_t        rrd_checksum_meta;
-    uint32_t        rrd_header_datasources;
-    uint64_t        rrd_timestamp;
-    uint32_t        rrd_data[];/* more data follows */
-}               __attribute__((packed));
-typedef struct rrd_header RRD_HEADER;
-
 /*
  * write data to fd
  */
@@ -101,55 +66,210 @@ write_exact(int fd, const void *data, size_t size)
 }
 
 /*
- * invalidate the current buffer. It will be re-created by sample().
+ * invalidate the current buffer. It will be re-created by sample() in
+ * the memory it occupies now.
  */
 static void
 invalidate(RRD_PLUGIN * plugin)
 {
     assert(plugin);
 
-    free(plugin->buf);
     plugin->buf = NULL;
     plugin->buf_size = 0;
-    json_value_free(plugin->meta);
-    plugin->meta = NULL;
 }
 
 /*
- * Generate JSON for a data source and return it as an JSON object (from
- * where it can be rendered to a string.
+ * Meta data is rendered directly into a buffer rather than built as a
+ * parson object first: parson limits objects to 960 members and looks
+ * up every member linearly when it is added. The output is identical to
+ * parson's pretty printer. A JSON_BUF counts the bytes that would be
+ * written even when they don't fit such that the required size is known
+ * after a first attempt.
+ */
+typedef struct json_buf {
+    char           *p;
+    size_t          len;        /* bytes written or required */
+    size_t          size;       /* capacity of p */
+} JSON_BUF;
+
+static void
+json_append(JSON_BUF * b, const char *s, size_t n)
+{
+    if (b->len + n <= b->size)
+        memcpy(b->p + b->len, s, n);
+    b->len += n;
+}
+
+/*
+ * length of the UTF-8 sequence at s, or 0 when it is not valid: a
+ * continuation byte, truncated, overlong, a surrogate, or beyond
+ * U+10FFFF. The string ends with a NUL, which is not a continuation
+ * byte.
+ */
+static int
+utf8_len(const unsigned char *s)
+{
+    uint32_t        cp;
+    int             len;
+
+    if (s[0] < 0x80)
+        return 1;
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        len = 2;
+    else if (s[0] >= 0xe0 && s[0] <= 0xef)
+        len = 3;
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+        len = 4;
+    else
+        return 0;
+    cp = s[0] & (0x7f >> len);
+    for (int i = 1; i < len; i++) {
+        if ((s[i] & 0xc0) != 0x80)
+            return 0;
+        cp = cp << 6 | (s[i] & 0x3f);
+    }
+    if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000)
+        || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+        return 0;
+    return len;
+}
+
+/*
+ * A byte that is not part of valid UTF-8 is replaced by U+FFFD, as
+ * parson refuses such strings and the daemon would reject the file.
  */
-static JSON_Value *
-json_for_source(RRD_SOURCE * source)
+static void
+json_string(JSON_BUF * b, const char *s)
+{
+    char            esc[8];
+    int             len;
+
+    json_append(b, "\"", 1);
+    for (; *s; s++) {
+        unsigned char   c = *s;
+        switch (c) {
+        case '"':
+            json_append(b, "\\\"", 2);
+            break;
+        case '\\':
+            json_append(b, "\\\\", 2);
+            break;
+        case '/':
+            json_append(b, "\\/", 2);
+            break;
+        case '\b':
+            json_append(b, "\\b", 2);
+            break;
+        case '\f':
+            json_append(b, "\\f", 2);
+            break;
+        case '\n':
+            json_append(b, "\\n", 2);
+            break;
+        case '\r':
+            json_append(b, "\\r", 2);
+            break;
+        case '\t':
+            json_append(b, "\\t", 2);
+            break;
+        default:
+            if (c < 0x20) {
+                snprintf(esc, sizeof esc, "\\u%04x", c);
+                json_append(b, esc, 6);
+            } else if ((len = utf8_len((const unsigned char *)s)) == 0) {
+                json_append(b, "\\ufffd", 6);
+            } else {
+                json_append(b, s, len);
+                s += len - 1;
+            }
+        }
+    }
+    json_append(b, "\"", 1);
+}
+
+static void
+json_indent(JSON_BUF * b, int level)
+{
+    while (level-- > 0)
+        json_append(b, "    ", 4);
+}
+
+/*
+ * Start a member of an object at level; first tells whether it is the
+ * first member of the object.
+ */
+static void
+json_member(JSON_BUF * b, int level, int *first, const char *name)
+{
+    json_append(b, *first ? "\n" : ",\n", *first ? 1 : 2);
+    *first = 0;
+    json_indent(b, level);
+    json_string(b, name);
+    json_append(b, ": ", 2);
+}
+
+/*
+ * A NULL value is omitted, as parson did.
+ */
+static void
+json_member_string(JSON_BUF * b, int level, int *first, const char *name,
+                   const char *value)
+{
+    if (value == NULL)
+        return;
+    json_member(b, level, first, name);
+    json_string(b, value);
+}
+
+static void
+json_end(JSON_BUF * b, int level, int first)
+{
+    if (!first) {
+        json_append(b, "\n", 1);
+        json_indent(b, level);
+    }
+    json_append(b, "}", 1);
+}
+
+/*
+ * Generate JSON for a data source as a member of the datasources object.
+ * uuid is reported for a source of a VM or SR without owner_uuid.
+ */
+static void
+json_for_source(JSON_BUF * b, int *first, RRD_SOURCE * source,
+                const char *uuid)
 {
     assert(source);
+    int             inner = 1;
+    const char     *owner_uuid = source->owner_uuid ? source->owner_uuid
+        : uuid;
 
-    JSON_Value     *json = json_value_init_object();
-    JSON_Object    *src = json_value_get_object(json);
+    json_member(b, 2, first, source->name);
+    json_append(b, "{", 1);
 
-    json_object_set_string(src, "description", source->description);
-    json_object_set_string(src, "units", source->rrd_units);
-    json_object_set_string(src, "min", source->min);
-    json_object_set_string(src, "max", source->max);
-    json_object_set_string(src, "default",
-                           source->rrd_default ? "true" : "false");
+    json_member_string(b, 3, &inner, "description", source->description);
+    json_member_string(b, 3, &inner, "units", source->rrd_units);
+    json_member_string(b, 3, &inner, "min", source->min);
+    json_member_string(b, 3, &inner, "max", source->max);
+    json_member_string(b, 3, &inner, "default",
+                       source->rrd_default ? "true" : "false");
 
-    char           owner[128] = {0};
+    char            owner[128] = { 0 };
 
     switch (source->owner) {
     case RRD_HOST:
         snprintf(owner, sizeof owner, "host");
         break;
     case RRD_VM:
-        snprintf(owner, sizeof owner, "vm %s", source->owner_uuid);
+        snprintf(owner, sizeof owner, "vm %s", owner_uuid);
         break;
     case RRD_SR:
-        snprintf(owner, sizeof owner, "sr %s", source->owner_uuid);
+        snprintf(owner, sizeof owner, "sr %s", owner_uuid);
         break;
     default:
         abort();
     }
-    json_object_set_string(src, "owner", owner);
+    json_member_string(b, 3, &inner, "owner", owner);
 
     char           *value_type = NULL;
     switch (source->type) {
@@ -162,7 +282,7 @@ json_for_source(RRD_SOURCE * source)
     default:
         abort();
     }
-    json_object_set_string(src, "value_type", value_type);
+    json_member_string(b, 3, &inner, "value_type", value_type);
 
 #define RRD_TRANSPORT_1_1_0
 #ifdef RRD_TRANSPORT_1_1_0
@@ -189,34 +309,64 @@ json_for_source(RRD_SOURCE * source)
     default:
         abort();
     }
-    json_object_set_string(src, "type", scale);
+    json_member_string(b, 3, &inner, "type", scale);
+    json_end(b, 2, inner);
+}
 
-    return json;
+/*
+ * Render the JSON for a source when it is added to a plugin. It is
+ * rendered as a member that is not the first one and starts with a
+ * comma, which json_for_plugin() drops for the first source. A plugin
+ * in the storage of the caller has RRD_JSON_PER_SOURCE bytes per slot
+ * for it.
+ */
+static int
+render_source(RRD_PLUGIN * plugin, int32_t slot, const char *uuid)
+{
+    JSON_BUF        json = { NULL, 0, 0 };
+    int             first = 0;
+
+    json_for_source(&json, &first, plugin->sources[slot], uuid);
+    if (plugin->fixed) {
+        if (json.len > RRD_JSON_PER_SOURCE)
+            return -1;
+        json.p = plugin->meta[slot].json;
+    } else {
+        json.p = malloc(json.len);
+        if (!json.p)
+            return -1;
+    }
+    json.size = json.len;
+    json.len = 0;
+    json_for_source(&json, &first, plugin->sources[slot], uuid);
+    plugin->meta[slot].json = json.p;
+    plugin->meta[slot].len = json.len;
+    return 0;
 }
+
 /*
  * Generate JSON for a plugin. This is just a JSON object containing a
- * sub-object for every data source.
+ * sub-object for every data source. The string is terminated by a NUL
+ * byte that is part of the meta data. The JSON of the sources was
+ * rendered when they were added.
  */
-static JSON_Value *
-json_for_plugin(RRD_PLUGIN * plugin)
+static void
+json_for_plugin(JSON_BUF * b, RRD_PLUGIN * plugin)
 {
     assert(plugin);
+    int             first = 1;
+    int             ds = plugin->n == 0;
 
-    JSON_Value     *root_json = json_value_init_object();
-    JSON_Object    *root = json_value_get_object(root_json);
-
-    JSON_Value     *ds_json = json_value_init_object();
-    JSON_Object    *ds = json_value_get_object(ds_json);
-
-    json_object_set_value(root, "datasources", ds_json);
-    for (size_t i = 0; i < RRD_MAX_SOURCES; i++) {
-        JSON_Value     *src;
-        if (plugin->sources[i] == NULL)
-            continue;
-        src = json_for_source(plugin->sources[i]);
-        json_object_set_value(ds, plugin->sources[i]->name, src);
+    json_append(b, "{", 1);
+    json_member(b, 1, &first, "datasources");
+    json_append(b, "{", 1);
+    for (uint32_t i = 0; i < plugin->n; i++) {
+        struct rrd_meta *meta = &plugin->meta[plugin->live[i].slot];
+        json_append(b, meta->json + (i == 0), meta->len - (i == 0));
     }
-    return root_json;
+    json_end(b, 1, ds);
+    json_end(b, 0, first);
+    json_append(b, "", 1);
 }
 
 double get_timestamp()
@@ -226,6 +376,19 @@ double get_timestamp()
     return (double) tp.tv_sec + (double) tp.tv_usec / 1e6;
 }
 
+double
+rrd_clock(int clock)
+{
+#ifdef CLOCK_REALTIME_COARSE
+    if (clock == RRD_CLOCK_COARSE) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+    }
+#endif
+    return get_timestamp();
+}
+
 /**
  * Returns the IEEE 754 bit pattern of a double as a uint64_t.
  * The timestamp used in RRD was changed from int to double to increase
@@ -241,44 +404,71 @@ uint64_t bits_of_double(double d)
     return i;
 }
 
+/*
+ * size of a buffer for the values of capacity slots and size_meta bytes
+ * of meta data
+ */
+static size_t
+buffer_size(size_t capacity, size_t size_meta)
+{
+    return sizeof(RRD_HEADER) + capacity * sizeof(int64_t)
+        + sizeof(uint32_t) + size_meta;
+}
+
 /*
  * initialise the buffer that we update and write out to a file. Once
- * initialised, it is kept up to date by sample().
+ * initialised, it is kept up to date by sample(). The buffer has room
+ * for the values of all slots and RRD_JSON_PER_SOURCE bytes of meta data
+ * per slot such that its size only changes when the number of slots
+ * grows. It is built in the store of the plugin, which is allocated
+ * together with the slots and kept when the buffer is invalidated. Only
+ * the bytes that were used before and are not overwritten are cleared.
+ * The store is replaced only when the meta data does not fit into it,
+ * which can't happen for a plugin in the storage of the caller.
  */
 static int
 initialise(RRD_PLUGIN * plugin)
 {
 
     RRD_HEADER     *header;
-    uint32_t        size_meta;
-    uint32_t        size_total;
+    JSON_BUF        json = { NULL, 0, 0 };
+    size_t          size_meta;
+    size_t          size_total;
+    size_t          used;
     int64_t        *p64;
     int32_t        *p32;
 
     assert(plugin);
-    assert(plugin->meta == NULL);
     assert(plugin->buf == NULL);
-    assert(plugin->n <= RRD_MAX_SOURCES);
+    assert(plugin->n <= plugin->capacity);
 
-    plugin->meta = json_for_plugin(plugin);
-    size_meta = json_serialization_size_pretty(plugin->meta);
-    assert(size_meta < RRD_MAX_JSON);   /* just a safeguard */
-
-    size_total = 0;
-    size_total += sizeof(RRD_HEADER);
-    size_total += RRD_MAX_SOURCES * sizeof(int64_t);
-    size_total += sizeof(uint32_t);
-    size_total += RRD_MAX_JSON;
+    json_for_plugin(&json, plugin);     /* only measures */
+    size_meta = plugin->capacity * RRD_JSON_PER_SOURCE;
+    if (plugin->fixed) {
+        size_meta += RRD_JSON_WRAPPER;
+        assert(json.len <= size_meta);
+    } else if (json.len > size_meta) {
+        size_meta = json.len;
+    }
+    size_total = buffer_size(plugin->capacity, size_meta);
 
-    plugin->buf_size = size_total;
-    plugin->buf = calloc(1, size_total);
-    if (!plugin->buf) {
-        /*
-         * fatal
-         */
-        plugin->buf_size = 0;
-        return -1;
+    if (size_total > plugin->store_size) {
+        char           *store = calloc(1, size_total);
+        if (!store) {
+            /*
+             * fatal
+             */
+            return -1;
+        }
+        if (plugin->store_heap)
+            free(plugin->store);
+        plugin->store = store;
+        plugin->store_size = size_total;
+        plugin->store_used = 0;
+        plugin->store_heap = 1;
     }
+    plugin->buf_size = size_total;
+    plugin->buf = plugin->store;
     /*
      * all values need to be in network byte order
      */
@@ -288,9 +478,7 @@ initialise(RRD_PLUGIN * plugin)
     header->rrd_header_datasources = htonl(plugin->n);
     header->rrd_timestamp = htonll(bits_of_double(get_timestamp()));
     if (header->rrd_timestamp == -1) {
-        free(plugin->buf);
-        plugin->buf_size = 0;
-        plugin->buf = NULL;
+        invalidate(plugin);
         return -1;
     }
     p64 = (int64_t *) (plugin->buf + sizeof(RRD_HEADER));
@@ -298,58 +486,389 @@ initialise(RRD_PLUGIN * plugin)
         *p64++ = htonll(0x0011223344556677);
     }
     p32 = (int32_t *) p64;
+    size_meta = json.len;
     *p32++ = htonl(size_meta);
-    json_serialize_to_buffer_pretty(plugin->meta, (char *)p32, size_meta);
+    json.p = (char *)p32;
+    json.len = 0;
+    json.size = size_meta;
+    json_for_plugin(&json, plugin);
+    used = (char *)p32 + size_meta - plugin->buf;
+    if (plugin->store_used > used)
+        memset(plugin->buf + used, 0, plugin->store_used - used);
+    plugin->store_used = used;
 
-    uint32_t        crc;
-    crc = crc32(0L, Z_NULL, 0);
-    crc = crc32(crc, (unsigned char *)p32, size_meta);
+    uint32_t        crc = rrd_crc32(0, p32, size_meta);
     header->rrd_checksum_meta = htonl(crc);
+    plugin->dirty = 1;
+
+    /*
+     * zeros[i] appends the words after word i of the timestamp and the
+     * values to a CRC
+     */
+    if (plugin->checksum == RRD_CHECKSUM_INCREMENTAL) {
+        uint32_t        word = rrd_crc32_zeros(sizeof(int64_t));
+        plugin->zeros[plugin->n] = rrd_crc32_zeros(0);
+        for (uint32_t i = plugin->n; i > 0; i--)
+            plugin->zeros[i - 1] = rrd_crc32_mult(word, plugin->zeros[i]);
+    }
+    return 0;
+}
+
+/*
+ * Build a snapshot of the sources in use and of a fresh buffer for the
+ * concurrent mode. The snapshot, its values, and its buffer are a
+ * single allocation; the buffer is a copy of the one of the plugin. It
+ * is built in reserve unless that is NULL.
+ */
+static struct rrd_snap *
+snapshot(RRD_PLUGIN * plugin, struct rrd_snap *reserve)
+{
+    struct rrd_snap *snap;
+    size_t          size;
+
+    invalidate(plugin);
+    if (initialise(plugin) != 0)
+        return NULL;
+    size = sizeof(struct rrd_snap) + plugin->n * sizeof(struct rrd_live)
+        + plugin->n * sizeof(int64_t);
+    snap = reserve ? reserve : malloc(size + plugin->buf_size);
+    if (!snap) {
+        invalidate(plugin);
+        return NULL;
+    }
+    memcpy(snap->live, plugin->live, plugin->n * sizeof(struct rrd_live));
+    snap->n = plugin->n;
+    snap->values = (int64_t *) (snap->live + snap->n);
+    snap->buf = (char *)snap + size;
+    snap->buf_size = plugin->buf_size;
+    memcpy(snap->buf, plugin->buf, plugin->buf_size);
+    snap->dirty = 1;
+    snap->next = NULL;
+    return snap;
+}
+
+struct rrd_snap *
+rrd_snapshot(RRD_PLUGIN * plugin)
+{
+    return snapshot(plugin, NULL);
+}
+
+/*
+ * Upper bound of the size of a snapshot once a source was removed: the
+ * buffer is built in the store, which does not grow when the meta data
+ * shrinks.
+ */
+static size_t
+snapshot_size(RRD_PLUGIN * plugin)
+{
+    return sizeof(struct rrd_snap) + plugin->n * sizeof(struct rrd_live)
+        + plugin->n * sizeof(int64_t) + plugin->store_size;
+}
+
+/*
+ * Push the slots from..to-1 onto the free list such that the lowest slot
+ * is used first.
+ */
+static void
+free_slots(RRD_PLUGIN * plugin, size_t from, size_t to)
+{
+    while (to-- > from) {
+        plugin->sources[to] = NULL;
+        plugin->next_free[to] = plugin->free;
+        plugin->free = (int32_t) to;
+    }
+}
+
+/*
+ * Free the memory of a plugin. A plugin in the storage of the caller
+ * has none.
+ */
+static void
+plugin_free(RRD_PLUGIN * plugin)
+{
+    invalidate(plugin);
+    if (plugin->fixed)
+        return;
+    for (uint32_t i = 0; i < plugin->n; i++)
+        free(plugin->meta[plugin->live[i].slot].json);
+    if (plugin->store_heap)
+        free(plugin->store);
+    free(plugin->body);
+    free(plugin);
+}
+
+/*
+ * Take the next chunk of size bytes from the memory at *p. Chunks are
+ * aligned to 16 bytes.
+ */
+static size_t
+align16(size_t size)
+{
+    return (size + 15) & ~(size_t) 15;
+}
+
+static void    *
+carve(char **p, size_t size)
+{
+    void           *chunk = *p;
+
+    *p += align16(size);
+    return chunk;
+}
+
+/*
+ * size of the store of a plugin with capacity slots
+ */
+static size_t
+store_size(size_t capacity)
+{
+    return buffer_size(capacity, capacity * RRD_JSON_PER_SOURCE
+                       + RRD_JSON_WRAPPER);
+}
+
+/*
+ * The slots, index, and store of a plugin with capacity slots are laid
+ * out in a single chunk of memory of layout_size() bytes by layout(),
+ * which returns the memory for the index and advances *p past the chunk.
+ */
+static size_t
+layout_size(size_t capacity)
+{
+    return align16(capacity * sizeof(RRD_SOURCE *))
+        + align16(capacity * sizeof(int32_t))
+        + align16(capacity * sizeof(struct rrd_live))
+        + align16(capacity * sizeof(int32_t))
+        + align16(capacity * sizeof(struct rrd_meta))
+        + align16((capacity + 1) * sizeof(uint32_t))
+        + align16(capacity * sizeof(int64_t))
+        + align16(rrd_index_bytes(capacity))
+        + align16(store_size(capacity));
+}
+
+static void    *
+layout(RRD_PLUGIN * plugin, char **p, size_t capacity)
+{
+    void           *index;
+
+    plugin->sources = carve(p, capacity * sizeof(RRD_SOURCE *));
+    plugin->next_free = carve(p, capacity * sizeof(int32_t));
+    plugin->live = carve(p, capacity * sizeof(struct rrd_live));
+    plugin->pos = carve(p, capacity * sizeof(int32_t));
+    plugin->meta = carve(p, capacity * sizeof(struct rrd_meta));
+    plugin->zeros = carve(p, (capacity + 1) * sizeof(uint32_t));
+    plugin->values = carve(p, capacity * sizeof(int64_t));
+    index = carve(p, rrd_index_bytes(capacity));
+    plugin->store = carve(p, store_size(capacity));
+    plugin->store_size = store_size(capacity);
+    plugin->store_heap = 0;
+    return index;
+}
+
+/*
+ * Double the number of slots of a plugin opened with rrd_open_sized().
+ * They move to a new chunk of memory together with the index and the
+ * store; the old chunk is freed.
+ */
+static int
+grow(RRD_PLUGIN * plugin)
+{
+    size_t          capacity = 2 * plugin->capacity;
+    RRD_PLUGIN      old = *plugin;
+    char           *body;
+    char           *p;
+    void           *index;
+
+    if (capacity > INT32_MAX || !plugin->grows) {
+        return -1;
+    }
+    body = calloc(1, layout_size(capacity));
+    if (!body) {
+        return -1;
+    }
+    /*
+     * the tables of timing and history only grow; a larger one is
+     * harmless should the plugin stay as it is
+     */
+    if ((plugin->watch && rrd_timing_resize(plugin, capacity) != 0)
+        || (plugin->history && rrd_history_resize(plugin, capacity) != 0)) {
+        free(body);
+        return -1;
+    }
+    p = body;
+    index = layout(plugin, &p, capacity);
+    memcpy(plugin->sources, old.sources, old.capacity * sizeof(RRD_SOURCE *));
+    memcpy(plugin->next_free, old.next_free, old.capacity * sizeof(int32_t));
+    memcpy(plugin->live, old.live, old.n * sizeof(struct rrd_live));
+    memcpy(plugin->pos, old.pos, old.capacity * sizeof(int32_t));
+    memcpy(plugin->meta, old.meta, old.capacity * sizeof(struct rrd_meta));
+    plugin->store_used = 0;
+    plugin->body = body;
+    if (old.store_heap)
+        free(old.store);
+    free(old.body);
+    invalidate(plugin);
+
+    free_slots(plugin, old.capacity, capacity);
+    plugin->capacity = capacity;
+    rrd_index_place(plugin, index);
     return 0;
 }
 
 /*
  * rrd_open creates the data structure that represents a plugin with
  * initially no data source. Data sources will be added later by rrd_add_src.
+ * Its capacity is fixed, as RRDD does not notice when the file grows.
  */
 RRD_PLUGIN     *
 rrd_open(char *name, rrd_domain_t domain, char *path)
+{
+    RRD_PLUGIN     *plugin = rrd_open_sized(name, domain, path,
+                                            RRD_MAX_SOURCES);
+    if (plugin)
+        plugin->grows = 0;
+    return plugin;
+}
+
+/*
+ * Create the file of a new plugin and write its initial buffer to it.
+ */
+static int
+create_file(RRD_PLUGIN * plugin)
+{
+    if (initialise(plugin) != 0) {
+        return -1;
+    }
+    plugin->file = open(plugin->path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (plugin->file == -1) {
+        return -1;
+    }
+    if (write_exact(plugin->file, plugin->buf, plugin->buf_size) != 0) {
+        close(plugin->file);
+        return -1;
+    }
+    plugin->dirty = 0;
+    return 0;
+}
+
+RRD_PLUGIN     *
+rrd_open_sized(char *name, rrd_domain_t domain, char *path,
+               size_t capacity)
 {
     assert(name);
     assert(path);
 
-    RRD_PLUGIN     *plugin = malloc(sizeof(RRD_PLUGIN));
-    if (!plugin) {
+    if (capacity == 0 || capacity > INT32_MAX) {
         return NULL;
     }
+    /*
+     * the slots, index, and store are allocated apart from the plugin
+     * such that grow() can replace them
+     */
+    RRD_PLUGIN     *plugin = calloc(1, sizeof(RRD_PLUGIN));
+    char           *body = calloc(1, layout_size(capacity));
+    char           *p = body;
+    void           *index;
+
+    if (!plugin || !body) {
+        free(plugin);
+        free(body);
+        return NULL;
+    }
+    index = layout(plugin, &p, capacity);
+    plugin->body = body;
     plugin->name = name;
     plugin->path = path;
     plugin->domain = domain;
     /*
      * mark all slots for data sources as free
      */
-    for (int i = 0; i < RRD_MAX_SOURCES; i++) {
-        plugin->sources[i] = (RRD_SOURCE *) NULL;
-    }
+    plugin->capacity = capacity;
+    plugin->grows = 1;
+    plugin->free = -1;
+    free_slots(plugin, 0, capacity);
+    rrd_index_place(plugin, index);
     plugin->n = 0;
     plugin->buf_size = 0;
     plugin->buf = NULL;
-    plugin->meta = NULL;
+    plugin->hf = NULL;
+    plugin->hist = NULL;
+    plugin->counters = NULL;
+    plugin->watch = NULL;
+    plugin->groups = NULL;
+    plugin->group_files = NULL;
+    plugin->rcu = NULL;
 
-    if (initialise(plugin) != 0) {
-        invalidate(plugin);
-        free(plugin);
+    if (create_file(plugin) != 0) {
+        plugin_free(plugin);
         return NULL;
     }
-    plugin->file = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (plugin->file == -1) {
-        invalidate(plugin);
-        free(plugin);
+    return plugin;
+}
+
+/*
+ * bytes of static storage used by a plugin with capacity slots, after
+ * aligning its start
+ */
+static size_t
+static_size(size_t capacity)
+{
+    return align16(sizeof(RRD_PLUGIN)) + layout_size(capacity)
+        + align16(capacity * RRD_JSON_PER_SOURCE);
+}
+
+RRD_PLUGIN     *
+rrd_open_static(char *name, rrd_domain_t domain, char *path,
+                void *storage, size_t size)
+{
+    assert(name);
+    assert(path);
+    assert(storage);
+    RRD_PLUGIN     *plugin;
+    size_t          capacity;
+    char           *arena;
+    void           *index;
+    char           *p;
+
+    if (size < RRD_STATIC_SIZE(1)) {
         return NULL;
     }
-    if (write_exact(plugin->file, plugin->buf, plugin->buf_size) != 0) {
-        invalidate(plugin);
-        free(plugin);
+    capacity = (size - RRD_STATIC_BASE) / RRD_STATIC_PER_SOURCE;
+    if (capacity > INT32_MAX) {
+        capacity = INT32_MAX;
+    }
+    p = (char *)(((uintptr_t) storage + 15) & ~(uintptr_t) 15);
+    /*
+     * RRD_STATIC_BASE and RRD_STATIC_PER_SOURCE are meant to cover the
+     * layout; if they don't, take fewer slots rather than write past
+     * the storage
+     */
+    while (capacity > 0
+           && (size_t) (p - (char *)storage) + static_size(capacity) > size)
+        capacity--;
+    if (capacity == 0) {
+        return NULL;
+    }
+    plugin = carve(&p, sizeof(RRD_PLUGIN));
+    memset(plugin, 0, sizeof(RRD_PLUGIN));
+    plugin->name = name;
+    plugin->path = path;
+    plugin->domain = domain;
+    plugin->capacity = capacity;
+    plugin->fixed = 1;
+    index = layout(plugin, &p, capacity);
+    /*
+     * the storage may have been used before
+     */
+    plugin->store_used = plugin->store_size;
+    arena = carve(&p, capacity * RRD_JSON_PER_SOURCE);
+    for (size_t i = 0; i < capacity; i++) {
+        plugin->meta[i].json = arena + i * RRD_JSON_PER_SOURCE;
+    }
+    plugin->free = -1;
+    free_slots(plugin, 0, capacity);
+    rrd_index_place(plugin, index);
+    assert(p <= (char *)storage + size);
+    if (create_file(plugin) != 0) {
         return NULL;
     }
     return plugin;
@@ -369,115 +888,275 @@ rrd_close(RRD_PLUGIN * plugin)
     rc = close(plugin->file);
     if (rc == 0)
         rc = unlink(plugin->path);
-    invalidate(plugin);
-    free(plugin);
+    rrd_group_close_all(plugin);
+    rrd_hf_close(plugin);
+    rrd_hist_close(plugin);
+    rrd_counter_close(plugin);
+    rrd_set_timing(plugin, RRD_TIMING_OFF);
+    rrd_set_concurrent(plugin, 0);
+    if (plugin->record)
+        rrd_record_stop(plugin);
+    rrd_set_history(plugin, 0);
+    plugin_free(plugin);
     return (rc == 0 ? RRD_OK : RRD_FILE_ERROR);
 }
 /*
- * Add a new data source to a plugin. It is inserted into the first free slot
- * available.
+ * Add a new data source to a plugin. It is inserted into the first slot
+ * on the free list. When all slots are used, their number is doubled.
  */
 int
 rrd_add_src(RRD_PLUGIN * plugin, RRD_SOURCE * source)
 {
-    assert(plugin);
-    assert(source);
+    rrd_handle_t    handle;
+    return rrd_add_src_handle(plugin, source, &handle);
+}
+
+int
+rrd_add_src_handle(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                   rrd_handle_t * handle)
+{
+    return rrd_add_src_owned(plugin, source, NULL, handle);
+}
+
+static int      del_src(RRD_PLUGIN * plugin, rrd_handle_t handle);
 
+static int
+add_src(RRD_PLUGIN * plugin, RRD_SOURCE * source, const char *uuid,
+        rrd_handle_t * handle)
+{
     /*
-     * find free slot
+     * take free slot
      */
-    size_t          i;
-    for (i = 0; i < RRD_MAX_SOURCES; i++) {
-        if (plugin->sources[i] == NULL)
-            break;
-    }
-    if (i >= RRD_MAX_SOURCES) {
+    int32_t         i;
+    if (plugin->free < 0 && grow(plugin) != 0) {
         return RRD_TOO_MANY_SOURCES;
     }
+    i = plugin->free;
     plugin->sources[i] = source;
+    if (rrd_index_insert(plugin, i) != 0) {
+        plugin->sources[i] = NULL;
+        return RRD_DUPLICATE_SOURCE;
+    }
+    if (render_source(plugin, i, uuid) != 0) {
+        rrd_index_remove(plugin, i);
+        plugin->sources[i] = NULL;
+        return RRD_ERROR;
+    }
+    plugin->free = plugin->next_free[i];
+    plugin->live[plugin->n].sample = source->sample;
+    plugin->live[plugin->n].userdata = source->userdata;
+    plugin->live[plugin->n].slot = i;
+    plugin->pos[i] = plugin->n;
     plugin->n++;
+    if (plugin->watch)
+        rrd_timing_reset(plugin, i);
     invalidate(plugin);
 
+    *handle = i;
     return RRD_OK;
 }
 
 /*
- * Remove a previously registered data source from a plugin,
+ * Like rrd_add_src_handle(); uuid is reported as the owner_uuid of a
+ * source that has none.
+ */
+int
+rrd_add_src_owned(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                  const char *uuid, rrd_handle_t * handle)
+{
+    assert(plugin);
+    assert(source);
+    assert(source->name);
+    assert(handle);
+    struct rrd_snap *snap;
+    int             rc;
+
+    rrd_rcu_lock(plugin);
+    rc = add_src(plugin, source, uuid, handle);
+    if (rc == RRD_OK && plugin->rcu) {
+        snap = rrd_snapshot(plugin);
+        if (snap) {
+            rrd_rcu_publish(plugin, snap, 0);
+        } else {
+            del_src(plugin, *handle);
+            rc = RRD_ERROR;
+        }
+    }
+    rrd_rcu_unlock(plugin);
+    return rc;
+}
+
+/*
+ * Remove a previously registered data source from a plugin. The slot is
+ * found by the name of the source. A source that is not in a slot may
+ * have been added as a high-frequency, histogram, or counter source;
+ * its name then refers to a derived source in a slot, or none.
  */
 int
 rrd_del_src(RRD_PLUGIN * plugin, RRD_SOURCE * source)
 {
     assert(source);
-    size_t          i;
-    /*
-     * find slot with source
-     */
-    for (i = 0; i < RRD_MAX_SOURCES; i++) {
-        if (plugin->sources[i] == source)
-            break;
+    int32_t         i;
+    int             rc;
+
+    rrd_rcu_lock(plugin);
+    i = rrd_index_find(plugin, source->name);
+    if (i >= 0 && plugin->sources[i] == source) {
+        rc = rrd_del_src_handle(plugin, i);
+        rrd_rcu_unlock(plugin);
+        return rc;
     }
-    if (i >= RRD_MAX_SOURCES) {
+    rrd_rcu_unlock(plugin);
+    rc = rrd_hf_del(plugin, source);
+    if (rc == RRD_NO_SUCH_SOURCE)
+        rc = rrd_hist_del(plugin, source);
+    if (rc == RRD_NO_SUCH_SOURCE)
+        rc = rrd_counter_del(plugin, source);
+    return rc;
+}
+
+RRD_SOURCE     *
+rrd_find_src(RRD_PLUGIN * plugin, const char *name)
+{
+    assert(plugin);
+    assert(name);
+    RRD_SOURCE     *source;
+    int32_t         i;
+
+    rrd_rcu_lock(plugin);
+    i = rrd_index_find(plugin, name);
+    source = i < 0 ? NULL : plugin->sources[i];
+    rrd_rcu_unlock(plugin);
+    return source;
+}
+
+static int
+del_src(RRD_PLUGIN * plugin, rrd_handle_t handle)
+{
+    int32_t         last;
+
+    if (handle < 0 || (size_t) handle >= plugin->capacity
+        || plugin->sources[handle] == NULL) {
         return RRD_NO_SUCH_SOURCE;
     }
-    plugin->sources[i] = NULL;
+    rrd_index_remove(plugin, handle);
+    if (!plugin->fixed)
+        free(plugin->meta[handle].json);
+    plugin->sources[handle] = NULL;
+    plugin->next_free[handle] = plugin->free;
+    plugin->free = handle;
     plugin->n--;
+    last = plugin->live[plugin->n].slot;
+    plugin->live[plugin->pos[handle]] = plugin->live[plugin->n];
+    plugin->pos[last] = plugin->pos[handle];
+    if (plugin->history)
+        rrd_history_reset(plugin, handle);
     invalidate(plugin);
 
     return RRD_OK;
 }
 
 /*
- * Sample obtains a values form all data sources by calling their sample
- * functions. It updates the buffer with all data and writes it out. If there
- * is no meta data it means it was invalidated previously because a data
- * source was added or removed. In that case in creates a new buffer first.
+ * Remove the data source in slot handle and put the slot on the free
+ * list. The last source in use takes the place of the removed one. In
+ * concurrent mode, wait until the sampler no longer uses the source.
+ * The memory of the snapshot without the source is reserved first, such
+ * that a source is not removed unless the snapshot is replaced.
  */
 int
-rrd_sample(RRD_PLUGIN * plugin, time_t(*t) (time_t *))
+rrd_del_src_handle(RRD_PLUGIN * plugin, rrd_handle_t handle)
 {
     assert(plugin);
-    int             n = 0;
-    int64_t        *p;
-    RRD_HEADER     *header;
+    struct rrd_snap *reserve = NULL;
+    struct rrd_snap *snap;
+    int             rc;
 
-    if (plugin->buf == NULL) {
-        int             rc;
-        rc = initialise(plugin);
-        if (rc != 0) {
+    rrd_rcu_lock(plugin);
+    if (plugin->rcu) {
+        reserve = malloc(snapshot_size(plugin));
+        if (!reserve) {
+            rrd_rcu_unlock(plugin);
             return RRD_ERROR;
         }
     }
-    assert(plugin->buf);
-    header = (RRD_HEADER *) plugin->buf;
+    rc = del_src(plugin, handle);
+    if (rc == RRD_OK && plugin->rcu) {
+        snap = snapshot(plugin, reserve);
+        if (snap) {
+            rrd_rcu_publish(plugin, snap, 1);
+            reserve = NULL;
+        } else {
+            /*
+             * the clock failed; the old snapshot stays
+             */
+            rc = RRD_ERROR;
+        }
+    }
+    free(reserve);
+    rrd_rcu_unlock(plugin);
+    return rc;
+}
 
-    /*
-     * sample n sources and write values to buffer
-     */
-    p = (int64_t *) (plugin->buf + sizeof(RRD_HEADER));
-    for (size_t i = 0; i < RRD_MAX_SOURCES; i++) {
-        void *userdata;
-        if (plugin->sources[i] == NULL)
-            continue;
-        userdata = plugin->sources[i]->userdata;
+/*
+ * Sample the n sources in live, write their values to buf, and write
+ * buf to the file of the plugin. Unless the buffer was re-created
+ * (*dirty), the file already contains the meta data and only the header
+ * and values need to be written.
+ *
+ * The values are collected in native byte order in values, which holds
+ * the values of the previous sample, and are then converted to
+ * big-endian into buf while their checksum is computed, in a single
+ * vectorised pass.
+ *
+ * With RRD_CHECKSUM_INCREMENTAL, the checksum of the previous sample in
+ * buf is updated for each value that changed and the timestamp. This
+ * costs as much as computing the checksum of a few hundred values
+ * (depending on the CPU), so the checksum is computed anew when more
+ * than CRC_DELTA_MAX in 1024 values changed, and always for fewer than
+ * 1024 values.
+ */
+#define CRC_DELTA_MAX 4
+
+static int
+write_sample(RRD_PLUGIN * plugin, char *buf, size_t buf_size,
+             struct rrd_live *live, int64_t * values, uint32_t n,
+             int *dirty, double timestamp)
+{
+    RRD_HEADER     *header = (RRD_HEADER *) buf;
+    char           *p = buf + sizeof(RRD_HEADER);
+    int             timed = plugin->watch && !plugin->rcu;
+    uint32_t        limit = n / 1024 * CRC_DELTA_MAX;
+    int             delta = plugin->checksum == RRD_CHECKSUM_INCREMENTAL
+        && !plugin->rcu && !*dirty && limit > 0;
+    uint32_t        changed = 0;
+    uint32_t        crc = ntohl(header->rrd_checksum_value);
+    int64_t         ts;
 
-        rrd_value_t     v = plugin->sources[i]->sample(userdata);
-        *p++ = htonll((uint64_t) v.int64);
-        n++;
-    }
     /*
-     * must have sampled exactly n data sources
+     * sample n sources
      */
-    assert(n == plugin->n);
+    for (uint32_t i = 0; i < n; i++) {
+        rrd_value_t     v = timed ? rrd_timing_sample(plugin, &live[i])
+            : live[i].sample(live[i].userdata);
+        if (delta && v.int64 != values[i] && ++changed <= limit)
+            crc ^= rrd_crc32_delta(plugin->zeros[i + 1],
+                                   htonll((uint64_t) (v.int64 ^ values[i])));
+        values[i] = v.int64;
+    }
 
     /*
-     * update timestamp, calculate crc
+     * update timestamp, write values to buffer, calculate crc
      */
-
-    header->rrd_timestamp = htonll(bits_of_double(get_timestamp()));
-    uint32_t        crc = crc32(0L, Z_NULL, 0);
-    crc = crc32(crc,
-                (unsigned char *)&header->rrd_timestamp,
-                (n + 1) * sizeof(int64_t));
+    ts = htonll(bits_of_double(timestamp));
+    if (delta && changed <= limit) {
+        crc ^= rrd_crc32_delta(plugin->zeros[0], ts ^ header->rrd_timestamp);
+        header->rrd_timestamp = ts;
+        rrd_bswap64(p, values, n);
+    } else {
+        header->rrd_timestamp = ts;
+        crc = rrd_crc32(0, &header->rrd_timestamp, sizeof(int64_t));
+        crc = rrd_crc32_bswap64(crc, p, values, n);
+    }
     header->rrd_checksum_value = htonl(crc);
 
     /*
@@ -486,8 +1165,100 @@ rrd_sample(RRD_PLUGIN * plugin, time_t(*t) (time_t *))
     if (lseek(plugin->file, 0, SEEK_SET) < 0) {
         return RRD_FILE_ERROR;
     }
-    if (write_exact(plugin->file, plugin->buf, plugin->buf_size) != 0) {
+    size_t          size = *dirty ? buf_size
+        : sizeof(RRD_HEADER) + n * sizeof(int64_t);
+    if (write_exact(plugin->file, buf, size) != 0) {
         return RRD_FILE_ERROR;
     }
+    *dirty = 0;
+    if (plugin->record) {
+        char           *meta = p + n * sizeof(int64_t);
+        uint32_t        meta_size;
+        memcpy(&meta_size, meta, sizeof(meta_size));
+        return rrd_record_sample(plugin, timestamp,
+                                 ntohl(header->rrd_checksum_meta),
+                                 buf + MAGIC_SIZE,
+                                 sizeof(RRD_HEADER) - MAGIC_SIZE
+                                 + n * sizeof(int64_t), meta,
+                                 sizeof(uint32_t) + ntohl(meta_size));
+    }
+    return RRD_OK;
+}
+
+int
+rrd_set_checksum(RRD_PLUGIN * plugin, int mode)
+{
+    assert(plugin);
+
+    if (mode != RRD_CHECKSUM_FULL && mode != RRD_CHECKSUM_INCREMENTAL) {
+        return RRD_ERROR;
+    }
+    rrd_rcu_lock(plugin);
+    plugin->checksum = mode;
+    invalidate(plugin);
+    rrd_rcu_unlock(plugin);
     return RRD_OK;
 }
+
+int
+rrd_set_clock(RRD_PLUGIN * plugin, int clock)
+{
+    assert(plugin);
+
+    if (clock != RRD_CLOCK_PRECISE && clock != RRD_CLOCK_COARSE) {
+        return RRD_ERROR;
+    }
+    plugin->clock = clock;
+    return RRD_OK;
+}
+
+/*
+ * Sample obtains a values form all data sources by calling their sample
+ * functions. It updates the buffer with all data and writes it out. If there
+ * is no buffer it means it was invalidated previously because a data
+ * source was added or removed. In that case in creates a new buffer first.
+ */
+int
+rrd_sample(RRD_PLUGIN * plugin, time_t(*t) (time_t *))
+{
+    return rrd_sample_at(plugin, rrd_clock(plugin->clock));
+}
+
+/*
+ * Like rrd_sample() with the timestamp given in seconds since the epoch.
+ * Groups of the plugin with a file of their own are sampled first; their
+ * first error is returned if the plugin itself was sampled fine.
+ */
+int
+rrd_sample_at(RRD_PLUGIN * plugin, double timestamp)
+{
+    assert(plugin);
+    int             groups_rc = RRD_OK;
+    int             rc;
+
+    if (plugin->group_files)
+        groups_rc = rrd_group_sample(plugin, timestamp);
+    if (plugin->hf)
+        rrd_hf_publish(plugin);
+    if (plugin->hist)
+        rrd_hist_publish(plugin);
+
+    if (plugin->rcu) {
+        struct rrd_snap *snap = rrd_rcu_enter(plugin);
+        rc = snap ? write_sample(plugin, snap->buf, snap->buf_size,
+                                 snap->live, snap->values, snap->n,
+                                 &snap->dirty, timestamp)
+            : RRD_ERROR;
+        rrd_rcu_exit(plugin);
+    } else {
+        if (plugin->buf == NULL && initialise(plugin) != 0) {
+            return RRD_ERROR;
+        }
+        rc = write_sample(plugin, plugin->buf, plugin->buf_size,
+                          plugin->live, plugin->values, plugin->n,
+                          &plugin->dirty, timestamp);
+        if (plugin->history)
+            rrd_history_sample(plugin, timestamp);
+    }
+    return rc == RRD_OK ? groups_rc : rc;
+}
@@ -21,8 +21,11 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#ifndef LIBRRD_H
+#define LIBRRD_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/time.h>
 
 #define RRD_MAX_SOURCES         16
@@ -32,6 +35,9 @@
 #define RRD_NO_SUCH_SOURCE      2
 #define RRD_FILE_ERROR          3
 #define RRD_ERROR               4
+#define RRD_NO_SUCH_PLUGIN      5
+#define RRD_DUPLICATE_SOURCE    6
+#define RRD_CHECKSUM_ERROR      7
 
 /* rrd_domain_t */
 typedef int32_t rrd_domain_t;
@@ -70,7 +76,9 @@ typedef union {
  * sample() function to obtain such values. Strings are expected
  * to be in UTF8 encoding. Part of an RRD_SOURCE is a pointer userdata
  * that is passed to sample(). This allows to share a single sample
- * function across several RRD_SOURCE values.
+ * function across several RRD_SOURCE values. The fields of a source
+ * are read when it is added and must not be changed while it is part of
+ * a plugin; only the name must remain valid.
  */
 typedef struct rrd_source {
     char           *name;       /* name of the data source */
@@ -88,6 +96,7 @@ typedef struct rrd_source {
     rrd_type_t      type;       /* type of value */
 } RRD_SOURCE;
 typedef struct rrd_plugin RRD_PLUGIN;
+typedef struct rrd_group RRD_GROUP;
 
 /*
  * Memory management policy: the library does not free the memory of any
@@ -97,7 +106,8 @@ typedef struct rrd_plugin RRD_PLUGIN;
  */
 
 /*
- * rrd_open - register a new plugin
+ * rrd_open - register a new plugin with room for RRD_MAX_SOURCES data
+ * sources; rrd_add_src returns RRD_TOO_MANY_SOURCES beyond that.
  * name: name of the plugin in UTF8 encoding.
  * domain: INTER_DOMAIN if it reports data from multiple domains
  * path: file path where the plugin writes it samples
@@ -106,6 +116,46 @@ typedef struct rrd_plugin RRD_PLUGIN;
  */
 RRD_PLUGIN     *rrd_open(char *name, rrd_domain_t domain, char *path);
 
+/*
+ * rrd_open_sized - like rrd_open but with room for capacity data sources
+ * initially. The size of the file written by the plugin is proportional
+ * to its capacity. When more sources are added, the capacity is doubled
+ * and the file grows, which RRDD does not notice: a plugin read by RRDD
+ * must be opened with the capacity it needs.
+ * returns:
+ * NULL on error
+ */
+RRD_PLUGIN     *rrd_open_sized(char *name, rrd_domain_t domain, char *path,
+                               size_t capacity);
+
+/*
+ * rrd_open_static - like rrd_open_sized but the plugin lives in storage
+ * of size bytes provided by the caller, which must not be used otherwise
+ * until rrd_close; nothing is written beyond size bytes. The capacity is
+ * fixed: it is the largest n for which RRD_STATIC_SIZE(n) fits into size
+ * bytes (or less if the plugin needs more room), and rrd_add_src returns
+ * RRD_TOO_MANY_SOURCES rather than growing the plugin. The meta data of
+ * a source is limited to RRD_STATIC_JSON bytes; rrd_add_src returns
+ * RRD_ERROR for a larger one. Adding, removing, and sampling sources
+ * does not allocate memory on the heap; high-frequency, histogram,
+ * counter, and group sources and timing do. The concurrent mode is not
+ * supported. Example:
+ *
+ *   static char storage[RRD_STATIC_SIZE(32)];
+ *   plugin = rrd_open_static("agent", RRD_LOCAL_DOMAIN, path,
+ *                            storage, sizeof storage);
+ * returns:
+ * NULL on error or when size is less than RRD_STATIC_SIZE(1)
+ */
+#define RRD_STATIC_JSON         2048
+#define RRD_STATIC_BASE         1024
+#define RRD_STATIC_PER_SOURCE   (2 * RRD_STATIC_JSON + 256)
+#define RRD_STATIC_SIZE(n) \
+    (RRD_STATIC_BASE + (size_t)(n) * RRD_STATIC_PER_SOURCE)
+
+RRD_PLUGIN     *rrd_open_static(char *name, rrd_domain_t domain, char *path,
+                                void *storage, size_t size);
+
 /*
  * rrd_close - close a plugin. Data sources do not need to be removed
  * from the plugin before calling rrd_close.
@@ -113,12 +163,12 @@ RRD_PLUGIN     *rrd_open(char *name, rrd_domain_t domain, char *path);
 int             rrd_close(RRD_PLUGIN * plugin);
 
 /*
- * rrd_add_src - add a new data source returns: error code At most
- * RRD_MAX_SOURCES can be active. It is an unchecked error to register the
- * same source multiple times. The name of the source must be unique for
- * all sources added to a plugin.
- *
- *
+ * rrd_add_src - add a new data source returns: error code. The capacity
+ * of a plugin opened with rrd_open_sized grows as needed;
+ * RRD_TOO_MANY_SOURCES is returned when it can't. The name of the
+ * source must be unique for all sources added to a plugin;
+ * RRD_DUPLICATE_SOURCE is returned otherwise. This includes sources
+ * derived from high-frequency and histogram sources.
  */
 int             rrd_add_src(RRD_PLUGIN * plugin, RRD_SOURCE * source);
 
@@ -127,6 +177,33 @@ int             rrd_add_src(RRD_PLUGIN * plugin, RRD_SOURCE * source);
  */
 int             rrd_del_src(RRD_PLUGIN * plugin, RRD_SOURCE * source);
 
+/*
+ * rrd_find_src - return the data source with the given name or NULL.
+ * For a name derived from a high-frequency, histogram, or counter
+ * source, this is the source maintained by the library.
+ */
+RRD_SOURCE     *rrd_find_src(RRD_PLUGIN * plugin, const char *name);
+
+/*
+ * A handle identifies a data source within its plugin. Removing a source
+ * by handle avoids looking it up by name. A handle becomes invalid when
+ * its source is removed and may be re-used for a source added later.
+ */
+typedef int32_t rrd_handle_t;
+
+/*
+ * rrd_add_src_handle - like rrd_add_src() and also stores the handle of
+ * the new source in handle. Returns an error code.
+ */
+int             rrd_add_src_handle(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                                   rrd_handle_t * handle);
+
+/*
+ * rrd_del_src_handle - remove the data source with the given handle.
+ * Returns an error code.
+ */
+int             rrd_del_src_handle(RRD_PLUGIN * plugin, rrd_handle_t handle);
+
 /*
  * calling rrd_sample(plugin) triggers that all data sources are sampled
  * and the results are reported to the RRD daemon. This function needs
@@ -134,3 +211,453 @@ int             rrd_del_src(RRD_PLUGIN * plugin, RRD_SOURCE * source);
  * deprecated and will be ignored (and should be NULL).
  */
 int             rrd_sample(RRD_PLUGIN * plugin, time_t (*t)(time_t*));
+
+/*
+ * rrd_sample_at - like rrd_sample() but reports the given timestamp in
+ * seconds since the epoch instead of reading the clock. A client that
+ * samples several plugins together can read the clock once with
+ * rrd_clock() and stamp every file identically.
+ */
+int             rrd_sample_at(RRD_PLUGIN * plugin, double timestamp);
+
+/*
+ * rrd_clock - the current time in seconds since the epoch.
+ * RRD_CLOCK_PRECISE reads it with microsecond resolution.
+ * RRD_CLOCK_COARSE reads CLOCK_REALTIME_COARSE, which is cheaper but
+ * only advances once per timer tick (a few milliseconds); where it is
+ * not available, the precise clock is used. rrd_set_clock - choose the
+ * clock rrd_sample() reads for a plugin; the default is
+ * RRD_CLOCK_PRECISE. Returns an error code.
+ */
+#define RRD_CLOCK_PRECISE       0
+#define RRD_CLOCK_COARSE        1
+
+double          rrd_clock(int clock);
+int             rrd_set_clock(RRD_PLUGIN * plugin, int clock);
+
+/*
+ * A high-frequency source is sampled by the library more often than
+ * rrd_sample() is called, either by a sampler thread of the plugin
+ * started with rrd_hf_start() or whenever the client calls
+ * rrd_hf_tick(). Between two calls of rrd_sample() the library keeps
+ * the minimum, maximum, mean, and last value sampled. The last value is
+ * reported under the name of the source; the others are reported as
+ * companion sources named <name>_min, <name>_max, and <name>_mean, as
+ * selected by a combination of the flags below. The mean is always of
+ * type RRD_FLOAT64. Only sources of scale RRD_GAUGE can be added as
+ * high-frequency sources and their sample() function must be
+ * thread-safe if a sampler thread is used. A high-frequency source is
+ * removed with rrd_del_src(). Each companion occupies a slot in the
+ * plugin.
+ */
+#define RRD_HF_MIN              (1 << 0)
+#define RRD_HF_MAX              (1 << 1)
+#define RRD_HF_MEAN             (1 << 2)
+
+/*
+ * rrd_add_hf_src - add a high-frequency source together with the
+ * companion sources selected by companions. Returns an error code.
+ */
+int             rrd_add_hf_src(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                               int companions);
+
+/*
+ * rrd_hf_start - start a thread that samples all high-frequency sources
+ * of plugin every interval seconds. Returns an error code.
+ */
+int             rrd_hf_start(RRD_PLUGIN * plugin, double interval);
+
+/*
+ * rrd_hf_stop - stop the sampler thread. rrd_close() stops it as well.
+ */
+int             rrd_hf_stop(RRD_PLUGIN * plugin);
+
+/*
+ * rrd_hf_tick - sample all high-frequency sources once. For clients that
+ * drive the sampling from their own timer instead of rrd_hf_start().
+ */
+int             rrd_hf_tick(RRD_PLUGIN * plugin);
+
+/*
+ * A histogram source reports percentiles of values recorded with
+ * rrd_hist_record(), which may be called from any thread without
+ * locking. Values are unsigned integers (like latencies in
+ * microseconds); a reported percentile is within 1.6% of the true
+ * value. For every percentile p (0 <= p <= 100) the plugin reports a
+ * source named <name>_p<p>, like request_latency_p99. Its type (integer
+ * or float) is taken from source; the sample() function of source is
+ * not used. At every rrd_sample() the counts of the past interval are
+ * added to the counts of all previous intervals, which are weighted by
+ * decay (0 <= decay < 1) first; a decay of 0 reports the percentiles of
+ * the past interval only. A histogram source is removed with
+ * rrd_del_src(), after which its RRD_HIST must no longer be used.
+ */
+typedef struct rrd_hist RRD_HIST;
+
+/*
+ * rrd_add_hist_src - add a histogram source reporting the n percentiles
+ * in the array percentiles. Each percentile occupies a slot in the
+ * plugin.
+ * returns:
+ * NULL on error
+ */
+RRD_HIST       *rrd_add_hist_src(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                                 const double *percentiles, size_t n,
+                                 double decay);
+
+/*
+ * rrd_hist_record - record a value; wait-free.
+ */
+void            rrd_hist_record(RRD_HIST * hist, uint64_t value);
+
+/*
+ * A counter source is updated by the client with rrd_counter_add()
+ * instead of being sampled. It is meant for RRD_ABSOLUTE and RRD_DERIVE
+ * sources of type RRD_INT64 that are updated by many threads at a high
+ * rate: the counter is split into per-CPU shards that live in separate
+ * cache lines and are summed up when the plugin is sampled. The
+ * sample() function of source is not used. A counter source is removed
+ * with rrd_del_src(), after which its RRD_COUNTER must no longer be
+ * used.
+ */
+typedef struct rrd_counter RRD_COUNTER;
+
+/*
+ * rrd_add_counter_src - add a counter source with initial value 0.
+ * returns:
+ * NULL on error
+ */
+RRD_COUNTER    *rrd_add_counter_src(RRD_PLUGIN * plugin,
+                                    RRD_SOURCE * source);
+
+/*
+ * rrd_counter_add - add delta to a counter; may be called from any
+ * thread.
+ */
+void            rrd_counter_add(RRD_COUNTER * counter, int64_t delta);
+
+/*
+ * Timing of sample() functions. When enabled, rrd_sample() measures
+ * how long each call of a sample() function takes and keeps statistics
+ * for every source. All durations are in nanoseconds. RRD_TIMING_COARSE
+ * uses a clock that is cheaper to read but only has a resolution of a
+ * few milliseconds, where there is one (CLOCK_MONOTONIC_COARSE), and
+ * the precise clock otherwise. A watchdog hook is called from within
+ * rrd_sample() right after a sample() function took longer than a
+ * threshold.
+ */
+#define RRD_TIMING_OFF          0
+#define RRD_TIMING_PRECISE      1
+#define RRD_TIMING_COARSE       2
+
+typedef struct rrd_timing {
+    uint64_t        count;      /* number of calls timed */
+    uint64_t        last;       /* duration of the last call */
+    uint64_t        min;
+    uint64_t        max;
+    uint64_t        ewma;       /* moving average, weight 1/8 */
+} RRD_TIMING;
+
+typedef void    (*rrd_watchdog_t) (RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                                   uint64_t duration, void *userdata);
+
+/*
+ * rrd_set_timing - enable timing with one of the clocks above or
+ * disable it with RRD_TIMING_OFF, which discards all statistics.
+ * Returns an error code.
+ */
+int             rrd_set_timing(RRD_PLUGIN * plugin, int mode);
+
+/*
+ * rrd_set_watchdog - call hook for every sample() call that takes longer
+ * than threshold (> 0) nanoseconds. A NULL hook removes the watchdog.
+ * Timing must be enabled. Returns an error code.
+ */
+int             rrd_set_watchdog(RRD_PLUGIN * plugin, uint64_t threshold,
+                                 rrd_watchdog_t hook, void *userdata);
+
+/*
+ * rrd_get_timing - copy the statistics for a source added with
+ * rrd_add_src() into timing. Returns an error code.
+ */
+int             rrd_get_timing(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                               RRD_TIMING * timing);
+
+/*
+ * rrd_set_checksum - choose how rrd_sample computes the checksum of the
+ * values. RRD_CHECKSUM_FULL, the default, computes it over all values.
+ * RRD_CHECKSUM_INCREMENTAL updates the checksum of the previous sample
+ * with the values that changed since, which is cheaper for a plugin with
+ * many sources of which few change between samples; when many change,
+ * the checksum is computed over all values. Both modes produce the same
+ * checksum. The concurrent mode always uses RRD_CHECKSUM_FULL. Returns
+ * an error code.
+ */
+#define RRD_CHECKSUM_FULL       0
+#define RRD_CHECKSUM_INCREMENTAL 1
+
+int             rrd_set_checksum(RRD_PLUGIN * plugin, int mode);
+
+/*
+ * rrd_set_concurrent - enable or disable the concurrent mode. By
+ * default, a plugin must not be used by more than one thread at a time.
+ * In concurrent mode, one thread may call rrd_sample() while others add,
+ * find, and remove sources with rrd_add_src(), rrd_add_src_handle(),
+ * rrd_find_src(), rrd_del_src(), and rrd_del_src_handle(), and with the
+ * functions for groups sharing the file of the plugin. Groups with a
+ * file of their own are not covered. rrd_sample() does not take a lock;
+ * it samples the sources present when it started.
+ * Removing a source waits until rrd_sample() no longer uses it, after
+ * which it may be freed. Adding or removing high-frequency, histogram,
+ * and counter sources is not covered, and timing is not done. The mode
+ * must be changed while no other thread uses the plugin. It is not
+ * available for a plugin opened with rrd_open_static(). Returns an
+ * error code.
+ */
+int             rrd_set_concurrent(RRD_PLUGIN * plugin, int on);
+
+/*
+ * rrd_record_start - record every sample that rrd_sample() writes to
+ * the file of the plugin in the file at path as well, for offline
+ * analysis: the timestamp and values of each, and the meta data
+ * whenever its checksum changes. A recording is written through a
+ * memory mapping and flushed to disk every sync seconds of sample time,
+ * or with 0 only when it stops.
+ * rrd_record_stop - stop recording and close the file, which
+ * rrd_close() does as well. A recording that can't be written is
+ * stopped and rrd_sample() returns RRD_FILE_ERROR. Recording is started
+ * and stopped while no other thread uses the plugin. Both return an
+ * error code.
+ */
+int             rrd_record_start(RRD_PLUGIN * plugin, const char *path,
+                                 double sync);
+int             rrd_record_stop(RRD_PLUGIN * plugin);
+
+/*
+ * rrd_set_history - keep the samples of every source of the last
+ * seconds in memory, where they take one or two bytes each; 0 discards
+ * the history and stops keeping it. The history of a source is
+ * discarded when it is removed. No history is kept in concurrent mode.
+ * Timestamps are kept with millisecond resolution. Returns an error
+ * code.
+ *
+ * rrd_history_query - call cb for every sample kept of the named source
+ * with a timestamp from <= t <= to, in order, until it returns
+ * non-zero. Returns an error code.
+ */
+typedef int     (*rrd_history_t) (double timestamp, rrd_value_t value,
+                                  void *userdata);
+
+int             rrd_set_history(RRD_PLUGIN * plugin, double seconds);
+int             rrd_history_query(RRD_PLUGIN * plugin, const char *name,
+                                  double from, double to, rrd_history_t cb,
+                                  void *userdata);
+
+/*
+ * A group collects sources that come and go together, like the sources
+ * of a VM. The sources of a group are either part of the file of the
+ * plugin or, with rrd_group_open_file(), of a file of their own that is
+ * written whenever the plugin is sampled; such a file must be
+ * registered with RRDD like a plugin. The JSON meta data of a source is
+ * rendered once when it is added, so adding or removing a group does
+ * not render the meta data of other groups again; a group with its own
+ * file leaves the file of the plugin untouched. A source of a VM or SR
+ * without owner_uuid reports the owner_uuid of its group.
+ */
+
+/*
+ * rrd_group_open, rrd_group_open_file - create an empty group;
+ * owner_uuid may be NULL. Returns NULL on error.
+ */
+RRD_GROUP      *rrd_group_open(RRD_PLUGIN * plugin, const char *owner_uuid);
+RRD_GROUP      *rrd_group_open_file(RRD_PLUGIN * plugin,
+                                    const char *owner_uuid, char *path);
+
+/*
+ * rrd_group_add_src, rrd_group_del_src - like rrd_add_src() and
+ * rrd_del_src() for a group.
+ */
+int             rrd_group_add_src(RRD_GROUP * group, RRD_SOURCE * source);
+int             rrd_group_del_src(RRD_GROUP * group, RRD_SOURCE * source);
+
+/*
+ * rrd_group_close - remove a group and all its sources. Groups that are
+ * still open are closed by rrd_close(). Returns an error code.
+ */
+int             rrd_group_close(RRD_GROUP * group);
+
+/*
+ * Sources of several processes can be reported by a single plugin
+ * through a segment of shared memory with a fixed number of slots. Every
+ * process opens the segment by name (a POSIX shared memory object, like
+ * "/rrd-host"); the first one creates it. A process adds its sources to
+ * the segment and calls rrd_shm_sample() to store their values in it.
+ * One process, the publisher, opens a plugin as usual and calls
+ * rrd_shm_sync() before rrd_sample() to mirror the sources in the
+ * segment as sources of the plugin. Slots are claimed with a
+ * compare-and-swap; the owner of a slot holds a file lock on it, which
+ * the kernel drops when the owner terminates. Slots of processes that
+ * terminated without removing their sources are freed by
+ * rrd_shm_sync(); a slot stays in use as long as a child forked by its
+ * owner after claiming it lives. Where open file description locks are
+ * not available, the owner is found by its pid, which only works for
+ * processes in the pid namespace of the publisher and mistakes a new
+ * process reusing the pid of a dead owner for the owner. Each segment
+ * opened keeps a file descriptor. The publisher must close its plugin
+ * before the segment. Source names are limited to 127 bytes, other
+ * strings are truncated to fit their slot.
+ */
+typedef struct rrd_shm RRD_SHM;
+
+/*
+ * rrd_shm_open - create a segment with the given number of slots or
+ * attach to an existing one, whose size is used. Returns NULL on error.
+ */
+RRD_SHM        *rrd_shm_open(const char *name, size_t slots);
+
+/*
+ * rrd_shm_close - remove the sources of this process from the segment
+ * and detach. The segment itself persists until rrd_shm_unlink().
+ */
+int             rrd_shm_close(RRD_SHM * shm);
+int             rrd_shm_unlink(const char *name);
+
+/*
+ * rrd_shm_add_src, rrd_shm_del_src - add a source of this process to the
+ * segment and remove it. Returns an error code; RRD_TOO_MANY_SOURCES if
+ * all slots are in use. A slot holds a name of up to 127 bytes, a
+ * description of up to 255 bytes, and an owner_uuid, units, min, and
+ * max of up to 47 bytes each; RRD_ERROR is returned for a source with a
+ * longer one.
+ */
+int             rrd_shm_add_src(RRD_SHM * shm, RRD_SOURCE * source);
+int             rrd_shm_del_src(RRD_SHM * shm, RRD_SOURCE * source);
+
+/*
+ * rrd_shm_sample - sample the sources of this process into the segment.
+ */
+int             rrd_shm_sample(RRD_SHM * shm);
+
+/*
+ * rrd_shm_sync - make the sources of plugin match the sources in the
+ * segment. Called by the publisher. Returns the error of the first slot
+ * that could not be mirrored, like RRD_DUPLICATE_SOURCE; the others are
+ * mirrored and the failed ones are tried again by the next call.
+ */
+int             rrd_shm_sync(RRD_SHM * shm, RRD_PLUGIN * plugin);
+
+/*
+ * A sharded plugin spreads its sources over n ordinary plugins, each
+ * with its own file, such that adding or removing a source only changes
+ * the meta data of one file. A source is placed by a hash of its name;
+ * the placement is stable as long as n doesn't change. Shard i is a
+ * plugin named name-i that writes to path.i; each must be registered
+ * with RRDD. Shards are opened like rrd_open_sized with a capacity of
+ * RRD_MAX_SOURCES and grow. High-frequency, histogram, and counter
+ * sources are added to the plugin returned by rrd_shard_of() for their
+ * name.
+ */
+typedef struct rrd_sharded RRD_SHARDED;
+
+/*
+ * rrd_shard_open - create a plugin with n shards. Returns NULL on
+ * error.
+ */
+RRD_SHARDED    *rrd_shard_open(char *name, rrd_domain_t domain, char *path,
+                               size_t n);
+
+/*
+ * rrd_shard_close - close all shards. Returns the first error.
+ */
+int             rrd_shard_close(RRD_SHARDED * sharded);
+
+/*
+ * rrd_shard_add_src, rrd_shard_del_src - like rrd_add_src() and
+ * rrd_del_src() for the shard of the source.
+ */
+int             rrd_shard_add_src(RRD_SHARDED * sharded, RRD_SOURCE * source);
+int             rrd_shard_del_src(RRD_SHARDED * sharded, RRD_SOURCE * source);
+
+/*
+ * rrd_shard_sample - sample all shards with the same timestamp. Returns
+ * the first error. rrd_shard_sample_at - the same with the timestamp
+ * given as for rrd_sample_at().
+ */
+int             rrd_shard_sample(RRD_SHARDED * sharded,
+                                 time_t (*t)(time_t*));
+int             rrd_shard_sample_at(RRD_SHARDED * sharded, double timestamp);
+
+/*
+ * rrd_shard_of - the shard for a source name. rrd_shard_get - shard i
+ * or NULL.
+ */
+RRD_PLUGIN     *rrd_shard_of(RRD_SHARDED * sharded, const char *name);
+RRD_PLUGIN     *rrd_shard_get(RRD_SHARDED * sharded, size_t i);
+
+/*
+ * An RRD_LOOP calls rrd_sample() for many plugins from a single thread.
+ * Each plugin has its own interval and phase: it is sampled at all
+ * points in time that are phase seconds past a multiple of interval
+ * seconds since the epoch. Samples that were missed (because the loop
+ * did not run) are skipped and not caught up. When the wall clock is
+ * set, all plugins are scheduled again from the new time on the next
+ * dispatch, which the loop's descriptor triggers. The loop does not take
+ * ownership of a plugin: plugins must be removed with rrd_loop_del()
+ * before they are closed.
+ *
+ * The loop can run in its own thread using rrd_loop_run() or it can be
+ * embedded into an existing event loop: rrd_loop_fd() returns a
+ * descriptor that becomes readable when plugins are due, at which
+ * point rrd_loop_dispatch() must be called.
+ */
+typedef struct rrd_loop RRD_LOOP;
+
+/*
+ * rrd_loop_open - create an event loop without plugins.
+ * returns:
+ * NULL on error
+ */
+RRD_LOOP       *rrd_loop_open(void);
+
+/*
+ * rrd_loop_close - release a loop. Plugins are not closed.
+ */
+int             rrd_loop_close(RRD_LOOP * loop);
+
+/*
+ * rrd_loop_add - sample plugin every interval seconds at an offset of
+ * phase seconds, where 0 <= phase < interval. It is an unchecked error
+ * to add the same plugin multiple times. Returns an error code.
+ */
+int             rrd_loop_add(RRD_LOOP * loop, RRD_PLUGIN * plugin,
+                             double interval, double phase);
+
+/*
+ * rrd_loop_del - stop sampling a plugin. Returns an error code.
+ */
+int             rrd_loop_del(RRD_LOOP * loop, RRD_PLUGIN * plugin);
+
+/*
+ * rrd_loop_fd - descriptor that is readable when rrd_loop_dispatch()
+ * needs to be called. It must not be read from or closed by the caller.
+ */
+int             rrd_loop_fd(RRD_LOOP * loop);
+
+/*
+ * rrd_loop_dispatch - sample all plugins that are due. Does not block.
+ * Returns the first error reported by rrd_sample() or RRD_OK.
+ */
+int             rrd_loop_dispatch(RRD_LOOP * loop);
+
+/*
+ * rrd_loop_run - dispatch until rrd_loop_stop() is called.
+ */
+int             rrd_loop_run(RRD_LOOP * loop);
+
+/*
+ * rrd_loop_stop - make rrd_loop_run() return. This may be called from a
+ * sample() function, another thread, or a signal handler.
+ */
+void            rrd_loop_stop(RRD_LOOP * loop);
+
+#endif                          /* LIBRRD_H */
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Declarations shared between the modules of the library. Nothing in
+ * here is part of the public interface.
+ */
+
+#include "librrd.h"
+
+struct rrd_hf;
+struct rrd_watch;
+struct rrd_index_entry;
+struct rrd_rcu;
+struct rrd_record;
+struct rrd_history;
+
+#define MAGIC "DATASOURCES"
+#define MAGIC_SIZE (sizeof (MAGIC)-1)
+
+/*
+ * The struct represents the first 31 bytes in the protocol header. Fields
+ * are not 4-byte or 8-byte aligned which is why we need the packed
+ * attribute.
+ */
+struct rrd_header {
+    uint8_t         rrd_magic[MAGIC_SIZE];
+    uint32_t        rrd_checksum_value;
+    uint32_t        rrd_checksum_meta;
+    uint32_t        rrd_header_datasources;
+    uint64_t        rrd_timestamp;
+    uint32_t        rrd_data[];/* more data follows */
+}               __attribute__((packed));
+typedef struct rrd_header RRD_HEADER;
+
+/*
+ * The sources in use, densely packed in the order their values appear
+ * in the file. sample and userdata are copied from the RRD_SOURCE when
+ * it is added such that sampling does not need to touch it.
+ */
+struct rrd_live {
+    rrd_value_t(*sample) (void *userdata);
+    void           *userdata;
+    int32_t         slot;       /* of the source */
+};
+
+/*
+ * An immutable copy of the sources in use and their buffer, sampled in
+ * concurrent mode; only the values in buf and dirty are updated by the
+ * sampler.
+ */
+struct rrd_snap {
+    char           *buf;
+    size_t          buf_size;
+    int             dirty;      /* buf is not completely in file yet */
+    uint32_t        n;
+    int64_t        *values;     /* of the last sample, native order */
+    uint64_t        retired;    /* epoch when replaced */
+    struct rrd_snap *next;      /* list of retired snapshots */
+    struct rrd_live live[];
+};
+
+/*
+ * JSON of a source as a member of the datasources object, rendered when
+ * the source is added
+ */
+struct rrd_meta {
+    char           *json;
+    size_t          len;
+};
+
+/*
+ * The type RRD_PLUGIN below is private to the implementation and entirely
+ * managed by it.
+ */
+
+struct rrd_plugin {
+    char           *name;       /* name of the plugin */
+    char           *path;       /* path to file */
+    RRD_SOURCE    **sources;    /* slots, NULL if unused */
+    size_t          capacity;   /* number of slots */
+    int32_t        *next_free;  /* links slots on the free list */
+    int32_t         free;       /* first free slot or -1 */
+    struct rrd_live *live;      /* n sources in use */
+    int32_t        *pos;        /* index into live of a used slot */
+    struct rrd_meta *meta;      /* per slot */
+    struct rrd_index_entry *index;      /* names of sources in slots */
+    size_t          index_mask; /* number of index entries - 1 */
+    char           *buf;        /* buffer where we keep protocol data */
+    char           *store;      /* memory of buf, kept when invalidated */
+    size_t          store_size; /* bytes of store */
+    size_t          store_used; /* bytes of store that may not be 0 */
+    int             store_heap; /* store was allocated on its own */
+    char           *body;       /* slots, index, store; NULL if static */
+    int             fixed;      /* plugin is in the storage of the caller */
+    int             grows;      /* capacity doubles when exceeded */
+    int             checksum;   /* RRD_CHECKSUM_FULL or _INCREMENTAL */
+    int             clock;      /* RRD_CLOCK_PRECISE or _COARSE */
+    uint32_t       *zeros;      /* per word of the values, see initialise() */
+    int64_t        *values;     /* of the last sample, native order */
+    rrd_domain_t    domain;     /* domain of this plugin */
+    uint32_t        n;          /* number of used slots */
+    size_t          buf_size;   /* size of the buffer */
+    int             file;       /* where we report data */
+    int             dirty;      /* buf is not completely in file yet */
+    struct rrd_hf  *hf;         /* high-frequency sources or NULL */
+    RRD_HIST       *hist;       /* list of histogram sources */
+    RRD_COUNTER    *counters;   /* list of counter sources */
+    struct rrd_watch *watch;    /* timing of sample() or NULL */
+    RRD_GROUP      *groups;     /* list of groups */
+    RRD_GROUP      *group_files;        /* groups with a file of their own */
+    struct rrd_rcu *rcu;        /* concurrent mode or NULL */
+    struct rrd_record *record;  /* recording or NULL */
+    struct rrd_history *history;        /* history or NULL */
+};
+
+/*
+ * librrd.c - rrd_snapshot() builds a snapshot for the concurrent mode.
+ * rrd_add_src_owned() adds a source that reports uuid unless it has an
+ * owner_uuid. get_timestamp() returns the current time in seconds
+ * since the epoch.
+ */
+struct rrd_snap *rrd_snapshot(RRD_PLUGIN * plugin);
+int             rrd_add_src_owned(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                                  const char *uuid, rrd_handle_t * handle);
+double          get_timestamp();
+
+/*
+ * rrd_crc.c - CRC-32 as computed by zlib's crc32(), which rrd_crc32()
+ * computes with the fastest implementation supported by the CPU.
+ * rrd_crc_impls lists all implementations in order of preference and
+ * ends with a NULL name; rrd_crc32_impl() returns the one in use.
+ * rrd_bswap64() stores n values as big-endian to dst, and
+ * rrd_crc32_bswap64() also returns the CRC of dst in the same pass.
+ * rrd_crc32_delta() updates a CRC for a changed word, see rrd_crc.c.
+ */
+struct rrd_crc_impl {
+    const char     *name;
+    uint32_t(*crc32) (uint32_t crc, const void *buf, size_t len);
+    uint32_t(*crc32_bswap64) (uint32_t crc, void *dst, const int64_t * src,
+                              size_t n);
+    void            (*bswap64) (void *dst, const int64_t * src, size_t n);
+    int             (*supported) (void);
+};
+extern const struct rrd_crc_impl rrd_crc_impls[];
+const struct rrd_crc_impl *rrd_crc32_impl(void);
+uint32_t        rrd_crc32(uint32_t crc, const void *buf, size_t len);
+uint32_t        rrd_crc32_bswap64(uint32_t crc, void *dst,
+                                  const int64_t * src, size_t n);
+void            rrd_bswap64(void *dst, const int64_t * src, size_t n);
+uint32_t        rrd_crc32_mult(uint32_t a, uint32_t b);
+uint32_t        rrd_crc32_zeros(size_t len);
+uint32_t        rrd_crc32_delta(uint32_t zeros, uint64_t delta);
+
+/*
+ * rrd_index.c - hash index of the names of the sources in slots.
+ * rrd_index_place() builds the index for the current number of slots in
+ * rrd_index_bytes() of memory that the index does not own.
+ * rrd_index_insert() returns -1 when the name of the source in slot is
+ * already indexed. rrd_index_find() returns the slot of the named
+ * source or -1. rrd_hash_name() is the hash function used.
+ */
+uint32_t        rrd_hash_name(const char *name);
+size_t          rrd_index_bytes(size_t capacity);
+void            rrd_index_place(RRD_PLUGIN * plugin, void *mem);
+int             rrd_index_insert(RRD_PLUGIN * plugin, int32_t slot);
+void            rrd_index_remove(RRD_PLUGIN * plugin, int32_t slot);
+int32_t         rrd_index_find(RRD_PLUGIN * plugin, const char *name);
+
+/*
+ * rrd_rcu.c - concurrent mode. Writers hold the lock, which does
+ * nothing unless the mode is enabled, and publish a new snapshot; with
+ * wait set, they wait until the sampler no longer uses older ones.
+ * rrd_sample() brackets its use of a snapshot by enter and exit.
+ */
+void            rrd_rcu_lock(RRD_PLUGIN * plugin);
+void            rrd_rcu_unlock(RRD_PLUGIN * plugin);
+void            rrd_rcu_publish(RRD_PLUGIN * plugin, struct rrd_snap *snap,
+                                int wait);
+struct rrd_snap *rrd_rcu_enter(RRD_PLUGIN * plugin);
+void            rrd_rcu_exit(RRD_PLUGIN * plugin);
+
+/*
+ * rrd_group.c - source groups. rrd_group_sample() samples the groups
+ * with a file of their own, which are kept in a list of their own such
+ * that the sampler never visits groups sharing the file of the plugin.
+ */
+int             rrd_group_sample(RRD_PLUGIN * plugin, double timestamp);
+void            rrd_group_close_all(RRD_PLUGIN * plugin);
+
+/*
+ * rrd_hf.c - consolidation of sources sampled at a high frequency.
+ * rrd_hf_publish() is called by rrd_sample() before any source is
+ * sampled; rrd_hf_del() returns RRD_NO_SUCH_SOURCE for a source that
+ * is not a high-frequency source.
+ */
+void            rrd_hf_publish(RRD_PLUGIN * plugin);
+int             rrd_hf_del(RRD_PLUGIN * plugin, RRD_SOURCE * source);
+void            rrd_hf_close(RRD_PLUGIN * plugin);
+
+/*
+ * rrd_hist.c - histogram sources. Like the functions above for
+ * high-frequency sources.
+ */
+void            rrd_hist_publish(RRD_PLUGIN * plugin);
+int             rrd_hist_del(RRD_PLUGIN * plugin, RRD_SOURCE * source);
+void            rrd_hist_close(RRD_PLUGIN * plugin);
+
+/*
+ * rrd_counter.c - sharded counter sources.
+ */
+int             rrd_counter_del(RRD_PLUGIN * plugin, RRD_SOURCE * source);
+void            rrd_counter_close(RRD_PLUGIN * plugin);
+
+/*
+ * rrd_timing.c - timing of sample() functions. rrd_timing_sample()
+ * samples the source of an entry of the live array and records how
+ * long it took.
+ * rrd_timing_resize() adjusts the statistics to capacity slots.
+ */
+rrd_value_t     rrd_timing_sample(RRD_PLUGIN * plugin,
+                                  const struct rrd_live *live);
+void            rrd_timing_reset(RRD_PLUGIN * plugin, size_t slot);
+int             rrd_timing_resize(RRD_PLUGIN * plugin, size_t capacity);
+
+/*
+ * rrd_record.c - recording of samples. rrd_record_sample() is called
+ * by rrd_sample() for every sample written while recording.
+ */
+int             rrd_record_sample(RRD_PLUGIN * plugin, double timestamp,
+                                  uint32_t meta_crc, const void *sample,
+                                  size_t sample_size, const void *meta,
+                                  size_t meta_size);
+
+/*
+ * rrd_history.c - history of the values of every source.
+ * rrd_history_sample() appends the values of the last sample.
+ * rrd_history_resize() adjusts the history to capacity slots and
+ * rrd_history_reset() discards that of a slot. rrd_history_usage()
+ * reports the number of samples kept, the bits they take, and the bytes
+ * allocated for them.
+ */
+void            rrd_history_sample(RRD_PLUGIN * plugin, double timestamp);
+int             rrd_history_resize(RRD_PLUGIN * plugin, size_t capacity);
+void            rrd_history_reset(RRD_PLUGIN * plugin, size_t slot);
+void            rrd_history_usage(RRD_PLUGIN * plugin, size_t * samples,
+                                  size_t * bits, size_t * bytes);
+
+/*
+ * rrd_loop.c - rrd_loop_skew() moves all due times by seconds, as
+ * setting the clock back does, for tests.
+ */
+void            rrd_loop_skew(RRD_LOOP * loop, double seconds);
+
+/*
+ * rrd_trace.c - sample traces for replay. rrd_trace_create() starts a
+ * new trace, to which rrd_trace_add(), rrd_trace_del(), and
+ * rrd_trace_sample() append; the values of a sample are indexed by the
+ * id under which a source was added. rrd_trace_open() opens a trace for
+ * reading with rrd_trace_next(). Strings and values of an event are
+ * valid until the next call.
+ */
+typedef struct rrd_trace RRD_TRACE;
+
+#define RRD_TRACE_ADD           'A'
+#define RRD_TRACE_DEL           'D'
+#define RRD_TRACE_SAMPLE        'S'
+
+struct rrd_trace_event {
+    int             type;       /* RRD_TRACE_ADD, _DEL, or _SAMPLE */
+    uint32_t        id;         /* of the source added or removed */
+    RRD_SOURCE     *source;     /* added, without sample function */
+    double          timestamp;  /* of the sample */
+    const int64_t  *values;     /* of the sample, indexed by id */
+    uint32_t        ids;        /* number of elements in values */
+};
+
+RRD_TRACE      *rrd_trace_create(const char *path);
+RRD_TRACE      *rrd_trace_open(const char *path);
+int             rrd_trace_close(RRD_TRACE * trace);
+int             rrd_trace_add(RRD_TRACE * trace, uint32_t id,
+                              RRD_SOURCE * source);
+int             rrd_trace_del(RRD_TRACE * trace, uint32_t id);
+int             rrd_trace_sample(RRD_TRACE * trace, double timestamp,
+                                 const int64_t * values);
+int             rrd_trace_next(RRD_TRACE * trace,
+                               struct rrd_trace_event *event);
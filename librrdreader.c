@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Reader of plugin files. The file is mapped and validated in place:
+ * the values are not copied but converted when they are used. The meta
+ * data is copied before its checksum is validated, such that a
+ * concurrent rewrite can't change it while it is parsed, and parsed in
+ * place by a parser for the subset of JSON written by librrd, because
+ * parson limits objects to 960 members. Strings are unescaped in place
+ * and the sources point into the copy.
+ *
+ * The plugin rewrites the file in place with a single write(2), which
+ * a read through the mapping may observe half done. Such a read does
+ * not validate and is retried after yielding the CPU.
+ *
+ * The descriptor is closed once the file is mapped, such that a reader
+ * does not hold one. Every read looks up the path: a file of another
+ * size is mapped again, and one that was replaced is opened again.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __APPLE__
+#include <libkern/OSByteOrder.h>
+#define be32toh(x) OSSwapBigToHostInt32(x)
+#define be64toh(x) OSSwapBigToHostInt64(x)
+#else
+#include <endian.h>
+#endif
+
+#include "librrd_private.h"
+#include "librrdreader.h"
+
+/*
+ * the layout of the header as written by librrd
+ */
+#define HEADER_SIZE     sizeof(RRD_HEADER)
+#define OFF_CRC_VALUES  offsetof(RRD_HEADER, rrd_checksum_value)
+#define OFF_CRC_META    offsetof(RRD_HEADER, rrd_checksum_meta)
+#define OFF_COUNT       offsetof(RRD_HEADER, rrd_header_datasources)
+#define OFF_TIMESTAMP   offsetof(RRD_HEADER, rrd_timestamp)
+#define JSON_DEPTH      16      /* of values that are skipped */
+
+struct rrd_reader {
+    char           *path;
+    dev_t           dev;        /* of the mapped file */
+    ino_t           ino;
+    unsigned char  *map;
+    size_t          map_size;
+    char           *meta;       /* copy, parsed in place */
+    size_t          meta_size;  /* capacity of meta */
+    uint32_t        meta_crc;
+    int             meta_valid; /* meta and sources are those of meta_crc */
+    RRD_READER_SOURCE *sources;
+    uint32_t        n_sources;
+    size_t          sources_size;       /* capacity of sources */
+    uint32_t        n;          /* values of the last read */
+    uint32_t        crc;        /* of the last read */
+    RRD_READER_STATS stats;
+};
+
+static          uint32_t
+get32(const unsigned char *p)
+{
+    uint32_t        v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static          uint64_t
+get64(const unsigned char *p)
+{
+    uint64_t        v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+/*
+ * JSON parser. Every function advances *p past what it parsed and
+ * returns -1 when the text is malformed.
+ */
+struct json {
+    char           *p;
+    char           *end;
+};
+
+static void
+json_ws(struct json *j)
+{
+    while (j->p < j->end
+           && (*j->p == ' ' || *j->p == '\n' || *j->p == '\r'
+               || *j->p == '\t'))
+        j->p++;
+}
+
+static int
+json_char(struct json *j, char c)
+{
+    json_ws(j);
+    if (j->p == j->end || *j->p != c)
+        return -1;
+    j->p++;
+    return 0;
+}
+
+static int
+hex4(const char *p, unsigned *v)
+{
+    *v = 0;
+    for (int i = 0; i < 4; i++) {
+        char            c = p[i];
+        *v <<= 4;
+        if (c >= '0' && c <= '9')
+            *v |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *v |= c - 'A' + 10;
+        else
+            return -1;
+    }
+    return 0;
+}
+
+static char    *
+utf8(char *out, unsigned c)
+{
+    if (c < 0x80) {
+        *out++ = c;
+    } else if (c < 0x800) {
+        *out++ = 0xc0 | c >> 6;
+        *out++ = 0x80 | (c & 0x3f);
+    } else if (c < 0x10000) {
+        *out++ = 0xe0 | c >> 12;
+        *out++ = 0x80 | (c >> 6 & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    } else {
+        *out++ = 0xf0 | c >> 18;
+        *out++ = 0x80 | (c >> 12 & 0x3f);
+        *out++ = 0x80 | (c >> 6 & 0x3f);
+        *out++ = 0x80 | (c & 0x3f);
+    }
+    return out;
+}
+
+/*
+ * Parse a string and unescape it in place, which never makes it longer.
+ */
+static int
+json_string(struct json *j, const char **s)
+{
+    char           *out;
+    unsigned        c;
+    unsigned        low;
+
+    if (json_char(j, '"') != 0)
+        return -1;
+    *s = out = j->p;
+    while (j->p < j->end && *j->p != '"') {
+        if (*j->p != '\\') {
+            *out++ = *j->p++;
+            continue;
+        }
+        if (j->end - j->p < 2)
+            return -1;
+        switch (j->p[1]) {
+        case '"':
+        case '\\':
+        case '/':
+            *out++ = j->p[1];
+            break;
+        case 'b':
+            *out++ = '\b';
+            break;
+        case 'f':
+            *out++ = '\f';
+            break;
+        case 'n':
+            *out++ = '\n';
+            break;
+        case 'r':
+            *out++ = '\r';
+            break;
+        case 't':
+            *out++ = '\t';
+            break;
+        case 'u':
+            if (j->end - j->p < 6 || hex4(j->p + 2, &c) != 0)
+                return -1;
+            j->p += 4;
+            if (c >= 0xd800 && c < 0xdc00 && j->end - j->p >= 8
+                && j->p[2] == '\\' && j->p[3] == 'u'
+                && hex4(j->p + 4, &low) == 0 && low >= 0xdc00
+                && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                j->p += 6;
+            }
+            out = utf8(out, c);
+            break;
+        default:
+            return -1;
+        }
+        j->p += 2;
+    }
+    if (j->p == j->end)
+        return -1;
+    *out = '\0';                /* at or before the closing quote */
+    j->p++;
+    return 0;
+}
+
+static int
+json_skip(struct json *j, int depth)
+{
+    const char     *s;
+    char            close;
+
+    json_ws(j);
+    if (j->p == j->end || depth > JSON_DEPTH)
+        return -1;
+    if (*j->p == '"')
+        return json_string(j, &s);
+    if (*j->p != '{' && *j->p != '[') {
+        /*
+         * number, true, false, or null
+         */
+        while (j->p < j->end && *j->p != ',' && *j->p != '}'
+               && *j->p != ']' && *j->p != ' ' && *j->p != '\n')
+            j->p++;
+        return 0;
+    }
+    close = *j->p == '{' ? '}' : ']';
+    j->p++;
+    if (json_char(j, close) == 0)
+        return 0;
+    do {
+        if (close == '}'
+            && (json_string(j, &s) != 0 || json_char(j, ':') != 0))
+            return -1;
+        if (json_skip(j, depth + 1) != 0)
+            return -1;
+    } while (json_char(j, ',') == 0);
+    return json_char(j, close);
+}
+
+/*
+ * the members of the object describing a source
+ */
+static int
+json_source(struct json *j, RRD_READER_SOURCE * source)
+{
+    const char     *key;
+    const char     *value;
+
+    if (json_char(j, '{') != 0)
+        return -1;
+    if (json_char(j, '}') == 0)
+        return 0;
+    do {
+        if (json_string(j, &key) != 0 || json_char(j, ':') != 0)
+            return -1;
+        json_ws(j);
+        if (j->p < j->end && *j->p != '"') {
+            if (json_skip(j, 0) != 0)
+                return -1;
+            continue;
+        }
+        if (json_string(j, &value) != 0)
+            return -1;
+        if (strcmp(key, "description") == 0)
+            source->description = value;
+        else if (strcmp(key, "units") == 0)
+            source->units = value;
+        else if (strcmp(key, "owner") == 0)
+            source->owner = value;
+        else if (strcmp(key, "min") == 0)
+            source->min = value;
+        else if (strcmp(key, "max") == 0)
+            source->max = value;
+        else if (strcmp(key, "type") == 0)
+            source->type = value;
+        else if (strcmp(key, "value_type") == 0)
+            source->value_type = strcmp(value, "int64") == 0
+                ? RRD_INT64 : RRD_FLOAT64;
+        else if (strcmp(key, "default") == 0)
+            source->rrd_default = strcmp(value, "true") == 0;
+    } while (json_char(j, ',') == 0);
+    return json_char(j, '}');
+}
+
+static int
+json_sources(RRD_READER * reader, struct json *j)
+{
+    RRD_READER_SOURCE *source;
+
+    if (json_char(j, '{') != 0)
+        return -1;
+    if (json_char(j, '}') == 0)
+        return 0;
+    do {
+        if (reader->n_sources == reader->sources_size) {
+            size_t          size = reader->sources_size
+                ? 2 * reader->sources_size : RRD_MAX_SOURCES;
+            source = realloc(reader->sources,
+                             size * sizeof(RRD_READER_SOURCE));
+            if (!source)
+                return -1;
+            reader->sources = source;
+            reader->sources_size = size;
+        }
+        source = &reader->sources[reader->n_sources];
+        memset(source, 0, sizeof(RRD_READER_SOURCE));
+        source->value_type = RRD_FLOAT64;
+        if (json_string(j, &source->name) != 0 || json_char(j, ':') != 0
+            || json_source(j, source) != 0)
+            return -1;
+        reader->n_sources++;
+    } while (json_char(j, ',') == 0);
+    return json_char(j, '}');
+}
+
+static int
+parse_meta(RRD_READER * reader, size_t len)
+{
+    struct json     j = { reader->meta, reader->meta + len };
+    const char     *key;
+
+    reader->n_sources = 0;
+    if (json_char(&j, '{') != 0)
+        return -1;
+    if (json_char(&j, '}') == 0)
+        return 0;
+    do {
+        if (json_string(&j, &key) != 0 || json_char(&j, ':') != 0)
+            return -1;
+        if (strcmp(key, "datasources") == 0) {
+            if (json_sources(reader, &j) != 0)
+                return -1;
+        } else if (json_skip(&j, 0) != 0) {
+            return -1;
+        }
+    } while (json_char(&j, ',') == 0);
+    return json_char(&j, '}');
+}
+
+RRD_READER     *
+rrd_reader_open(const char *path)
+{
+    assert(path);
+    RRD_READER     *reader = calloc(1, sizeof(RRD_READER));
+
+    if (!reader) {
+        return NULL;
+    }
+    reader->path = strdup(path);
+    if (!reader->path) {
+        free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+static void
+unmap(RRD_READER * reader)
+{
+    if (reader->map)
+        munmap(reader->map, reader->map_size);
+    reader->map = NULL;
+    reader->map_size = 0;
+}
+
+int
+rrd_reader_close(RRD_READER * reader)
+{
+    assert(reader);
+
+    unmap(reader);
+    free(reader->meta);
+    free(reader->sources);
+    free(reader->path);
+    free(reader);
+    return RRD_OK;
+}
+
+/*
+ * Map the file as it is now, unless it is mapped already.
+ */
+static int
+map(RRD_READER * reader)
+{
+    struct stat     st;
+    int             fd;
+
+    if (stat(reader->path, &st) != 0) {
+        unmap(reader);
+        return -1;
+    }
+    if (st.st_dev == reader->dev && st.st_ino == reader->ino
+        && (size_t) st.st_size == reader->map_size)
+        return 0;
+    unmap(reader);
+    fd = open(reader->path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_dev != reader->dev || st.st_ino != reader->ino)
+        reader->meta_valid = 0;
+    reader->dev = st.st_dev;
+    reader->ino = st.st_ino;
+    if (st.st_size > 0) {
+        reader->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (reader->map == MAP_FAILED) {
+            reader->map = NULL;
+            close(fd);
+            return -1;
+        }
+        reader->map_size = st.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * One attempt to read the file of size bytes at m. Returns RRD_OK or
+ * the error code of the failure.
+ */
+static int
+attempt(RRD_READER * reader, const unsigned char *m, size_t size,
+        RRD_READER_VIEW * view)
+{
+    size_t          end;
+    uint32_t        n;
+    uint32_t        crc;
+    uint32_t        meta_crc;
+    uint32_t        meta_len;
+    uint64_t        ts;
+
+    if (size < HEADER_SIZE || memcmp(m, MAGIC, MAGIC_SIZE) != 0)
+        return RRD_ERROR;
+    n = get32(m + OFF_COUNT);
+    if (n > (size - HEADER_SIZE) / sizeof(int64_t))
+        return RRD_ERROR;
+    end = HEADER_SIZE + (size_t) n * sizeof(int64_t);
+    crc = get32(m + OFF_CRC_VALUES);
+    meta_crc = get32(m + OFF_CRC_META);
+    if (rrd_crc32(0, m + OFF_TIMESTAMP, end - OFF_TIMESTAMP) != crc)
+        return RRD_CHECKSUM_ERROR;
+    reader->stats.bytes += end - OFF_TIMESTAMP;
+
+    if (!reader->meta_valid || reader->meta_crc != meta_crc) {
+        reader->meta_valid = 0;
+        if (end + sizeof(uint32_t) > size)
+            return RRD_ERROR;
+        meta_len = get32(m + end);
+        if (meta_len > size - end - sizeof(uint32_t))
+            return RRD_ERROR;
+        if (meta_len > reader->meta_size) {
+            char           *meta = realloc(reader->meta, meta_len);
+            if (!meta)
+                return RRD_ERROR;
+            reader->meta = meta;
+            reader->meta_size = meta_len;
+        }
+        memcpy(reader->meta, m + end + sizeof(uint32_t), meta_len);
+        if (rrd_crc32(0, reader->meta, meta_len) != meta_crc)
+            return RRD_CHECKSUM_ERROR;
+        reader->stats.bytes += meta_len;
+        reader->stats.parses++;
+        if (parse_meta(reader, meta_len) != 0)
+            return RRD_ERROR;
+        reader->meta_crc = meta_crc;
+        reader->meta_valid = 1;
+    }
+    if (reader->n_sources != n) {
+        reader->meta_valid = 0;
+        return RRD_ERROR;
+    }
+    ts = get64(m + OFF_TIMESTAMP);
+    memcpy(&view->timestamp, &ts, sizeof(ts));
+    view->n = n;
+    view->values = m + HEADER_SIZE;
+    view->sources = reader->sources;
+    reader->n = n;
+    reader->crc = crc;
+    return RRD_OK;
+}
+
+int
+rrd_reader_read(RRD_READER * reader, RRD_READER_VIEW * view)
+{
+    assert(reader);
+    assert(view);
+    int             rc = RRD_ERROR;
+
+    for (int i = 0; i < RRD_READER_RETRIES; i++) {
+        if (i > 0) {
+            reader->stats.retries++;
+            sched_yield();
+        }
+        if (map(reader) != 0) {
+            return RRD_FILE_ERROR;
+        }
+        rc = attempt(reader, reader->map, reader->map_size, view);
+        if (rc == RRD_OK) {
+            reader->stats.reads++;
+            return RRD_OK;
+        }
+    }
+    return rc;
+}
+
+int
+rrd_reader_image(RRD_READER * reader, const void *image, size_t size,
+                 RRD_READER_VIEW * view)
+{
+    assert(reader);
+    assert(image);
+    assert(view);
+    int             rc = attempt(reader, image, size, view);
+
+    if (rc == RRD_OK)
+        reader->stats.reads++;
+    return rc;
+}
+
+rrd_value_t
+rrd_reader_value(const RRD_READER_VIEW * view, uint32_t i)
+{
+    assert(view);
+    assert(i < view->n);
+    rrd_value_t     v;
+
+    v.int64 = (int64_t) get64((const unsigned char *) view->values
+                              + (size_t) i * sizeof(int64_t));
+    return v;
+}
+
+int
+rrd_reader_stable(RRD_READER * reader)
+{
+    assert(reader);
+
+    if (!reader->map
+        || reader->map_size < HEADER_SIZE + reader->n * sizeof(int64_t))
+        return 0;
+    return rrd_crc32(0, reader->map + OFF_TIMESTAMP,
+                     (reader->n + 1) * sizeof(int64_t)) == reader->crc;
+}
+
+void
+rrd_reader_stats(RRD_READER * reader, RRD_READER_STATS * stats)
+{
+    assert(reader);
+    assert(stats);
+    *stats = reader->stats;
+}
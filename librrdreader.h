@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * librrdreader reads the files written by plugins of librrd, as the RRD
+ * daemon does, for tests, benchmarks, and local consumers. A reader maps
+ * a file into memory. Every rrd_reader_read() validates the magic and
+ * both checksums; the meta data is parsed only when its checksum
+ * changed. A read that races with the plugin rewriting the file is
+ * retried a bounded number of times.
+ */
+
+#ifndef LIBRRDREADER_H
+#define LIBRRDREADER_H
+
+#include "librrd.h"
+
+#define RRD_READER_RETRIES      16
+
+typedef struct rrd_reader RRD_READER;
+
+/*
+ * A source as described by the meta data of a file. The strings are
+ * those of the JSON; a member that is missing is NULL. value_type is
+ * RRD_INT64 or RRD_FLOAT64 and rrd_default is true when the daemon
+ * archives the source.
+ */
+typedef struct rrd_reader_source {
+    const char     *name;
+    const char     *description;
+    const char     *units;
+    const char     *owner;      /* "host", "vm <uuid>", or "sr <uuid>" */
+    const char     *min;
+    const char     *max;
+    const char     *type;       /* "gauge", "absolute", or "derive" */
+    rrd_type_t      value_type;
+    int32_t         rrd_default;
+} RRD_READER_SOURCE;
+
+/*
+ * The result of a read. values points into the mapping of the file and
+ * holds n big-endian values; rrd_reader_value() converts one of them.
+ * sources is valid until the next read.
+ */
+typedef struct rrd_reader_view {
+    double          timestamp;
+    uint32_t        n;
+    const void     *values;
+    const RRD_READER_SOURCE *sources;
+} RRD_READER_VIEW;
+
+typedef struct rrd_reader_stats {
+    uint64_t        reads;      /* successful reads */
+    uint64_t        retries;    /* reads that did not validate */
+    uint64_t        parses;     /* of the meta data */
+    uint64_t        bytes;      /* validated */
+} RRD_READER_STATS;
+
+/*
+ * rrd_reader_open - create a reader for the file at path, which need
+ * not exist yet. Returns NULL when out of memory. rrd_reader_close -
+ * unmap the file and free the reader. Returns an error code.
+ */
+RRD_READER     *rrd_reader_open(const char *path);
+int             rrd_reader_close(RRD_READER * reader);
+
+/*
+ * rrd_reader_read - read the file and describe its contents in view.
+ * A file that is replaced is opened again. Returns RRD_OK,
+ * RRD_FILE_ERROR when the file can't be opened or mapped,
+ * RRD_CHECKSUM_ERROR when a checksum did not match in
+ * RRD_READER_RETRIES attempts, or RRD_ERROR when the file is malformed.
+ */
+int             rrd_reader_read(RRD_READER * reader, RRD_READER_VIEW * view);
+
+/*
+ * rrd_reader_image - read a copy of a file of size bytes in memory, like
+ * one in a recording, rather than the file of the reader. The view
+ * refers to image, and its meta data is parsed only when its checksum
+ * differs from that of the last read. Returns the error codes of
+ * rrd_reader_read() except RRD_FILE_ERROR; a checksum error is not
+ * retried.
+ */
+int             rrd_reader_image(RRD_READER * reader, const void *image,
+                                 size_t size, RRD_READER_VIEW * view);
+
+/*
+ * rrd_reader_value - value i of a view in host byte order. The value is
+ * read from the file when called: once the plugin rewrites it, it may
+ * be that of a later sample. rrd_reader_stable - true when the values
+ * still have the checksum validated by the last read, such that those
+ * used since were consistent.
+ */
+rrd_value_t     rrd_reader_value(const RRD_READER_VIEW * view, uint32_t i);
+int             rrd_reader_stable(RRD_READER * reader);
+
+/*
+ * rrd_reader_stats - copy the statistics of a reader into stats.
+ */
+void            rrd_reader_stats(RRD_READER * reader,
+                                 RRD_READER_STATS * stats);
+
+#endif                          /* LIBRRDREADER_H */
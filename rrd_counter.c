@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Counter sources are updated by the client rather than sampled. A
+ * counter is split into one shard per CPU, each in its own cache line;
+ * an update goes to the shard of the CPU the thread is running on.
+ * sched_getcpu() is served from the rseq area (or vDSO) by recent
+ * versions of glibc and does not enter the kernel. Where it does not
+ * exist, each thread is assigned a shard when it first updates a
+ * counter, which spreads threads rather than CPUs. Because a thread
+ * may migrate between looking up the CPU and updating the shard, the
+ * update is still atomic, but the cache line is almost never contended.
+ * Sampling sums up all shards.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "librrd_private.h"
+
+#define CACHE_LINE 64
+
+struct rrd_shard {
+    int64_t         value;
+    char            pad[CACHE_LINE - sizeof(int64_t)];
+};
+
+struct rrd_counter {
+    struct rrd_shard *shards;   /* one per CPU */
+    size_t          n;          /* number of shards */
+    RRD_COUNTER    *next;       /* list of counters of a plugin */
+    RRD_SOURCE     *source;     /* as registered by the client */
+    RRD_SOURCE      derived;    /* added to the plugin */
+    rrd_handle_t    handle;     /* of derived */
+};
+
+#ifdef __linux__
+static size_t
+this_cpu(void)
+{
+    int             cpu = sched_getcpu();
+    return cpu < 0 ? 0 : (size_t) cpu;
+}
+#else
+static size_t
+this_cpu(void)
+{
+    static size_t   threads;
+    static __thread size_t thread;
+
+    if (thread == 0)
+        thread = __atomic_add_fetch(&threads, 1, __ATOMIC_RELAXED);
+    return thread;
+}
+#endif
+
+void
+rrd_counter_add(RRD_COUNTER * counter, int64_t delta)
+{
+    size_t          i = this_cpu() % counter->n;
+
+    __atomic_fetch_add(&counter->shards[i].value, delta, __ATOMIC_RELAXED);
+}
+
+static          rrd_value_t
+counter_sample(void *userdata)
+{
+    RRD_COUNTER    *counter = userdata;
+    rrd_value_t     v;
+
+    v.int64 = 0;
+    for (size_t i = 0; i < counter->n; i++) {
+        v.int64 += __atomic_load_n(&counter->shards[i].value,
+                                   __ATOMIC_RELAXED);
+    }
+    return v;
+}
+
+static void
+counter_free(RRD_COUNTER * counter)
+{
+    free(counter->shards);
+    free(counter);
+}
+
+RRD_COUNTER    *
+rrd_add_counter_src(RRD_PLUGIN * plugin, RRD_SOURCE * source)
+{
+    assert(plugin);
+    assert(source);
+    RRD_COUNTER    *counter;
+    long            cpus;
+
+    if (source->type != RRD_INT64) {
+        return NULL;
+    }
+    counter = calloc(1, sizeof(RRD_COUNTER));
+    if (!counter) {
+        return NULL;
+    }
+    cpus = sysconf(_SC_NPROCESSORS_CONF);
+    counter->n = cpus > 0 ? (size_t) cpus : 1;
+    counter->shards = aligned_alloc(CACHE_LINE,
+                                    counter->n * sizeof(struct rrd_shard));
+    if (!counter->shards) {
+        counter_free(counter);
+        return NULL;
+    }
+    for (size_t i = 0; i < counter->n; i++) {
+        counter->shards[i].value = 0;
+    }
+    counter->source = source;
+    counter->derived = *source;
+    counter->derived.sample = counter_sample;
+    counter->derived.userdata = counter;
+    if (rrd_add_src_handle(plugin, &counter->derived, &counter->handle)
+        != RRD_OK) {
+        counter_free(counter);
+        return NULL;
+    }
+    counter->next = plugin->counters;
+    plugin->counters = counter;
+    return counter;
+}
+
+int
+rrd_counter_del(RRD_PLUGIN * plugin, RRD_SOURCE * source)
+{
+    RRD_COUNTER   **p;
+    RRD_COUNTER    *counter;
+
+    for (p = &plugin->counters; *p; p = &(*p)->next) {
+        if ((*p)->source == source)
+            break;
+    }
+    if (!*p)
+        return RRD_NO_SUCH_SOURCE;
+    counter = *p;
+    *p = counter->next;
+    rrd_del_src_handle(plugin, counter->handle);
+    counter_free(counter);
+    return RRD_OK;
+}
+
+void
+rrd_counter_close(RRD_PLUGIN * plugin)
+{
+    RRD_COUNTER    *counter = plugin->counters;
+
+    while (counter) {
+        RRD_COUNTER    *next = counter->next;
+        counter_free(counter);
+        counter = next;
+    }
+    plugin->counters = NULL;
+}
@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * CRC-32 of the RRD protocol, which is the one of zlib (IEEE 802.3, bit
+ * reflected). On x86-64, a buffer is folded with carry-less
+ * multiplications as described in "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" by Intel: 64 bytes per
+ * iteration with PCLMULQDQ, or 256 bytes with VPCLMULQDQ on 512-bit
+ * registers. On ARMv8, the CRC32 instructions process 8 bytes at a
+ * time. The implementation is chosen on first use from CPUID or HWCAP;
+ * zlib's crc32() is used when neither is available, and for short
+ * buffers and the last bytes of a buffer that is folded.
+ *
+ * Each implementation can also convert an array of native 64-bit values
+ * to big-endian and compute the CRC of the result in the same pass, as
+ * rrd_sample() does for the values of a plugin: the values are swapped
+ * in registers (PSHUFB, REV) that are then stored and folded.
+ */
+
+#include <string.h>
+#include <zlib.h>
+
+#include "librrd_private.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#ifdef __linux__
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BE64(x) __builtin_bswap64(x)
+#else
+#define BE64(x) (x)
+#endif
+
+static uint32_t
+crc_zlib(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    /*
+     * crc32() takes the length as an unsigned int
+     */
+    while (len > 0) {
+        size_t          n = len < (1u << 30) ? len : (1u << 30);
+        crc = crc32(crc, p, (uInt) n);
+        p += n;
+        len -= n;
+    }
+    return crc;
+}
+
+static void
+bswap_scalar(void *dst, const int64_t * src, size_t n)
+{
+    unsigned char  *d = dst;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t        v = BE64((uint64_t) src[i]);
+        memcpy(d + i * sizeof(v), &v, sizeof(v));
+    }
+}
+
+static uint32_t
+crc_zlib_bswap(uint32_t crc, void *dst, const int64_t * src, size_t n)
+{
+    bswap_scalar(dst, src, n);
+    return crc_zlib(crc, dst, n * sizeof(int64_t));
+}
+
+#if defined(__x86_64__)
+
+/*
+ * Folding constants are x^(d+32) and x^(d-32) mod P, bit reflected and
+ * shifted left by one, for a folding distance of d bits; the low half of
+ * a 128-bit lane is multiplied by the first, the high half by the
+ * second.
+ */
+static const uint64_t k2048[] = { 0x011542778a, 0x01322d1430 };
+static const uint64_t k512[] = { 0x0154442bd4, 0x01c6e41596 };
+static const uint64_t k128[] = { 0x01751997d0, 0x00ccaa009e };
+static const uint64_t k64[] = { 0x0163cd6124, 0x0000000000 };
+
+/*
+ * P and floor(x^64 / P) for the Barrett reduction, bit reflected
+ */
+static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+/*
+ * PSHUFB mask that reverses the bytes of each 64-bit lane
+ */
+static const uint8_t swap64[] = {
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+};
+
+#define TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#define TARGET_VPCLMUL \
+    __attribute__((target("pclmul,sse4.1,avx512f,avx512bw,vpclmulqdq")))
+
+/*
+ * Load 16 bytes from src. With swap, they are 64-bit values that are
+ * converted to big-endian and also stored to dst.
+ */
+static inline   TARGET_PCLMUL __m128i
+load128(const unsigned char *src, unsigned char *dst, int swap)
+{
+    __m128i         x = _mm_loadu_si128((const __m128i *)src);
+
+    if (swap) {
+        x = _mm_shuffle_epi8(x, _mm_loadu_si128((const __m128i *)swap64));
+        _mm_storeu_si128((__m128i *) dst, x);
+    }
+    return x;
+}
+
+static inline   TARGET_PCLMUL __m128i
+fold128(__m128i x, __m128i k, __m128i next)
+{
+    __m128i         lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i         hi = _mm_clmulepi64_si128(x, k, 0x11);
+
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+/*
+ * Reduce the 128 bits in x to 32 bits, which is the CRC of the buffer
+ * folded into x.
+ */
+static inline   TARGET_PCLMUL uint32_t
+reduce128(__m128i x)
+{
+    __m128i         mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i         k;
+    __m128i         t;
+
+    k = _mm_loadu_si128((const __m128i *)k128);
+    t = _mm_clmulepi64_si128(x, k, 0x10);
+    x = _mm_xor_si128(_mm_srli_si128(x, 8), t);
+
+    k = _mm_loadl_epi64((const __m128i *)k64);
+    t = _mm_srli_si128(x, 4);
+    x = _mm_clmulepi64_si128(_mm_and_si128(x, mask), k, 0x00);
+    x = _mm_xor_si128(x, t);
+
+    k = _mm_loadu_si128((const __m128i *)poly);
+    t = _mm_and_si128(x, mask);
+    t = _mm_clmulepi64_si128(t, k, 0x10);
+    t = _mm_and_si128(t, mask);
+    t = _mm_clmulepi64_si128(t, k, 0x00);
+    x = _mm_xor_si128(x, t);
+    return (uint32_t) _mm_extract_epi32(x, 1);
+}
+
+/*
+ * Fold len bytes from src, at least 64 and a multiple of 16, into four
+ * and then one 128-bit register. crc is the inverted CRC before src.
+ * With swap, src holds 64-bit values that are folded as big-endian and
+ * stored to dst; otherwise dst is not used.
+ */
+static inline   TARGET_PCLMUL uint32_t
+fold_pclmul(uint32_t crc, const unsigned char *src, size_t len,
+            unsigned char *dst, int swap)
+{
+    __m128i         k = _mm_loadu_si128((const __m128i *)k512);
+    __m128i         x0, x1, x2, x3;
+
+    x0 = load128(src + 0x00, dst + 0x00, swap);
+    x1 = load128(src + 0x10, dst + 0x10, swap);
+    x2 = load128(src + 0x20, dst + 0x20, swap);
+    x3 = load128(src + 0x30, dst + 0x30, swap);
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128((int)crc));
+    src += 64;
+    dst += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x0 = fold128(x0, k, load128(src + 0x00, dst + 0x00, swap));
+        x1 = fold128(x1, k, load128(src + 0x10, dst + 0x10, swap));
+        x2 = fold128(x2, k, load128(src + 0x20, dst + 0x20, swap));
+        x3 = fold128(x3, k, load128(src + 0x30, dst + 0x30, swap));
+        src += 64;
+        dst += 64;
+        len -= 64;
+    }
+
+    k = _mm_loadu_si128((const __m128i *)k128);
+    x0 = fold128(x0, k, x1);
+    x0 = fold128(x0, k, x2);
+    x0 = fold128(x0, k, x3);
+    while (len >= 16) {
+        x0 = fold128(x0, k, load128(src, dst, swap));
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+    return reduce128(x0);
+}
+
+static          TARGET_PCLMUL uint32_t
+crc_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+    size_t          n = len & ~(size_t) 15;
+    const unsigned char *p = buf;
+
+    if (len < 64)
+        return crc_zlib(crc, buf, len);
+    crc = ~fold_pclmul(~crc, p, n, (unsigned char *)p, 0);
+    return crc_zlib(crc, p + n, len - n);
+}
+
+static          TARGET_PCLMUL uint32_t
+crc_pclmul_bswap(uint32_t crc, void *dst, const int64_t * src, size_t n)
+{
+    size_t          len = n * sizeof(int64_t);
+    size_t          m = len & ~(size_t) 15;
+    unsigned char  *d = dst;
+
+    if (len < 64)
+        return crc_zlib_bswap(crc, dst, src, n);
+    crc = ~fold_pclmul(~crc, (const unsigned char *)src, m, d, 1);
+    return crc_zlib_bswap(crc, d + m, src + m / 8, n - m / 8);
+}
+
+static          TARGET_PCLMUL void
+bswap_ssse3(void *dst, const int64_t * src, size_t n)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char  *d = dst;
+    size_t          m = n & ~(size_t) 1;
+
+    for (size_t i = 0; i < m; i += 2)
+        load128(s + i * 8, d + i * 8, 1);
+    bswap_scalar(d + m * 8, src + m, n - m);
+}
+
+static inline   TARGET_VPCLMUL __m512i
+load512(const unsigned char *src, unsigned char *dst, int swap)
+{
+    __m512i         x = _mm512_loadu_si512((const void *)src);
+
+    if (swap) {
+        __m512i         mask = _mm512_broadcast_i32x4(_mm_loadu_si128
+                                                      ((const __m128i *)
+                                                       swap64));
+        x = _mm512_shuffle_epi8(x, mask);
+        _mm512_storeu_si512((void *)dst, x);
+    }
+    return x;
+}
+
+static inline   TARGET_VPCLMUL __m512i
+fold512(__m512i x, __m512i k, __m512i next)
+{
+    __m512i         lo = _mm512_clmulepi64_epi128(x, k, 0x00);
+    __m512i         hi = _mm512_clmulepi64_epi128(x, k, 0x11);
+
+    /*
+     * lo ^ hi ^ next
+     */
+    return _mm512_ternarylogic_epi64(lo, hi, next, 0x96);
+}
+
+/*
+ * Like fold_pclmul() for at least 256 bytes in four 512-bit registers.
+ */
+static inline   TARGET_VPCLMUL uint32_t
+fold_vpclmul(uint32_t crc, const unsigned char *src, size_t len,
+             unsigned char *dst, int swap)
+{
+    __m512i         k;
+    __m512i         x0, x1, x2, x3;
+    __m128i         k1, y;
+
+    x0 = load512(src + 0x00, dst + 0x00, swap);
+    x1 = load512(src + 0x40, dst + 0x40, swap);
+    x2 = load512(src + 0x80, dst + 0x80, swap);
+    x3 = load512(src + 0xc0, dst + 0xc0, swap);
+    x0 = _mm512_xor_si512(x0,
+                          _mm512_inserti32x4(_mm512_setzero_si512(),
+                                             _mm_cvtsi32_si128((int)crc), 0));
+    src += 256;
+    dst += 256;
+    len -= 256;
+
+    k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)k2048));
+    while (len >= 256) {
+        x0 = fold512(x0, k, load512(src + 0x00, dst + 0x00, swap));
+        x1 = fold512(x1, k, load512(src + 0x40, dst + 0x40, swap));
+        x2 = fold512(x2, k, load512(src + 0x80, dst + 0x80, swap));
+        x3 = fold512(x3, k, load512(src + 0xc0, dst + 0xc0, swap));
+        src += 256;
+        dst += 256;
+        len -= 256;
+    }
+
+    k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)k512));
+    x0 = fold512(x0, k, x1);
+    x0 = fold512(x0, k, x2);
+    x0 = fold512(x0, k, x3);
+    while (len >= 64) {
+        x0 = fold512(x0, k, load512(src, dst, swap));
+        src += 64;
+        dst += 64;
+        len -= 64;
+    }
+
+    k1 = _mm_loadu_si128((const __m128i *)k128);
+    y = _mm512_extracti32x4_epi32(x0, 0);
+    y = fold128(y, k1, _mm512_extracti32x4_epi32(x0, 1));
+    y = fold128(y, k1, _mm512_extracti32x4_epi32(x0, 2));
+    y = fold128(y, k1, _mm512_extracti32x4_epi32(x0, 3));
+    while (len >= 16) {
+        y = fold128(y, k1, load128(src, dst, swap));
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+    return reduce128(y);
+}
+
+static          TARGET_VPCLMUL uint32_t
+crc_vpclmul(uint32_t crc, const void *buf, size_t len)
+{
+    size_t          n = len & ~(size_t) 15;
+    const unsigned char *p = buf;
+
+    if (len < 256)
+        return crc_pclmul(crc, buf, len);
+    crc = ~fold_vpclmul(~crc, p, n, (unsigned char *)p, 0);
+    return crc_zlib(crc, p + n, len - n);
+}
+
+static          TARGET_VPCLMUL uint32_t
+crc_vpclmul_bswap(uint32_t crc, void *dst, const int64_t * src, size_t n)
+{
+    size_t          len = n * sizeof(int64_t);
+    size_t          m = len & ~(size_t) 15;
+    unsigned char  *d = dst;
+
+    if (len < 256)
+        return crc_pclmul_bswap(crc, dst, src, n);
+    crc = ~fold_vpclmul(~crc, (const unsigned char *)src, m, d, 1);
+    return crc_zlib_bswap(crc, d + m, src + m / 8, n - m / 8);
+}
+
+static          TARGET_VPCLMUL void
+bswap_avx512(void *dst, const int64_t * src, size_t n)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char  *d = dst;
+    size_t          m = n & ~(size_t) 7;
+
+    for (size_t i = 0; i < m; i += 8)
+        load512(s + i * 8, d + i * 8, 1);
+    bswap_ssse3(d + m * 8, src + m, n - m);
+}
+
+static int
+has_pclmul(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul")
+        && __builtin_cpu_supports("sse4.1");
+}
+
+static int
+has_vpclmul(void)
+{
+    __builtin_cpu_init();
+    return has_pclmul() && __builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("vpclmulqdq");
+}
+
+#elif defined(__aarch64__)
+
+static          __attribute__((target("+crc"))) uint32_t
+crc_armv8(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t        v;
+
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t) p & 7)) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32d(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+
+/*
+ * Each value is swapped (REV) and added to the CRC in a register.
+ */
+static          __attribute__((target("+crc"))) uint32_t
+crc_armv8_bswap(uint32_t crc, void *dst, const int64_t * src, size_t n)
+{
+    unsigned char  *d = dst;
+
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t        v = BE64((uint64_t) src[i]);
+        memcpy(d + i * sizeof(v), &v, sizeof(v));
+        crc = __crc32d(crc, v);
+    }
+    return ~crc;
+}
+
+/*
+ * getauxval() is Linux-specific; all Apple CPUs have the instructions
+ */
+static int
+has_armv8(void)
+{
+#if defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(__APPLE__)
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#endif
+
+static int
+has_zlib(void)
+{
+    return 1;
+}
+
+/*
+ * in order of preference
+ */
+const struct rrd_crc_impl rrd_crc_impls[] = {
+#if defined(__x86_64__)
+    {"vpclmulqdq", crc_vpclmul, crc_vpclmul_bswap, bswap_avx512,
+     has_vpclmul},
+    {"pclmulqdq", crc_pclmul, crc_pclmul_bswap, bswap_ssse3, has_pclmul},
+#elif defined(__aarch64__)
+    {"armv8", crc_armv8, crc_armv8_bswap, bswap_scalar, has_armv8},
+#endif
+    {"zlib", crc_zlib, crc_zlib_bswap, bswap_scalar, has_zlib},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+/*
+ * Polynomials modulo P in the bit-reflected representation of the CRC,
+ * as in zlib's crc32_combine(): the product of a and b, and x^(8 * len),
+ * which appends len zero bytes to a CRC when multiplied with it.
+ */
+#define POLY 0xedb88320u
+
+uint32_t
+rrd_crc32_mult(uint32_t a, uint32_t b)
+{
+    uint32_t        p = 0;
+
+    /*
+     * without branches, which would be mispredicted half of the time
+     */
+    for (int i = 31; i >= 0; i--) {
+        p ^= b & -((a >> i) & 1);
+        b = (b >> 1) ^ (POLY & -(b & 1));
+    }
+    return p;
+}
+
+uint32_t
+rrd_crc32_zeros(size_t len)
+{
+    uint32_t        sq = 1u << 30;      /* x^1, squared below */
+    uint32_t        p = 1u << 31;       /* x^0 */
+    int             k;
+
+    /*
+     * x^(8 * len) is the product of x^(2^k) for the bits k of 8 * len
+     */
+    for (k = 0; k < 3; k++)
+        sq = rrd_crc32_mult(sq, sq);
+    for (; len; len >>= 1) {
+        if (len & 1)
+            p = rrd_crc32_mult(sq, p);
+        sq = rrd_crc32_mult(sq, sq);
+    }
+    return p;
+}
+
+/*
+ * The CRC of a buffer changes by rrd_crc32_delta(zeros, delta) when an
+ * 8-byte word in it changes by delta (the XOR of the old and new word)
+ * and zeros = rrd_crc32_zeros(n) for the n bytes that follow the word.
+ */
+uint32_t
+rrd_crc32_delta(uint32_t zeros, uint64_t delta)
+{
+    return rrd_crc32_mult(zeros, ~rrd_crc32(~0u, &delta, sizeof(delta)));
+}
+
+static const struct rrd_crc_impl *crc_impl;
+
+const struct rrd_crc_impl *
+rrd_crc32_impl(void)
+{
+    const struct rrd_crc_impl *impl;
+
+    impl = __atomic_load_n(&crc_impl, __ATOMIC_ACQUIRE);
+    if (impl)
+        return impl;
+    for (impl = rrd_crc_impls; !impl->supported(); impl++);
+    __atomic_store_n(&crc_impl, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+uint32_t
+rrd_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    return rrd_crc32_impl()->crc32(crc, buf, len);
+}
+
+uint32_t
+rrd_crc32_bswap64(uint32_t crc, void *dst, const int64_t * src, size_t n)
+{
+    return rrd_crc32_impl()->crc32_bswap64(crc, dst, src, n);
+}
+
+void
+rrd_bswap64(void *dst, const int64_t * src, size_t n)
+{
+    rrd_crc32_impl()->bswap64(dst, src, n);
+}
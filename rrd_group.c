@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Source groups. A group shares the file of its plugin or has a file
+ * of its own, in which case it keeps a plugin of its own as well. The
+ * JSON of every source is rendered once when it is added, so changing
+ * one group never renders the meta data of sources in other groups.
+ * A group remembers the slots of its sources to remove them when it is
+ * closed.
+ *
+ * In concurrent mode, the list of groups and the slots of a group are
+ * changed under the lock of the plugin. The sampler only walks the list
+ * of groups with a file of their own, which are opened and closed
+ * while no other thread uses the plugin.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "librrd_private.h"
+
+struct rrd_group_src {
+    RRD_SOURCE     *source;
+    rrd_handle_t    handle;
+};
+
+struct rrd_group {
+    RRD_PLUGIN     *plugin;     /* the group belongs to */
+    RRD_PLUGIN     *own;        /* file of the group or NULL */
+    RRD_GROUP      *next;       /* list of groups of a plugin */
+    RRD_GROUP      *next_file;  /* list of groups with a file */
+    char           *uuid;       /* default owner_uuid or NULL */
+    struct rrd_group_src *srcs;
+    size_t          n;
+    size_t          size;
+};
+
+static RRD_GROUP *
+group_new(RRD_PLUGIN * plugin, const char *owner_uuid)
+{
+    RRD_GROUP      *group = calloc(1, sizeof(RRD_GROUP));
+
+    if (!group)
+        return NULL;
+    if (owner_uuid && !(group->uuid = strdup(owner_uuid))) {
+        free(group);
+        return NULL;
+    }
+    group->plugin = plugin;
+    return group;
+}
+
+static void
+group_link(RRD_GROUP * group)
+{
+    RRD_PLUGIN     *plugin = group->plugin;
+
+    rrd_rcu_lock(plugin);
+    group->next = plugin->groups;
+    plugin->groups = group;
+    if (group->own) {
+        group->next_file = plugin->group_files;
+        plugin->group_files = group;
+    }
+    rrd_rcu_unlock(plugin);
+}
+
+static void
+group_free(RRD_GROUP * group)
+{
+    free(group->srcs);
+    free(group->uuid);
+    free(group);
+}
+
+RRD_GROUP      *
+rrd_group_open(RRD_PLUGIN * plugin, const char *owner_uuid)
+{
+    assert(plugin);
+    RRD_GROUP      *group = group_new(plugin, owner_uuid);
+
+    if (group)
+        group_link(group);
+    return group;
+}
+
+RRD_GROUP      *
+rrd_group_open_file(RRD_PLUGIN * plugin, const char *owner_uuid, char *path)
+{
+    assert(plugin);
+    assert(path);
+    RRD_GROUP      *group = group_new(plugin, owner_uuid);
+
+    if (!group)
+        return NULL;
+    group->own = rrd_open(plugin->name, plugin->domain, path);
+    if (!group->own) {
+        group_free(group);
+        return NULL;
+    }
+    group_link(group);
+    return group;
+}
+
+int
+rrd_group_add_src(RRD_GROUP * group, RRD_SOURCE * source)
+{
+    assert(group);
+    assert(source);
+    RRD_PLUGIN     *plugin = group->own ? group->own : group->plugin;
+    rrd_handle_t    handle;
+    int             rc = RRD_ERROR;
+
+    rrd_rcu_lock(group->plugin);
+    if (group->n == group->size) {
+        size_t          size = group->size ? 2 * group->size : 8;
+        struct rrd_group_src *srcs =
+            realloc(group->srcs, size * sizeof(struct rrd_group_src));
+        if (!srcs)
+            goto out;
+        group->srcs = srcs;
+        group->size = size;
+    }
+    rc = rrd_add_src_owned(plugin, source, group->uuid, &handle);
+    if (rc != RRD_OK)
+        goto out;
+    group->srcs[group->n].source = source;
+    group->srcs[group->n].handle = handle;
+    group->n++;
+  out:
+    rrd_rcu_unlock(group->plugin);
+    return rc;
+}
+
+int
+rrd_group_del_src(RRD_GROUP * group, RRD_SOURCE * source)
+{
+    assert(group);
+    assert(source);
+    RRD_PLUGIN     *plugin = group->own ? group->own : group->plugin;
+    int             rc = RRD_NO_SUCH_SOURCE;
+
+    rrd_rcu_lock(group->plugin);
+    for (size_t i = 0; i < group->n; i++) {
+        if (group->srcs[i].source == source) {
+            rrd_handle_t    handle = group->srcs[i].handle;
+            group->srcs[i] = group->srcs[--group->n];
+            /*
+             * removed with rrd_del_src() and the slot maybe reused
+             */
+            if (plugin->sources[handle] == source)
+                rc = rrd_del_src_handle(plugin, handle);
+            break;
+        }
+    }
+    rrd_rcu_unlock(group->plugin);
+    return rc;
+}
+
+/*
+ * Remove the sources of a group from its plugin; a source that was
+ * removed with rrd_del_src() meanwhile is no longer in its slot.
+ */
+static int
+group_release(RRD_GROUP * group)
+{
+    if (group->own)
+        return rrd_close(group->own);
+    for (size_t i = 0; i < group->n; i++) {
+        rrd_handle_t    handle = group->srcs[i].handle;
+        if (group->plugin->sources[handle] == group->srcs[i].source)
+            rrd_del_src_handle(group->plugin, handle);
+    }
+    return RRD_OK;
+}
+
+int
+rrd_group_close(RRD_GROUP * group)
+{
+    assert(group);
+    RRD_PLUGIN     *plugin = group->plugin;
+    RRD_GROUP     **p;
+    int             rc;
+
+    rrd_rcu_lock(plugin);
+    for (p = &plugin->groups; *p != group; p = &(*p)->next);
+    *p = group->next;
+    if (group->own) {
+        for (p = &plugin->group_files; *p != group; p = &(*p)->next_file);
+        *p = group->next_file;
+    }
+    rc = group_release(group);
+    rrd_rcu_unlock(plugin);
+    group_free(group);
+    return rc;
+}
+
+int
+rrd_group_sample(RRD_PLUGIN * plugin, double timestamp)
+{
+    int             rc = RRD_OK;
+
+    for (RRD_GROUP * group = plugin->group_files; group;
+         group = group->next_file) {
+        int             r = rrd_sample_at(group->own, timestamp);
+        if (rc == RRD_OK)
+            rc = r;
+    }
+    return rc;
+}
+
+/*
+ * called by rrd_close(); the sources of groups sharing the file of the
+ * plugin are freed with it
+ */
+void
+rrd_group_close_all(RRD_PLUGIN * plugin)
+{
+    RRD_GROUP      *group = plugin->groups;
+
+    while (group) {
+        RRD_GROUP      *next = group->next;
+        if (group->own)
+            rrd_close(group->own);
+        group_free(group);
+        group = next;
+    }
+    plugin->groups = NULL;
+    plugin->group_files = NULL;
+}
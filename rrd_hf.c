@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * High-frequency sources are sampled more often than rrd_sample() is
+ * called: by a sampler thread started with rrd_hf_start() or by the
+ * client calling rrd_hf_tick(). Every sample updates a window of
+ * running statistics. rrd_sample() publishes the window and starts a
+ * new one; the published values are reported by sources derived from
+ * the original source. Updating a window does not allocate.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "librrd_private.h"
+
+#define HF_LAST 0               /* index of derived sources */
+#define HF_MIN  1
+#define HF_MAX  2
+#define HF_MEAN 3
+#define HF_DERIVED 4
+
+struct rrd_hf_window {
+    rrd_value_t     last;
+    rrd_value_t     min;
+    rrd_value_t     max;
+    double          sum;
+    uint64_t        count;
+};
+
+struct rrd_hf_src {
+    RRD_SOURCE     *source;     /* as registered by the client */
+    RRD_SOURCE      derived[HF_DERIVED];        /* added to the plugin */
+    rrd_handle_t    handles[HF_DERIVED];        /* of derived, or -1 */
+    int             companions; /* RRD_HF_MIN | RRD_HF_MAX | RRD_HF_MEAN */
+    struct rrd_hf_window cur;   /* updated by every tick */
+    struct rrd_hf_window pub;   /* reported by derived sources */
+    char           *names;      /* storage for names of derived sources */
+};
+
+struct rrd_hf {
+    pthread_mutex_t lock;       /* protects everything below */
+    pthread_cond_t  wake;       /* signals sampler to stop */
+    pthread_t       sampler;
+    int             running;    /* sampler thread exists */
+    struct timespec interval;
+    struct rrd_hf_src **srcs;
+    size_t          n;
+    size_t          size;
+};
+
+static void
+window_add(struct rrd_hf_window *w, rrd_type_t type, rrd_value_t v)
+{
+    if (w->count == 0) {
+        w->min = v;
+        w->max = v;
+        w->sum = 0;
+    } else if (type == RRD_INT64) {
+        if (v.int64 < w->min.int64)
+            w->min = v;
+        if (v.int64 > w->max.int64)
+            w->max = v;
+    } else {
+        if (v.float64 < w->min.float64)
+            w->min = v;
+        if (v.float64 > w->max.float64)
+            w->max = v;
+    }
+    w->sum += type == RRD_INT64 ? (double)v.int64 : v.float64;
+    w->last = v;
+    w->count++;
+}
+
+static void
+tick_one(struct rrd_hf_src *src)
+{
+    RRD_SOURCE     *source = src->source;
+    window_add(&src->cur, source->type, source->sample(source->userdata));
+}
+
+/*
+ * sample functions of the derived sources; called by rrd_sample() after
+ * rrd_hf_publish()
+ */
+static          rrd_value_t
+hf_last(void *userdata)
+{
+    return ((struct rrd_hf_src *)userdata)->pub.last;
+}
+
+static          rrd_value_t
+hf_min(void *userdata)
+{
+    return ((struct rrd_hf_src *)userdata)->pub.min;
+}
+
+static          rrd_value_t
+hf_max(void *userdata)
+{
+    return ((struct rrd_hf_src *)userdata)->pub.max;
+}
+
+static          rrd_value_t
+hf_mean(void *userdata)
+{
+    struct rrd_hf_src *src = userdata;
+    rrd_value_t     v;
+    v.float64 = src->pub.sum / src->pub.count;
+    return v;
+}
+
+static struct rrd_hf *
+hf_get(RRD_PLUGIN * plugin)
+{
+    struct rrd_hf  *hf;
+    pthread_condattr_t attr;
+
+    if (plugin->hf)
+        return plugin->hf;
+    hf = calloc(1, sizeof(struct rrd_hf));
+    if (!hf)
+        return NULL;
+    pthread_mutex_init(&hf->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hf->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    plugin->hf = hf;
+    return hf;
+}
+
+static void
+src_free(struct rrd_hf_src *src)
+{
+    free(src->names);
+    free(src);
+}
+
+int
+rrd_add_hf_src(RRD_PLUGIN * plugin, RRD_SOURCE * source, int companions)
+{
+    assert(plugin);
+    assert(source);
+    struct rrd_hf  *hf;
+    struct rrd_hf_src *src;
+    static const char *suffix[HF_DERIVED] = { "", "_min", "_max", "_mean" };
+    static rrd_value_t(*sample[HF_DERIVED]) (void *) = {
+    hf_last, hf_min, hf_max, hf_mean};
+    size_t          len;
+    int             rc;
+    int             i;
+
+    if (source->scale != RRD_GAUGE) {
+        return RRD_ERROR;
+    }
+    hf = hf_get(plugin);
+    src = calloc(1, sizeof(struct rrd_hf_src));
+    len = strlen(source->name) + sizeof("_mean");
+    if (hf == NULL || src == NULL
+        || (src->names = malloc(HF_DERIVED * len)) == NULL) {
+        free(src);
+        return RRD_ERROR;
+    }
+    src->source = source;
+    src->companions = companions;
+    for (i = 0; i < HF_DERIVED; i++) {
+        RRD_SOURCE     *d = &src->derived[i];
+        *d = *source;
+        d->name = src->names + i * len;
+        strcpy(d->name, source->name);
+        strcat(d->name, suffix[i]);
+        d->sample = sample[i];
+        d->userdata = src;
+        src->handles[i] = -1;
+    }
+    src->derived[HF_MEAN].type = RRD_FLOAT64;
+
+    pthread_mutex_lock(&hf->lock);
+    if (hf->n == hf->size) {
+        size_t          size = hf->size ? 2 * hf->size : 4;
+        struct rrd_hf_src **srcs =
+            realloc(hf->srcs, size * sizeof(struct rrd_hf_src *));
+        if (!srcs) {
+            pthread_mutex_unlock(&hf->lock);
+            src_free(src);
+            return RRD_ERROR;
+        }
+        hf->srcs = srcs;
+        hf->size = size;
+    }
+    hf->srcs[hf->n++] = src;
+    pthread_mutex_unlock(&hf->lock);
+
+    /*
+     * derived sources are ordinary sources of the plugin
+     */
+    for (i = 0; i < HF_DERIVED; i++) {
+        if (i != HF_LAST && !(companions & (1 << (i - 1))))
+            continue;
+        rc = rrd_add_src_handle(plugin, &src->derived[i], &src->handles[i]);
+        if (rc != RRD_OK) {
+            rrd_hf_del(plugin, source);
+            return rc;
+        }
+    }
+    return RRD_OK;
+}
+
+/*
+ * Remove a high-frequency source and the sources derived from it.
+ */
+int
+rrd_hf_del(RRD_PLUGIN * plugin, RRD_SOURCE * source)
+{
+    struct rrd_hf  *hf = plugin->hf;
+    struct rrd_hf_src *src = NULL;
+    size_t          i;
+
+    if (!hf)
+        return RRD_NO_SUCH_SOURCE;
+    pthread_mutex_lock(&hf->lock);
+    for (i = 0; i < hf->n; i++) {
+        if (hf->srcs[i]->source == source) {
+            src = hf->srcs[i];
+            hf->srcs[i] = hf->srcs[--hf->n];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hf->lock);
+    if (!src)
+        return RRD_NO_SUCH_SOURCE;
+    for (i = 0; i < HF_DERIVED; i++) {
+        if (src->handles[i] >= 0)
+            rrd_del_src_handle(plugin, src->handles[i]);
+    }
+    src_free(src);
+    return RRD_OK;
+}
+
+/*
+ * Take one sample from every high-frequency source. Called with the lock
+ * held.
+ */
+static void
+tick(struct rrd_hf *hf)
+{
+    for (size_t i = 0; i < hf->n; i++) {
+        tick_one(hf->srcs[i]);
+    }
+}
+
+int
+rrd_hf_tick(RRD_PLUGIN * plugin)
+{
+    assert(plugin);
+    struct rrd_hf  *hf = plugin->hf;
+
+    if (hf) {
+        pthread_mutex_lock(&hf->lock);
+        tick(hf);
+        pthread_mutex_unlock(&hf->lock);
+    }
+    return RRD_OK;
+}
+
+/*
+ * Make the current window visible to the derived sources and start a new
+ * window. A source that was not sampled since the last call is sampled
+ * now such that there is always at least one value.
+ */
+void
+rrd_hf_publish(RRD_PLUGIN * plugin)
+{
+    struct rrd_hf  *hf = plugin->hf;
+
+    pthread_mutex_lock(&hf->lock);
+    for (size_t i = 0; i < hf->n; i++) {
+        struct rrd_hf_src *src = hf->srcs[i];
+        if (src->cur.count == 0)
+            tick_one(src);
+        src->pub = src->cur;
+        src->cur.count = 0;
+    }
+    pthread_mutex_unlock(&hf->lock);
+}
+
+static void     *
+sampler(void *arg)
+{
+    struct rrd_hf  *hf = arg;
+    struct timespec due;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    pthread_mutex_lock(&hf->lock);
+    while (hf->running) {
+        tick(hf);
+        due.tv_sec += hf->interval.tv_sec;
+        due.tv_nsec += hf->interval.tv_nsec;
+        if (due.tv_nsec >= 1000000000) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000;
+        }
+        /*
+         * skip ticks that we missed
+         */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (due.tv_sec < now.tv_sec
+            || (due.tv_sec == now.tv_sec && due.tv_nsec < now.tv_nsec))
+            due = now;
+        while (hf->running
+               && pthread_cond_timedwait(&hf->wake, &hf->lock, &due) == 0);
+    }
+    pthread_mutex_unlock(&hf->lock);
+    return NULL;
+}
+
+int
+rrd_hf_start(RRD_PLUGIN * plugin, double interval)
+{
+    assert(plugin);
+    struct rrd_hf  *hf;
+    int             rc = RRD_OK;
+
+    if (!(interval > 0)) {
+        return RRD_ERROR;
+    }
+    hf = hf_get(plugin);
+    if (!hf) {
+        return RRD_ERROR;
+    }
+    pthread_mutex_lock(&hf->lock);
+    if (hf->running) {
+        rc = RRD_ERROR;
+    } else {
+        hf->interval.tv_sec = (time_t) interval;
+        hf->interval.tv_nsec = (long)((interval - hf->interval.tv_sec) * 1e9);
+        hf->running = 1;
+        if (pthread_create(&hf->sampler, NULL, sampler, hf) != 0) {
+            hf->running = 0;
+            rc = RRD_ERROR;
+        }
+    }
+    pthread_mutex_unlock(&hf->lock);
+    return rc;
+}
+
+int
+rrd_hf_stop(RRD_PLUGIN * plugin)
+{
+    assert(plugin);
+    struct rrd_hf  *hf = plugin->hf;
+    int             running;
+
+    if (!hf) {
+        return RRD_ERROR;
+    }
+    pthread_mutex_lock(&hf->lock);
+    running = hf->running;
+    hf->running = 0;
+    pthread_cond_signal(&hf->wake);
+    pthread_mutex_unlock(&hf->lock);
+    if (!running) {
+        return RRD_ERROR;
+    }
+    pthread_join(hf->sampler, NULL);
+    return RRD_OK;
+}
+
+/*
+ * Stop the sampler and release all high-frequency sources. The derived
+ * sources are not removed from the plugin because it is being closed.
+ */
+void
+rrd_hf_close(RRD_PLUGIN * plugin)
+{
+    struct rrd_hf  *hf = plugin->hf;
+
+    if (!hf)
+        return;
+    rrd_hf_stop(plugin);
+    for (size_t i = 0; i < hf->n; i++) {
+        src_free(hf->srcs[i]);
+    }
+    free(hf->srcs);
+    pthread_cond_destroy(&hf->wake);
+    pthread_mutex_destroy(&hf->lock);
+    free(hf);
+    plugin->hf = NULL;
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Histogram sources. Values are counted in log-linear buckets: values
+ * below 2^HIST_SUB_BITS have a bucket each; above, every power of two
+ * is split into 2^HIST_SUB_BITS buckets of equal width. This bounds
+ * the relative error of a reported value to 2^-(HIST_SUB_BITS + 1)
+ * over the whole range of uint64_t. Recording a value is a single
+ * relaxed atomic increment. rrd_sample() moves the counts into an
+ * accumulator (which decays) and computes the percentiles from it.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "librrd_private.h"
+
+#define HIST_SUB_BITS   5
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct rrd_hist {
+    uint64_t        buckets[HIST_BUCKETS];      /* updated by recorders */
+    double          acc[HIST_BUCKETS];  /* accumulated by rrd_sample */
+    RRD_HIST       *next;       /* list of histograms of a plugin */
+    RRD_SOURCE     *source;     /* as registered by the client */
+    double          decay;      /* weight of past intervals */
+    size_t          n;          /* number of percentiles */
+    double         *percentiles;        /* ascending */
+    RRD_SOURCE     *derived;    /* one source per percentile */
+    rrd_handle_t   *handles;    /* of derived */
+    rrd_value_t    *values;     /* reported by derived sources */
+    char           *names;      /* storage for names of derived sources */
+};
+
+static inline size_t
+bucket_of(uint64_t v)
+{
+    unsigned        shift;
+
+    if (v < HIST_SUB)
+        return v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (v >> shift) - HIST_SUB;
+}
+
+/*
+ * lowest value in a bucket and number of values in it
+ */
+static void
+bucket_range(size_t i, uint64_t * low, uint64_t * width)
+{
+    unsigned        shift;
+
+    if (i < HIST_SUB) {
+        *low = i;
+        *width = 1;
+        return;
+    }
+    shift = (i >> HIST_SUB_BITS) - 1;
+    *low = (uint64_t) (HIST_SUB + (i & (HIST_SUB - 1))) << shift;
+    *width = (uint64_t) 1 << shift;
+}
+
+void
+rrd_hist_record(RRD_HIST * hist, uint64_t value)
+{
+    __atomic_fetch_add(&hist->buckets[bucket_of(value)], 1,
+                       __ATOMIC_RELAXED);
+}
+
+static          rrd_value_t
+hist_sample(void *userdata)
+{
+    return *(rrd_value_t *) userdata;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double          x = *(const double *)a;
+    double          y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+hist_free(RRD_HIST * hist)
+{
+    free(hist->percentiles);
+    free(hist->derived);
+    free(hist->handles);
+    free(hist->values);
+    free(hist->names);
+    free(hist);
+}
+
+RRD_HIST       *
+rrd_add_hist_src(RRD_PLUGIN * plugin, RRD_SOURCE * source,
+                 const double *percentiles, size_t n, double decay)
+{
+    assert(plugin);
+    assert(source);
+    assert(percentiles);
+    RRD_HIST       *hist;
+    size_t          len;
+    size_t          i;
+
+    if (n == 0 || !(decay >= 0 && decay < 1)) {
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        if (!(percentiles[i] >= 0 && percentiles[i] <= 100))
+            return NULL;
+    }
+    len = strlen(source->name) + sizeof("_p100.000000");
+    hist = calloc(1, sizeof(RRD_HIST));
+    if (!hist) {
+        return NULL;
+    }
+    hist->percentiles = malloc(n * sizeof(double));
+    hist->derived = malloc(n * sizeof(RRD_SOURCE));
+    hist->handles = malloc(n * sizeof(rrd_handle_t));
+    hist->values = calloc(n, sizeof(rrd_value_t));
+    hist->names = malloc(n * len);
+    if (!hist->percentiles || !hist->derived || !hist->handles
+        || !hist->values || !hist->names) {
+        hist_free(hist);
+        return NULL;
+    }
+    hist->source = source;
+    hist->decay = decay;
+    hist->n = n;
+    memcpy(hist->percentiles, percentiles, n * sizeof(double));
+    qsort(hist->percentiles, n, sizeof(double), cmp_double);
+
+    for (i = 0; i < n; i++) {
+        RRD_SOURCE     *d = &hist->derived[i];
+        *d = *source;
+        d->name = hist->names + i * len;
+        snprintf(d->name, len, "%s_p%g", source->name, hist->percentiles[i]);
+        d->sample = hist_sample;
+        d->userdata = &hist->values[i];
+    }
+    for (i = 0; i < n; i++) {
+        if (rrd_add_src_handle(plugin, &hist->derived[i], &hist->handles[i])
+            != RRD_OK) {
+            while (i-- > 0)
+                rrd_del_src_handle(plugin, hist->handles[i]);
+            hist_free(hist);
+            return NULL;
+        }
+    }
+    hist->next = plugin->hist;
+    plugin->hist = hist;
+    return hist;
+}
+
+/*
+ * Remove a histogram source and the sources derived from it.
+ */
+int
+rrd_hist_del(RRD_PLUGIN * plugin, RRD_SOURCE * source)
+{
+    RRD_HIST      **p;
+    RRD_HIST       *hist;
+
+    for (p = &plugin->hist; *p; p = &(*p)->next) {
+        if ((*p)->source == source)
+            break;
+    }
+    if (!*p)
+        return RRD_NO_SUCH_SOURCE;
+    hist = *p;
+    *p = hist->next;
+    for (size_t i = 0; i < hist->n; i++) {
+        rrd_del_src_handle(plugin, hist->handles[i]);
+    }
+    hist_free(hist);
+    return RRD_OK;
+}
+
+/*
+ * Move the counts recorded since the last call into the accumulator and
+ * compute the percentiles from it in a single pass over the buckets.
+ */
+static void
+publish(RRD_HIST * hist)
+{
+    double          total = 0;
+    double          cum = 0;
+    size_t          p = 0;
+    size_t          i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t        count = __atomic_exchange_n(&hist->buckets[i], 0,
+                                                    __ATOMIC_RELAXED);
+        hist->acc[i] = hist->acc[i] * hist->decay + count;
+        total += hist->acc[i];
+    }
+    for (i = 0; i < HIST_BUCKETS && p < hist->n; i++) {
+        if (hist->acc[i] == 0)
+            continue;
+        cum += hist->acc[i];
+        while (p < hist->n && cum >= hist->percentiles[p] / 100 * total) {
+            uint64_t        low;
+            uint64_t        width;
+            bucket_range(i, &low, &width);
+            if (hist->source->type == RRD_INT64)
+                hist->values[p].int64 = (int64_t) (low + width / 2);
+            else
+                hist->values[p].float64 = low + (width - 1) / 2.0;
+            p++;
+        }
+    }
+    /*
+     * no values recorded
+     */
+    for (; p < hist->n; p++) {
+        if (hist->source->type == RRD_INT64)
+            hist->values[p].int64 = 0;
+        else
+            hist->values[p].float64 = NAN;
+    }
+}
+
+void
+rrd_hist_publish(RRD_PLUGIN * plugin)
+{
+    for (RRD_HIST * hist = plugin->hist; hist; hist = hist->next) {
+        publish(hist);
+    }
+}
+
+void
+rrd_hist_close(RRD_PLUGIN * plugin)
+{
+    RRD_HIST       *hist = plugin->hist;
+
+    while (hist) {
+        RRD_HIST       *next = hist->next;
+        hist_free(hist);
+        hist = next;
+    }
+    plugin->hist = NULL;
+}
@@ -0,0 +1,427 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * History of the values of every source, kept in memory and compressed
+ * as in Facebook's Gorilla time series database. The samples of a
+ * source are appended to a list of blocks of BLOCK_BITS bits. The first
+ * sample of a block is stored as is: its timestamp in milliseconds and
+ * its 64 bits. Later samples store the difference of the time since
+ * the previous sample to the one before (delta of delta) and the XOR
+ * of the bits of the value with the previous one:
+ *
+ * delta of delta  0                 '0'
+ *                 [-63, 64]         '10' and 7 bits
+ *                 [-255, 256]       '110' and 9 bits
+ *                 [-2047, 2048]     '1110' and 12 bits
+ *                 int32_t           '1111' and 32 bits
+ * XOR             0                 '0'
+ *                 within window     '10' and the bits in the window
+ *                 otherwise         '11', 6 bits of leading zeros, 6
+ *                                   bits of length - 1, and the bits
+ *
+ * The window is that of the last XOR stored with its leading zeros and
+ * length. A sample that does not fit into the current block starts a
+ * new one. Samples taken at a regular interval with values that don't
+ * change take two bits; a counter that grows a little every time takes
+ * one or two bytes. The bits of integers are encoded like those of
+ * floats, which works well for small changes of either.
+ *
+ * Blocks whose last sample is older than the history to keep are
+ * evicted when the plugin is sampled and reused for new samples.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "librrd_private.h"
+
+#define BLOCK_WORDS     64
+#define BLOCK_BITS      (BLOCK_WORDS * 64)
+#define SAMPLE_BITS     114     /* longest encoding of a sample */
+
+struct block {
+    struct block   *next;
+    int64_t         first;      /* timestamp in ms of the first sample */
+    int64_t         last;       /* timestamp in ms of the last sample */
+    uint32_t        count;      /* of samples */
+    uint32_t        bits;       /* used */
+    uint64_t        words[BLOCK_WORDS];
+};
+
+/*
+ * samples of a source and the state of the encoder after the last one
+ */
+struct series {
+    struct block   *head;
+    struct block   *tail;
+    int64_t         t;          /* timestamp in ms */
+    int64_t         delta;      /* to the timestamp before */
+    uint64_t        v;
+    int             lead;       /* window of the last XOR, -1: none */
+    int             trail;
+};
+
+struct rrd_history {
+    int64_t         span;       /* ms to keep */
+    struct series  *series;     /* per slot */
+    size_t          capacity;   /* number of elements in series */
+    struct block   *spare;      /* evicted blocks */
+};
+
+static void
+put_bits(struct block *b, uint64_t v, unsigned n)
+{
+    unsigned        w = b->bits >> 6;
+    unsigned        room = 64 - (b->bits & 63);
+
+    if (n == 0)
+        return;
+    if (n <= room) {
+        b->words[w] |= v << (room - n);
+    } else {
+        b->words[w] |= v >> (n - room);
+        b->words[w + 1] |= v << (64 - (n - room));
+    }
+    b->bits += n;
+}
+
+static          uint64_t
+get_bits(const struct block *b, uint32_t * pos, unsigned n)
+{
+    unsigned        w = *pos >> 6;
+    unsigned        o = *pos & 63;
+    uint64_t        v;
+
+    if (n == 0)
+        return 0;
+    v = b->words[w] << o;
+    if (o + n > 64)
+        v |= b->words[w + 1] >> (64 - o);
+    *pos += n;
+    return n == 64 ? v : v >> (64 - n);
+}
+
+static struct block *
+new_block(struct rrd_history *history)
+{
+    struct block   *b = history->spare;
+
+    if (b) {
+        history->spare = b->next;
+    } else {
+        b = malloc(sizeof(struct block));
+        if (!b)
+            return NULL;
+    }
+    memset(b, 0, sizeof(struct block));
+    return b;
+}
+
+static void
+free_blocks(struct block *b)
+{
+    while (b) {
+        struct block   *next = b->next;
+        free(b);
+        b = next;
+    }
+}
+
+/*
+ * Store the delta of delta of a timestamp; returns -1 if it is out of
+ * range.
+ */
+static int
+put_dod(struct block *b, int64_t dod)
+{
+    if (dod == 0) {
+        put_bits(b, 0, 1);
+    } else if (dod >= -63 && dod <= 64) {
+        put_bits(b, 2, 2);
+        put_bits(b, dod + 63, 7);
+    } else if (dod >= -255 && dod <= 256) {
+        put_bits(b, 6, 3);
+        put_bits(b, dod + 255, 9);
+    } else if (dod >= -2047 && dod <= 2048) {
+        put_bits(b, 14, 4);
+        put_bits(b, dod + 2047, 12);
+    } else if (dod >= INT32_MIN && dod <= INT32_MAX) {
+        put_bits(b, 15, 4);
+        put_bits(b, (uint32_t) dod, 32);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static          int64_t
+get_dod(const struct block *b, uint32_t * pos)
+{
+    if (!get_bits(b, pos, 1))
+        return 0;
+    if (!get_bits(b, pos, 1))
+        return (int64_t) get_bits(b, pos, 7) - 63;
+    if (!get_bits(b, pos, 1))
+        return (int64_t) get_bits(b, pos, 9) - 255;
+    if (!get_bits(b, pos, 1))
+        return (int64_t) get_bits(b, pos, 12) - 2047;
+    return (int32_t) get_bits(b, pos, 32);
+}
+
+static void
+put_xor(struct block *b, struct series *s, uint64_t x)
+{
+    int             lead;
+    int             trail;
+
+    if (x == 0) {
+        put_bits(b, 0, 1);
+        return;
+    }
+    lead = __builtin_clzll(x);
+    trail = __builtin_ctzll(x);
+    if (s->lead >= 0 && lead >= s->lead && trail >= s->trail) {
+        put_bits(b, 2, 2);
+        put_bits(b, x >> s->trail, 64 - s->lead - s->trail);
+    } else {
+        put_bits(b, 3, 2);
+        put_bits(b, lead, 6);
+        put_bits(b, 64 - lead - trail - 1, 6);
+        put_bits(b, x >> trail, 64 - lead - trail);
+        s->lead = lead;
+        s->trail = trail;
+    }
+}
+
+static          uint64_t
+get_xor(const struct block *b, uint32_t * pos, int *lead, int *trail)
+{
+    int             len;
+
+    if (!get_bits(b, pos, 1))
+        return 0;
+    if (get_bits(b, pos, 1)) {
+        *lead = (int) get_bits(b, pos, 6);
+        len = (int) get_bits(b, pos, 6) + 1;
+        *trail = 64 - *lead - len;
+    }
+    return get_bits(b, pos, 64 - *lead - *trail) << *trail;
+}
+
+/*
+ * Append a sample to a series, starting a new block when it does not
+ * fit into the last one.
+ */
+static void
+append(struct rrd_history *history, struct series *s, int64_t t, uint64_t v)
+{
+    struct block   *b = s->tail;
+    int64_t         delta = t - s->t;
+
+    if (b && b->bits + SAMPLE_BITS <= BLOCK_BITS
+        && put_dod(b, delta - s->delta) == 0) {
+        put_xor(b, s, v ^ s->v);
+    } else {
+        b = new_block(history);
+        if (!b)
+            return;
+        put_bits(b, (uint64_t) t, 64);
+        put_bits(b, v, 64);
+        b->first = t;
+        delta = 0;
+        s->lead = -1;
+        if (s->tail)
+            s->tail->next = b;
+        else
+            s->head = b;
+        s->tail = b;
+    }
+    b->last = t;
+    b->count++;
+    s->t = t;
+    s->delta = delta;
+    s->v = v;
+}
+
+int
+rrd_set_history(RRD_PLUGIN * plugin, double seconds)
+{
+    assert(plugin);
+    struct rrd_history *history = plugin->history;
+
+    if (!(seconds >= 0 && seconds < 1e12)) {
+        return RRD_ERROR;
+    }
+    if (seconds == 0) {
+        if (history) {
+            for (size_t i = 0; i < history->capacity; i++) {
+                free_blocks(history->series[i].head);
+            }
+            free_blocks(history->spare);
+            free(history->series);
+        }
+        free(history);
+        plugin->history = NULL;
+        return RRD_OK;
+    }
+    if (!history) {
+        history = calloc(1, sizeof(struct rrd_history));
+        if (!history) {
+            return RRD_ERROR;
+        }
+        plugin->history = history;
+        if (rrd_history_resize(plugin, plugin->capacity) != 0) {
+            free(history);
+            plugin->history = NULL;
+            return RRD_ERROR;
+        }
+    }
+    history->span = llround(seconds * 1e3);
+    return RRD_OK;
+}
+
+int
+rrd_history_query(RRD_PLUGIN * plugin, const char *name, double from,
+                  double to, rrd_history_t cb, void *userdata)
+{
+    assert(plugin);
+    assert(name);
+    assert(cb);
+    int32_t         slot;
+    int64_t         t_from = llround(from * 1e3);
+    int64_t         t_to = llround(to * 1e3);
+
+    if (!plugin->history) {
+        return RRD_ERROR;
+    }
+    slot = rrd_index_find(plugin, name);
+    if (slot < 0) {
+        return RRD_NO_SUCH_SOURCE;
+    }
+    for (struct block * b = plugin->history->series[slot].head; b;
+         b = b->next) {
+        uint32_t        pos = 0;
+        int64_t         t;
+        int64_t         delta = 0;
+        rrd_value_t     v;
+        int             lead = 0;
+        int             trail = 0;
+
+        if (b->last < t_from)
+            continue;
+        if (b->first > t_to)
+            break;
+        t = (int64_t) get_bits(b, &pos, 64);
+        v.int64 = (int64_t) get_bits(b, &pos, 64);
+        for (uint32_t i = 0; i < b->count; i++) {
+            if (i > 0) {
+                delta += get_dod(b, &pos);
+                t += delta;
+                v.int64 ^= (int64_t) get_xor(b, &pos, &lead, &trail);
+            }
+            if (t > t_to)
+                break;
+            if (t >= t_from && cb(t / 1e3, v, userdata) != 0)
+                return RRD_OK;
+        }
+    }
+    return RRD_OK;
+}
+
+/*
+ * Append the values of the last sample to the history of every source
+ * and evict old blocks. A sample that can't be stored for lack of
+ * memory is lost.
+ */
+void
+rrd_history_sample(RRD_PLUGIN * plugin, double timestamp)
+{
+    struct rrd_history *history = plugin->history;
+    int64_t         t = llround(timestamp * 1e3);
+    int64_t         cutoff = t - history->span;
+
+    for (uint32_t i = 0; i < plugin->n; i++) {
+        struct series  *s = &history->series[plugin->live[i].slot];
+        while (s->head && s->head != s->tail && s->head->last < cutoff) {
+            struct block   *b = s->head;
+            s->head = b->next;
+            b->next = history->spare;
+            history->spare = b;
+        }
+        append(history, s, t, (uint64_t) plugin->values[i]);
+    }
+}
+
+int
+rrd_history_resize(RRD_PLUGIN * plugin, size_t capacity)
+{
+    struct rrd_history *history = plugin->history;
+    struct series  *series;
+
+    series = realloc(history->series, capacity * sizeof(struct series));
+    if (!series)
+        return -1;
+    if (capacity > history->capacity)
+        memset(series + history->capacity, 0,
+               (capacity - history->capacity) * sizeof(struct series));
+    history->series = series;
+    history->capacity = capacity;
+    return 0;
+}
+
+/*
+ * discard the history of a slot when its source is removed
+ */
+void
+rrd_history_reset(RRD_PLUGIN * plugin, size_t slot)
+{
+    struct series  *s = &plugin->history->series[slot];
+
+    free_blocks(s->head);
+    memset(s, 0, sizeof(struct series));
+}
+
+void
+rrd_history_usage(RRD_PLUGIN * plugin, size_t * samples, size_t * bits,
+                  size_t * bytes)
+{
+    struct rrd_history *history = plugin->history;
+
+    *samples = 0;
+    *bits = 0;
+    *bytes = 0;
+    if (!history)
+        return;
+    for (size_t i = 0; i < history->capacity; i++) {
+        for (struct block * b = history->series[i].head; b; b = b->next) {
+            *samples += b->count;
+            *bits += b->bits;
+            *bytes += sizeof(struct block);
+        }
+    }
+}
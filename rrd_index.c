@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Index of the names of the sources in the slots of a plugin. This is
+ * an open addressing hash table with linear probing that is at most
+ * half full. An entry is removed by shifting the entries following it
+ * back rather than by leaving a tombstone, so the table does not
+ * degrade when sources are added and removed repeatedly. The table is
+ * rebuilt when the number of slots grows.
+ */
+
+#include <string.h>
+
+#include "librrd_private.h"
+
+struct rrd_index_entry {
+    uint32_t        hash;       /* of the name of the source */
+    int32_t         slot;       /* -1: entry is empty */
+};
+
+/*
+ * FNV-1a followed by the finaliser of MurmurHash3: FNV-1a alone leaves
+ * the high bits poorly mixed for short names that differ only at the
+ * end.
+ */
+uint32_t
+rrd_hash_name(const char *name)
+{
+    uint32_t        h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static size_t
+index_size(size_t capacity)
+{
+    size_t          size = 4;
+
+    while (size < 2 * capacity)
+        size *= 2;
+    return size;
+}
+
+/*
+ * bytes needed by rrd_index_place() for a plugin with capacity slots
+ */
+size_t
+rrd_index_bytes(size_t capacity)
+{
+    return index_size(capacity) * sizeof(struct rrd_index_entry);
+}
+
+/*
+ * Use mem of rrd_index_bytes() for the index of a plugin and enter the
+ * sources in its slots.
+ */
+void
+rrd_index_place(RRD_PLUGIN * plugin, void *mem)
+{
+    struct rrd_index_entry *index = mem;
+    size_t          size = index_size(plugin->capacity);
+    size_t          i;
+
+    for (i = 0; i < size; i++)
+        index[i].slot = -1;
+    plugin->index = index;
+    plugin->index_mask = size - 1;
+    for (i = 0; i < plugin->capacity; i++) {
+        if (plugin->sources[i])
+            rrd_index_insert(plugin, (int32_t) i);
+    }
+}
+
+int32_t
+rrd_index_find(RRD_PLUGIN * plugin, const char *name)
+{
+    uint32_t        h = rrd_hash_name(name);
+    size_t          i;
+
+    for (i = h & plugin->index_mask; plugin->index[i].slot >= 0;
+         i = (i + 1) & plugin->index_mask) {
+        struct rrd_index_entry *e = &plugin->index[i];
+        if (e->hash == h && strcmp(plugin->sources[e->slot]->name, name) == 0)
+            return e->slot;
+    }
+    return -1;
+}
+
+int
+rrd_index_insert(RRD_PLUGIN * plugin, int32_t slot)
+{
+    const char     *name = plugin->sources[slot]->name;
+    uint32_t        h = rrd_hash_name(name);
+    size_t          i;
+
+    for (i = h & plugin->index_mask; plugin->index[i].slot >= 0;
+         i = (i + 1) & plugin->index_mask) {
+        struct rrd_index_entry *e = &plugin->index[i];
+        if (e->hash == h && strcmp(plugin->sources[e->slot]->name, name) == 0)
+            return -1;
+    }
+    plugin->index[i].hash = h;
+    plugin->index[i].slot = slot;
+    return 0;
+}
+
+void
+rrd_index_remove(RRD_PLUGIN * plugin, int32_t slot)
+{
+    struct rrd_index_entry *index = plugin->index;
+    size_t          mask = plugin->index_mask;
+    size_t          i = rrd_hash_name(plugin->sources[slot]->name) & mask;
+    size_t          j;
+
+    while (index[i].slot != slot) {
+        if (index[i].slot < 0)
+            return;
+        i = (i + 1) & mask;
+    }
+    /*
+     * move every following entry of the cluster into the hole unless
+     * its home position lies cyclically after the hole
+     */
+    for (j = (i + 1) & mask; index[j].slot >= 0; j = (j + 1) & mask) {
+        size_t          home = index[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index[i] = index[j];
+            i = j;
+        }
+    }
+    index[i].slot = -1;
+}
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * A single-threaded event loop that calls rrd_sample() for many plugins.
+ * All timers are kept in a binary min-heap ordered by their next due
+ * time and a single timerfd is armed for the earliest one. The timerfd
+ * and an eventfd (used to stop the loop) are registered with an epoll
+ * instance whose descriptor is exported, such that the loop can be
+ * embedded into an existing event loop of an application.
+ *
+ * Due times are wall-clock times. When the clock is set, the timerfd
+ * is cancelled (TFD_TIMER_CANCEL_ON_SET) and all timers are scheduled
+ * again from the new time; otherwise setting the clock back would stop
+ * sampling until the clock had caught up with the old due times.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "librrd_private.h"
+
+#define NSEC 1000000000LL
+
+struct rrd_timer {
+    int64_t         due;        /* next sample, ns since the epoch */
+    int64_t         interval;   /* ns */
+    int64_t         phase;      /* ns, 0 <= phase < interval */
+    RRD_PLUGIN     *plugin;
+};
+
+struct rrd_loop {
+    struct rrd_timer *heap;     /* min-heap ordered by due */
+    size_t          n;          /* number of timers in heap */
+    size_t          size;       /* allocated slots in heap */
+    int             epoll;      /* exported descriptor */
+    int             timer;      /* timerfd, armed for heap[0] */
+    int             event;      /* eventfd, signals rrd_loop_stop */
+    volatile int    stop;
+};
+
+static int64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/*
+ * Return the first point in time after now that is phase ns past a
+ * multiple of interval. Missed samples are skipped rather than
+ * replayed.
+ */
+static int64_t
+next_due(int64_t now, int64_t interval, int64_t phase)
+{
+    return ((now - phase) / interval + 1) * interval + phase;
+}
+
+static void
+swap(struct rrd_timer *heap, size_t i, size_t j)
+{
+    struct rrd_timer tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+static void
+sift_up(struct rrd_timer *heap, size_t i)
+{
+    while (i > 0) {
+        size_t          parent = (i - 1) / 2;
+        if (heap[parent].due <= heap[i].due)
+            break;
+        swap(heap, i, parent);
+        i = parent;
+    }
+}
+
+static void
+sift_down(struct rrd_timer *heap, size_t n, size_t i)
+{
+    for (;;) {
+        size_t          min = i;
+        size_t          left = 2 * i + 1;
+        size_t          right = left + 1;
+        if (left < n && heap[left].due < heap[min].due)
+            min = left;
+        if (right < n && heap[right].due < heap[min].due)
+            min = right;
+        if (min == i)
+            break;
+        swap(heap, i, min);
+        i = min;
+    }
+}
+
+/*
+ * Schedule all timers again from now, after the clock was set.
+ */
+static void
+reschedule(RRD_LOOP * loop, int64_t now)
+{
+    for (size_t i = 0; i < loop->n; i++) {
+        struct rrd_timer *timer = &loop->heap[i];
+        timer->due = next_due(now, timer->interval, timer->phase);
+    }
+    for (size_t i = loop->n / 2; i > 0; i--)
+        sift_down(loop->heap, loop->n, i - 1);
+}
+
+/*
+ * arm the timerfd for the earliest timer or disarm it if there is none.
+ */
+static int
+arm(RRD_LOOP * loop)
+{
+    struct itimerspec its = { {0, 0}, {0, 0} };
+
+    if (loop->n > 0) {
+        its.it_value.tv_sec = loop->heap[0].due / NSEC;
+        its.it_value.tv_nsec = loop->heap[0].due % NSEC;
+    }
+    if (timerfd_settime(loop->timer,
+                        TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its,
+                        NULL) != 0)
+        return RRD_ERROR;
+    return RRD_OK;
+}
+
+static int
+watch(int epoll, int fd)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * rrd_loop_open creates a loop without any plugins.
+ */
+RRD_LOOP       *
+rrd_loop_open(void)
+{
+    RRD_LOOP       *loop = calloc(1, sizeof(RRD_LOOP));
+    if (!loop) {
+        return NULL;
+    }
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epoll == -1 || loop->timer == -1 || loop->event == -1
+        || watch(loop->epoll, loop->timer) != 0
+        || watch(loop->epoll, loop->event) != 0) {
+        rrd_loop_close(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+/*
+ * rrd_loop_close releases the loop. The plugins that were added to it
+ * are not closed.
+ */
+int
+rrd_loop_close(RRD_LOOP * loop)
+{
+    assert(loop);
+    int             rc = RRD_OK;
+
+    if (loop->epoll != -1 && close(loop->epoll) != 0)
+        rc = RRD_FILE_ERROR;
+    if (loop->timer != -1 && close(loop->timer) != 0)
+        rc = RRD_FILE_ERROR;
+    if (loop->event != -1 && close(loop->event) != 0)
+        rc = RRD_FILE_ERROR;
+    free(loop->heap);
+    free(loop);
+    return rc;
+}
+
+int
+rrd_loop_add(RRD_LOOP * loop, RRD_PLUGIN * plugin, double interval,
+             double phase)
+{
+    assert(loop);
+    assert(plugin);
+    struct rrd_timer *timer;
+
+    if (!(interval > 0) || !(phase >= 0) || !(phase < interval)) {
+        return RRD_ERROR;
+    }
+    if (loop->n == loop->size) {
+        size_t          size = loop->size ? 2 * loop->size : 16;
+        timer = realloc(loop->heap, size * sizeof(struct rrd_timer));
+        if (!timer) {
+            return RRD_ERROR;
+        }
+        loop->heap = timer;
+        loop->size = size;
+    }
+    timer = &loop->heap[loop->n];
+    timer->plugin = plugin;
+    timer->interval = (int64_t) (interval * NSEC);
+    timer->phase = (int64_t) (phase * NSEC);
+    if (timer->interval == 0) {
+        return RRD_ERROR;
+    }
+    timer->due = next_due(now_ns(), timer->interval, timer->phase);
+    sift_up(loop->heap, loop->n++);
+    return arm(loop);
+}
+
+int
+rrd_loop_del(RRD_LOOP * loop, RRD_PLUGIN * plugin)
+{
+    assert(loop);
+    assert(plugin);
+    size_t          i;
+
+    for (i = 0; i < loop->n; i++) {
+        if (loop->heap[i].plugin == plugin)
+            break;
+    }
+    if (i >= loop->n) {
+        return RRD_NO_SUCH_PLUGIN;
+    }
+    loop->n--;
+    if (i < loop->n) {
+        loop->heap[i] = loop->heap[loop->n];
+        sift_up(loop->heap, i);
+        sift_down(loop->heap, loop->n, i);
+    }
+    return arm(loop);
+}
+
+int
+rrd_loop_fd(RRD_LOOP * loop)
+{
+    assert(loop);
+    return loop->epoll;
+}
+
+/*
+ * Sample all plugins that are due and re-schedule them. The clock is
+ * read once and all of them report the same timestamp. Reading the
+ * timerfd fails with ECANCELED when the clock was set; a timer due more
+ * than one interval from now means the same. In both cases all timers
+ * are scheduled again before sampling.
+ * This never blocks. Sampling continues when a plugin reports an
+ * error; the first error is returned.
+ */
+int
+rrd_loop_dispatch(RRD_LOOP * loop)
+{
+    assert(loop);
+    uint64_t        expirations;
+    int64_t         now;
+    double          timestamp;
+    int             rc = RRD_OK;
+    int             set = 0;
+
+    /*
+     * drain both descriptors such that they are no longer readable
+     */
+    while (read(loop->timer, &expirations, sizeof(expirations)) == -1) {
+        if (errno != EINTR) {
+            set = errno == ECANCELED;
+            break;
+        }
+    }
+    while (read(loop->event, &expirations, sizeof(expirations)) == -1
+           && errno == EINTR);
+
+    now = now_ns();
+    if (loop->n > 0 && loop->heap[0].due - now > loop->heap[0].interval)
+        set = 1;
+    if (set)
+        reschedule(loop, now);
+    timestamp = (double) now / NSEC;
+    while (loop->n > 0 && loop->heap[0].due <= now) {
+        struct rrd_timer *timer = &loop->heap[0];
+        int             sampled = rrd_sample_at(timer->plugin, timestamp);
+        if (sampled != RRD_OK && rc == RRD_OK)
+            rc = sampled;
+        timer->due = next_due(now, timer->interval, timer->phase);
+        sift_down(loop->heap, loop->n, 0);
+    }
+    if (arm(loop) != RRD_OK && rc == RRD_OK)
+        rc = RRD_ERROR;
+    return rc;
+}
+
+/*
+ * Move all due times by seconds, as if the clock was set back by that
+ * much, without cancelling the timerfd. Only for tests.
+ */
+void
+rrd_loop_skew(RRD_LOOP * loop, double seconds)
+{
+    assert(loop);
+
+    for (size_t i = 0; i < loop->n; i++)
+        loop->heap[i].due += (int64_t) (seconds * NSEC);
+    arm(loop);
+}
+
+/*
+ * Run the loop until rrd_loop_stop() is called.
+ */
+int
+rrd_loop_run(RRD_LOOP * loop)
+{
+    assert(loop);
+    struct epoll_event ev[2];
+    int             rc = RRD_OK;
+
+    loop->stop = 0;
+    while (!loop->stop) {
+        if (epoll_wait(loop->epoll, ev, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            return RRD_ERROR;
+        }
+        int             dispatched = rrd_loop_dispatch(loop);
+        if (dispatched != RRD_OK && rc == RRD_OK)
+            rc = dispatched;
+    }
+    return rc;
+}
+
+/*
+ * Ask rrd_loop_run() to return. This is safe to call from a sample()
+ * function, another thread, or a signal handler.
+ */
+void
+rrd_loop_stop(RRD_LOOP * loop)
+{
+    assert(loop);
+    uint64_t        one = 1;
+
+    loop->stop = 1;
+    while (write(loop->event, &one, sizeof(one)) == -1 && errno == EINTR);
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Concurrent mode. Writers serialise on a mutex, change the source
+ * table of the plugin, and publish an immutable snapshot of it with an
+ * atomic pointer exchange. The single sampler never takes the mutex: it
+ * announces the epoch in which it picked up the current snapshot and
+ * announces being idle when done. A replaced snapshot is retired with
+ * the epoch that its replacement started; it is freed once the sampler
+ * is idle or announced that epoch or a later one, because then it
+ * picked up the replacement or a newer snapshot.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "librrd_private.h"
+
+#define IDLE UINT64_MAX
+
+struct rrd_rcu {
+    pthread_mutex_t lock;       /* serialises writers */
+    struct rrd_snap *snap;      /* current snapshot, may be NULL */
+    uint64_t        epoch;      /* incremented by every publication */
+    uint64_t        reader;     /* epoch announced by sampler or IDLE */
+    struct rrd_snap *retired;   /* list of replaced snapshots */
+};
+
+static void
+snap_free(struct rrd_snap *snap)
+{
+    free(snap);
+}
+
+/*
+ * free retired snapshots the sampler can no longer use
+ */
+static void
+reclaim(struct rrd_rcu *rcu)
+{
+    uint64_t        reader = __atomic_load_n(&rcu->reader, __ATOMIC_SEQ_CST);
+    struct rrd_snap **p = &rcu->retired;
+
+    while (*p) {
+        struct rrd_snap *snap = *p;
+        if (reader == IDLE || reader >= snap->retired) {
+            *p = snap->next;
+            snap_free(snap);
+        } else {
+            p = &snap->next;
+        }
+    }
+}
+
+int
+rrd_set_concurrent(RRD_PLUGIN * plugin, int on)
+{
+    assert(plugin);
+    struct rrd_rcu *rcu = plugin->rcu;
+    pthread_mutexattr_t attr;
+
+    if (!on) {
+        if (rcu) {
+            snap_free(rcu->snap);
+            rcu->reader = IDLE;
+            reclaim(rcu);
+            pthread_mutex_destroy(&rcu->lock);
+            free(rcu);
+            plugin->rcu = NULL;
+        }
+        return RRD_OK;
+    }
+    if (rcu)
+        return RRD_OK;
+    if (plugin->fixed)
+        return RRD_ERROR;
+    rcu = calloc(1, sizeof(struct rrd_rcu));
+    if (!rcu)
+        return RRD_ERROR;
+    rcu->snap = rrd_snapshot(plugin);
+    if (!rcu->snap) {
+        free(rcu);
+        return RRD_ERROR;
+    }
+    rcu->reader = IDLE;
+    /*
+     * rrd_del_src() takes the lock and calls rrd_del_src_handle()
+     */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&rcu->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    plugin->rcu = rcu;
+    return RRD_OK;
+}
+
+void
+rrd_rcu_lock(RRD_PLUGIN * plugin)
+{
+    if (plugin->rcu)
+        pthread_mutex_lock(&plugin->rcu->lock);
+}
+
+void
+rrd_rcu_unlock(RRD_PLUGIN * plugin)
+{
+    if (plugin->rcu)
+        pthread_mutex_unlock(&plugin->rcu->lock);
+}
+
+void
+rrd_rcu_publish(RRD_PLUGIN * plugin, struct rrd_snap *snap, int wait)
+{
+    struct rrd_rcu *rcu = plugin->rcu;
+    struct rrd_snap *old;
+
+    old = __atomic_exchange_n(&rcu->snap, snap, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->retired = __atomic_add_fetch(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+        old->next = rcu->retired;
+        rcu->retired = old;
+    }
+    reclaim(rcu);
+    while (wait && rcu->retired) {
+        sched_yield();
+        reclaim(rcu);
+    }
+}
+
+struct rrd_snap *
+rrd_rcu_enter(RRD_PLUGIN * plugin)
+{
+    struct rrd_rcu *rcu = plugin->rcu;
+
+    __atomic_store_n(&rcu->reader,
+                     __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&rcu->snap, __ATOMIC_SEQ_CST);
+}
+
+void
+rrd_rcu_exit(RRD_PLUGIN * plugin)
+{
+    __atomic_store_n(&plugin->rcu->reader, IDLE, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Recordings of the samples of a plugin for offline analysis. A
+ * recording starts with RECORD_MAGIC and is followed by records, each
+ * starting with its size in bytes (including the size) as a big-endian
+ * uint32_t and a tag byte:
+ *
+ * 'M' meta data: the checksum of the meta data and the meta data
+ *     section of the file, its length followed by the JSON text
+ * 'S' sample: the file from the checksum of the values up to the last
+ *     value - checksums, number of values, timestamp, and values
+ *
+ * A meta data record precedes the first sample and every sample with
+ * different meta data. All data is copied as written to the file and
+ * hence big-endian. A size of 0 marks the end of a recording that was
+ * not stopped.
+ *
+ * The file is written through a window mapped into memory, such that a
+ * record costs a copy. The file is extended with posix_fallocate()
+ * before a window is mapped, which reserves the disk space and avoids a
+ * SIGBUS when the disk is full, and the window is populated for writing
+ * when it is mapped rather than faulted in page by page on every
+ * record. When a record does not fit into the window, the window moves
+ * to the page holding the end of the recording. The first window is
+ * RECORD_WINDOW bytes; every move doubles it until it holds RECORD_AHEAD
+ * records of the size being written or reaches RECORD_WINDOW_MAX, such
+ * that short recordings stay small and large samples rarely pay for a
+ * move. Written pages are flushed
+ * every sync seconds (of the timestamps of the samples) and when the
+ * recording stops, which truncates it to its size.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "librrd_private.h"
+
+#define RECORD_MAGIC    "RRDREC01"
+#define RECORD_MAGIC_SIZE 8
+#define RECORD_WINDOW   (1 << 20)
+#define RECORD_WINDOW_MAX (1 << 26)
+#define RECORD_AHEAD    256     /* records a window should hold */
+#define RECORD_META     'M'
+#define RECORD_SAMPLE   'S'
+#define RECORD_HEADER   5       /* size and tag */
+
+/*
+ * MAP_POPULATE maps the pages of a shared mapping read-only, such that
+ * every page still faults on its first write; MADV_POPULATE_WRITE
+ * avoids that where it is available. Neither exists on macOS.
+ */
+#if defined(MADV_POPULATE_WRITE) || !defined(MAP_POPULATE)
+#define RECORD_MMAP     MAP_SHARED
+#else
+#define RECORD_MMAP     (MAP_SHARED | MAP_POPULATE)
+#endif
+
+struct rrd_record {
+    int             fd;
+    char           *map;        /* window or NULL */
+    size_t          map_offset; /* in the file */
+    size_t          map_size;
+    size_t          window;     /* size of the next window */
+    size_t          end;        /* of the recording */
+    size_t          reserved;   /* size of the file */
+    size_t          synced;     /* end of the recording at the last sync */
+    double          sync;       /* interval, 0: at the end only */
+    double          sync_due;   /* timestamp */
+    uint32_t        meta_crc;
+    int             meta;       /* meta data was recorded */
+};
+
+static size_t   page_size;
+
+/*
+ * Extend the file by len bytes from offset and reserve the disk space.
+ * macOS has no posix_fallocate(); the file is only extended there.
+ */
+static int
+extend(int fd, off_t offset, off_t len)
+{
+#ifdef __APPLE__
+    return ftruncate(fd, offset + len) == 0 ? 0 : errno;
+#else
+    return posix_fallocate(fd, offset, len);
+#endif
+}
+
+/*
+ * fdatasync() is optional in POSIX and missing on macOS
+ */
+static int
+sync_data(int fd)
+{
+#if defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+/*
+ * Flush what was written since the last sync. Pages of earlier windows
+ * are no longer mapped; they are flushed with the file.
+ */
+static int
+flush(struct rrd_record *record)
+{
+    size_t          from = record->synced & ~(page_size - 1);
+    int             rc;
+
+    if (record->end == record->synced)
+        return 0;
+    if (record->map && from >= record->map_offset)
+        rc = msync(record->map + (from - record->map_offset),
+                   record->end - from, MS_SYNC);
+    else
+        rc = sync_data(record->fd);
+    if (rc != 0)
+        return -1;
+    record->synced = record->end;
+    return 0;
+}
+
+/*
+ * Return a pointer to size bytes at the end of the recording.
+ */
+static char    *
+reserve(struct rrd_record *record, size_t size)
+{
+    size_t          offset;
+    size_t          map_size;
+    int             rc;
+
+    if (record->map
+        && record->end + size <= record->map_offset + record->map_size)
+        return record->map + (record->end - record->map_offset);
+
+    if (record->map) {
+        munmap(record->map, record->map_size);
+        record->map = NULL;
+    }
+    offset = record->end & ~(page_size - 1);
+    map_size = record->end + size - offset;
+    map_size = (map_size + page_size - 1) & ~(page_size - 1);
+    if (record->window < RECORD_WINDOW)
+        record->window = RECORD_WINDOW;
+    else if (record->window < RECORD_WINDOW_MAX
+             && record->window < RECORD_AHEAD * size)
+        record->window *= 2;
+    if (map_size < record->window)
+        map_size = record->window;
+    if (offset + map_size > record->reserved) {
+        rc = extend(record->fd, record->reserved,
+                    offset + map_size - record->reserved);
+        if (rc != 0)
+            return NULL;
+        record->reserved = offset + map_size;
+    }
+    record->map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                       RECORD_MMAP, record->fd, offset);
+    if (record->map == MAP_FAILED) {
+        record->map = NULL;
+        return NULL;
+    }
+#ifdef MADV_POPULATE_WRITE
+    /*
+     * this fails before Linux 5.14, where pages are faulted in instead
+     */
+    madvise(record->map, map_size, MADV_POPULATE_WRITE);
+#endif
+    record->map_offset = offset;
+    record->map_size = map_size;
+    return record->map + (record->end - offset);
+}
+
+static int
+append(struct rrd_record *record, int tag, const void *data,
+       size_t size, const void *more, size_t more_size)
+{
+    uint32_t        total = htonl(RECORD_HEADER + size + more_size);
+    char           *p = reserve(record, RECORD_HEADER + size + more_size);
+
+    if (!p)
+        return -1;
+    memcpy(p, &total, sizeof(total));
+    p[4] = (char) tag;
+    memcpy(p + RECORD_HEADER, data, size);
+    if (more_size)
+        memcpy(p + RECORD_HEADER + size, more, more_size);
+    record->end += RECORD_HEADER + size + more_size;
+    return 0;
+}
+
+static int
+record_close(struct rrd_record *record)
+{
+    int             rc = flush(record);
+
+    if (record->map)
+        munmap(record->map, record->map_size);
+    if (ftruncate(record->fd, record->end) != 0)
+        rc = -1;
+    if (close(record->fd) != 0)
+        rc = -1;
+    free(record);
+    return rc;
+}
+
+int
+rrd_record_start(RRD_PLUGIN * plugin, const char *path, double sync)
+{
+    assert(plugin);
+    assert(path);
+    struct rrd_record *record;
+    char           *p;
+
+    if (plugin->record || !(sync >= 0)) {
+        return RRD_ERROR;
+    }
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+    record = calloc(1, sizeof(struct rrd_record));
+    if (!record) {
+        return RRD_ERROR;
+    }
+    record->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (record->fd < 0) {
+        free(record);
+        return RRD_FILE_ERROR;
+    }
+    record->sync = sync;
+    p = reserve(record, RECORD_MAGIC_SIZE);
+    if (!p) {
+        record_close(record);
+        return RRD_FILE_ERROR;
+    }
+    memcpy(p, RECORD_MAGIC, RECORD_MAGIC_SIZE);
+    record->end = RECORD_MAGIC_SIZE;
+    plugin->record = record;
+    return RRD_OK;
+}
+
+int
+rrd_record_stop(RRD_PLUGIN * plugin)
+{
+    assert(plugin);
+    int             rc;
+
+    if (!plugin->record) {
+        return RRD_ERROR;
+    }
+    rc = record_close(plugin->record);
+    plugin->record = NULL;
+    return rc == 0 ? RRD_OK : RRD_FILE_ERROR;
+}
+
+/*
+ * Record a sample. sample holds the sample as written to the file,
+ * from the checksum of the values on, and meta the meta data section
+ * with a checksum of meta_crc. When the recording fails, it is stopped.
+ */
+int
+rrd_record_sample(RRD_PLUGIN * plugin, double timestamp, uint32_t meta_crc,
+                  const void *sample, size_t sample_size,
+                  const void *meta, size_t meta_size)
+{
+    struct rrd_record *record = plugin->record;
+    int             rc = 0;
+
+    if (!record->meta || record->meta_crc != meta_crc) {
+        uint32_t        crc = htonl(meta_crc);
+        rc = append(record, RECORD_META, &crc, sizeof(crc), meta, meta_size);
+        record->meta_crc = meta_crc;
+        record->meta = 1;
+    }
+    if (rc == 0)
+        rc = append(record, RECORD_SAMPLE, sample, sample_size, NULL, 0);
+    if (rc == 0 && record->sync > 0 && timestamp >= record->sync_due) {
+        rc = flush(record);
+        record->sync_due = timestamp + record->sync;
+    }
+    if (rc != 0) {
+        rrd_record_stop(plugin);
+        return RRD_FILE_ERROR;
+    }
+    return RRD_OK;
+}
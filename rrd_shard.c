@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * A sharded plugin is a set of ordinary plugins, each with its own file.
+ * A source is placed by the hash of its name. The index of each plugin
+ * uses the low bits of the same hash, so the shard is chosen by the
+ * high bits: otherwise all names in a shard would share their low bits
+ * and crowd a fraction of the index.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "librrd_private.h"
+
+struct rrd_sharded {
+    size_t          n;          /* number of shards */
+    RRD_PLUGIN    **shards;
+    char           *names;      /* storage for names of shards */
+    char           *paths;      /* storage for paths of shards */
+};
+
+static void
+sharded_free(RRD_SHARDED * sharded)
+{
+    free(sharded->shards);
+    free(sharded->names);
+    free(sharded->paths);
+    free(sharded);
+}
+
+RRD_SHARDED    *
+rrd_shard_open(char *name, rrd_domain_t domain, char *path, size_t n)
+{
+    assert(name);
+    assert(path);
+    RRD_SHARDED    *sharded;
+    size_t          name_len = strlen(name) + 22;
+    size_t          path_len = strlen(path) + 22;
+    size_t          i;
+
+    if (n == 0) {
+        return NULL;
+    }
+    sharded = calloc(1, sizeof(RRD_SHARDED));
+    if (!sharded) {
+        return NULL;
+    }
+    sharded->shards = calloc(n, sizeof(RRD_PLUGIN *));
+    sharded->names = malloc(n * name_len);
+    sharded->paths = malloc(n * path_len);
+    if (!sharded->shards || !sharded->names || !sharded->paths) {
+        sharded_free(sharded);
+        return NULL;
+    }
+    sharded->n = n;
+    for (i = 0; i < n; i++) {
+        char           *shard_name = sharded->names + i * name_len;
+        char           *shard_path = sharded->paths + i * path_len;
+        snprintf(shard_name, name_len, "%s-%zu", name, i);
+        snprintf(shard_path, path_len, "%s.%zu", path, i);
+        sharded->shards[i] = rrd_open_sized(shard_name, domain, shard_path,
+                                            RRD_MAX_SOURCES);
+        if (!sharded->shards[i]) {
+            while (i-- > 0)
+                rrd_close(sharded->shards[i]);
+            sharded_free(sharded);
+            return NULL;
+        }
+    }
+    return sharded;
+}
+
+int
+rrd_shard_close(RRD_SHARDED * sharded)
+{
+    assert(sharded);
+    int             rc = RRD_OK;
+
+    for (size_t i = 0; i < sharded->n; i++) {
+        int             r = rrd_close(sharded->shards[i]);
+        if (rc == RRD_OK)
+            rc = r;
+    }
+    sharded_free(sharded);
+    return rc;
+}
+
+RRD_PLUGIN     *
+rrd_shard_of(RRD_SHARDED * sharded, const char *name)
+{
+    assert(sharded);
+    assert(name);
+    uint64_t        h = rrd_hash_name(name);
+
+    return sharded->shards[(h * sharded->n) >> 32];
+}
+
+RRD_PLUGIN     *
+rrd_shard_get(RRD_SHARDED * sharded, size_t i)
+{
+    assert(sharded);
+
+    return i < sharded->n ? sharded->shards[i] : NULL;
+}
+
+int
+rrd_shard_add_src(RRD_SHARDED * sharded, RRD_SOURCE * source)
+{
+    assert(source);
+    return rrd_add_src(rrd_shard_of(sharded, source->name), source);
+}
+
+int
+rrd_shard_del_src(RRD_SHARDED * sharded, RRD_SOURCE * source)
+{
+    assert(source);
+    return rrd_del_src(rrd_shard_of(sharded, source->name), source);
+}
+
+int
+rrd_shard_sample(RRD_SHARDED * sharded, time_t(*t) (time_t *))
+{
+    assert(sharded);
+    return rrd_shard_sample_at(sharded, get_timestamp());
+}
+
+/*
+ * Sample all shards with the same timestamp. Every shard is sampled
+ * even if an earlier one failed.
+ */
+int
+rrd_shard_sample_at(RRD_SHARDED * sharded, double timestamp)
+{
+    assert(sharded);
+    int             rc = RRD_OK;
+
+    for (size_t i = 0; i < sharded->n; i++) {
+        int             r = rrd_sample_at(sharded->shards[i], timestamp);
+        if (rc == RRD_OK)
+            rc = r;
+    }
+    return rc;
+}
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Sources contributed by several processes through a segment of shared
+ * memory. The segment is an array of slots. A process claims a free
+ * slot by a compare-and-swap of its owner word, which holds the
+ * generation of the slot, the pid of the owner, and the state of the
+ * slot, copies the description of the source into the slot, and marks
+ * it ready. The generation changes with every claim, such that the
+ * owner word of a slot claimed again by the same process differs. The
+ * publisher mirrors the ready slots as sources of an ordinary plugin;
+ * it reads the description of a slot like a sequence lock, checking the
+ * owner word again after copying. A slot whose owner no longer exists
+ * is freed by the publisher.
+ *
+ * An owner holds an open file description lock on the first byte of
+ * each slot it owns: taken before the slot is claimed and dropped after
+ * it is freed. The kernel drops the locks of a process that dies, so a
+ * slot whose lock is not held has no owner, independent of pid
+ * namespaces and reuse of pids. Without such locks the publisher falls
+ * back to checking whether the pid in the owner word exists, which is
+ * only correct for processes in its own pid namespace, and confuses a
+ * new process with a dead owner whose pid it reuses.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "librrd_private.h"
+
+#define SHM_MAGIC       0x52524453484d0002ull   /* "RRDSHM", version 2 */
+
+#define SLOT_FREE       0
+#define SLOT_BUSY       1       /* being claimed or released */
+#define SLOT_READY      2
+
+/*
+ * owner word: generation (32 bits), pid (24 bits), state (8 bits); a
+ * pid on Linux is below 2^22
+ */
+#define OWNER(gen, pid, state) \
+    ((uint64_t) (uint32_t) (gen) << 32 | (uint64_t) ((pid) & 0xffffff) << 8 \
+     | (state))
+#define OWNER_GEN(owner)  ((uint32_t) ((owner) >> 32))
+#define OWNER_PID(owner)  ((pid_t) ((owner) >> 8 & 0xffffff))
+#define OWNER_STATE(owner) ((owner) & 0xff)
+
+/*
+ * strings of a source; a NULL string is flagged in nulls
+ */
+#define SHM_NAME        128
+#define SHM_DESCRIPTION 256
+#define SHM_SHORT       48
+
+struct rrd_shm_slot {
+    uint64_t        owner;      /* OWNER(gen, pid, state) */
+    int64_t         value;      /* last value sampled by the owner */
+    int32_t         owner_type; /* rrd_owner_t */
+    int32_t         rrd_default;
+    int32_t         scale;
+    int32_t         type;
+    uint32_t        nulls;      /* bit i: string i is NULL */
+    char            name[SHM_NAME];
+    char            description[SHM_DESCRIPTION];
+    char            owner_uuid[SHM_SHORT];
+    char            units[SHM_SHORT];
+    char            min[SHM_SHORT];
+    char            max[SHM_SHORT];
+};
+
+struct rrd_shm_header {
+    uint64_t        magic;      /* set last by the creator */
+    uint64_t        slots;
+};
+
+/*
+ * a source of this process in a slot
+ */
+struct rrd_shm_own {
+    RRD_SOURCE     *source;
+    size_t          slot;
+};
+
+/*
+ * a slot as mirrored by the publisher
+ */
+struct rrd_shm_mirror {
+    uint64_t        owner;      /* owner word mirrored, 0: none */
+    rrd_handle_t    handle;
+    RRD_SOURCE      source;
+    struct rrd_shm_slot copy;   /* holds the strings of source */
+};
+
+struct rrd_shm {
+    struct rrd_shm_header *header;
+    struct rrd_shm_slot *slots;
+    size_t          n;          /* number of slots */
+    size_t          size;       /* of the mapping */
+    int             fd;         /* holds the locks on owned slots */
+    pid_t           pid;
+    struct rrd_shm_own *own;    /* sources of this process */
+    size_t          n_own;
+    size_t          size_own;
+    struct rrd_shm_mirror *mirror;      /* per slot, publisher only */
+};
+
+static int
+shm_map(RRD_SHM * shm, int fd, size_t size)
+{
+    void           *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                             fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    shm->header = p;
+    shm->slots = (struct rrd_shm_slot *)((char *)p
+                                         + sizeof(struct rrd_shm_header));
+    shm->size = size;
+    return 0;
+}
+
+RRD_SHM        *
+rrd_shm_open(const char *name, size_t slots)
+{
+    assert(name);
+    RRD_SHM        *shm;
+    struct stat     st;
+    size_t          size;
+    int             fd;
+
+    shm = calloc(1, sizeof(RRD_SHM));
+    if (!shm)
+        return NULL;
+    shm->pid = getpid();
+    size = sizeof(struct rrd_shm_header)
+        + slots * sizeof(struct rrd_shm_slot);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+        /*
+         * created the segment; it is zero filled, all slots are free
+         */
+        if (slots == 0 || ftruncate(fd, size) != 0
+            || shm_map(shm, fd, size) != 0) {
+            close(fd);
+            shm_unlink(name);
+            free(shm);
+            return NULL;
+        }
+        shm->header->slots = slots;
+        __atomic_store_n(&shm->header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    } else if (errno == EEXIST) {
+        /*
+         * attach; wait for the creator to size the segment
+         */
+        fd = shm_open(name, O_RDWR, 0);
+        for (int i = 0; fd >= 0 && i < 1000; i++) {
+            if (fstat(fd, &st) != 0 || st.st_size > 0)
+                break;
+            sched_yield();
+        }
+        if (fd < 0 || fstat(fd, &st) != 0
+            || (size_t) st.st_size < sizeof(struct rrd_shm_header)
+            || shm_map(shm, fd, st.st_size) != 0) {
+            if (fd >= 0)
+                close(fd);
+            free(shm);
+            return NULL;
+        }
+        /*
+         * wait for the creator to set the magic; a segment of another
+         * version, or one whose creator died, never gets it
+         */
+        for (int i = 0; i < 1000; i++) {
+            if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE)
+                == SHM_MAGIC)
+                break;
+            sched_yield();
+        }
+        slots = shm->header->slots;
+        if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE)
+            != SHM_MAGIC
+            || sizeof(struct rrd_shm_header)
+            + slots * sizeof(struct rrd_shm_slot) > shm->size) {
+            munmap(shm->header, shm->size);
+            close(fd);
+            free(shm);
+            return NULL;
+        }
+    } else {
+        free(shm);
+        return NULL;
+    }
+    shm->fd = fd;
+    shm->n = slots;
+    return shm;
+}
+
+/*
+ * lock, unlock, or test the lock of slot i
+ */
+#ifdef F_OFD_SETLK
+static int
+slot_lock(RRD_SHM * shm, size_t i, int cmd, short type)
+{
+    struct flock    fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = sizeof(struct rrd_shm_header)
+        + i * sizeof(struct rrd_shm_slot);
+    fl.l_len = 1;
+    if (fcntl(shm->fd, cmd, &fl) != 0)
+        return -1;
+    return cmd == F_OFD_GETLK && fl.l_type != F_UNLCK;
+}
+#endif
+
+static int
+own_slot(RRD_SHM * shm, size_t i)
+{
+    for (size_t k = 0; k < shm->n_own; k++)
+        if (shm->own[k].slot == i)
+            return 1;
+    return 0;
+}
+
+/*
+ * Returns 1 if the owner of slot i may still be alive.
+ */
+static int
+owner_alive(RRD_SHM * shm, size_t i, uint64_t owner)
+{
+    if (own_slot(shm, i))
+        return 1;
+#ifdef F_OFD_SETLK
+    /*
+     * a lock held by another open file description; if the lock can't
+     * be tested, assume the owner is alive
+     */
+    return slot_lock(shm, i, F_OFD_GETLK, F_WRLCK) != 0;
+#else
+    return kill(OWNER_PID(owner), 0) == 0 || errno != ESRCH;
+#endif
+}
+
+/*
+ * a string fits into a field of size bytes with its terminating NUL
+ */
+static int
+fits(const char *src, size_t size)
+{
+    return src == NULL || strlen(src) < size;
+}
+
+static void
+copy_string(char *dst, size_t size, const char *src, uint32_t * nulls,
+            int bit)
+{
+    if (src == NULL) {
+        *nulls |= 1u << bit;
+        dst[0] = 0;
+        return;
+    }
+    strncpy(dst, src, size - 1);
+    dst[size - 1] = 0;
+}
+
+int
+rrd_shm_add_src(RRD_SHM * shm, RRD_SOURCE * source)
+{
+    assert(shm);
+    assert(source);
+    struct rrd_shm_slot *slot;
+    uint64_t        owner = 0;
+    size_t          i;
+
+    /*
+     * a publisher must export the strings the client registered
+     */
+    if (strlen(source->name) >= SHM_NAME
+        || !fits(source->description, SHM_DESCRIPTION)
+        || !fits(source->owner_uuid, SHM_SHORT)
+        || !fits(source->rrd_units, SHM_SHORT)
+        || !fits(source->min, SHM_SHORT) || !fits(source->max, SHM_SHORT)) {
+        return RRD_ERROR;
+    }
+    if (shm->n_own == shm->size_own) {
+        size_t          size = shm->size_own ? 2 * shm->size_own : 8;
+        struct rrd_shm_own *own =
+            realloc(shm->own, size * sizeof(struct rrd_shm_own));
+        if (!own)
+            return RRD_ERROR;
+        shm->own = own;
+        shm->size_own = size;
+    }
+    for (i = 0; i < shm->n; i++) {
+        uint64_t        expected = __atomic_load_n(&shm->slots[i].owner,
+                                                   __ATOMIC_RELAXED);
+        if (OWNER_STATE(expected) != SLOT_FREE)
+            continue;
+#ifdef F_OFD_SETLK
+        /*
+         * the lock of a slot is held by whoever claims it; a process
+         * that fails to get it skips the slot
+         */
+        if (slot_lock(shm, i, F_OFD_SETLK, F_WRLCK) != 0)
+            continue;
+#endif
+        owner = OWNER(OWNER_GEN(expected) + 1, shm->pid, SLOT_BUSY);
+        if (__atomic_compare_exchange_n(&shm->slots[i].owner, &expected,
+                                        owner, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            break;
+#ifdef F_OFD_SETLK
+        slot_lock(shm, i, F_OFD_SETLK, F_UNLCK);
+#endif
+    }
+    if (i == shm->n) {
+        return RRD_TOO_MANY_SOURCES;
+    }
+    slot = &shm->slots[i];
+    /*
+     * a publisher that sees any of the following stores sees the new
+     * owner word when it checks it again
+     */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->nulls = 0;
+    copy_string(slot->name, SHM_NAME, source->name, &slot->nulls, 0);
+    copy_string(slot->description, SHM_DESCRIPTION, source->description,
+                &slot->nulls, 1);
+    copy_string(slot->owner_uuid, SHM_SHORT, source->owner_uuid,
+                &slot->nulls, 2);
+    copy_string(slot->units, SHM_SHORT, source->rrd_units, &slot->nulls, 3);
+    copy_string(slot->min, SHM_SHORT, source->min, &slot->nulls, 4);
+    copy_string(slot->max, SHM_SHORT, source->max, &slot->nulls, 5);
+    slot->owner_type = source->owner;
+    slot->rrd_default = source->rrd_default;
+    slot->scale = source->scale;
+    slot->type = source->type;
+    slot->value = source->sample(source->userdata).int64;
+    __atomic_store_n(&slot->owner, OWNER(OWNER_GEN(owner), shm->pid,
+                                         SLOT_READY), __ATOMIC_RELEASE);
+
+    shm->own[shm->n_own].source = source;
+    shm->own[shm->n_own].slot = i;
+    shm->n_own++;
+    return RRD_OK;
+}
+
+static void
+release(RRD_SHM * shm, size_t i)
+{
+    uint64_t        owner = __atomic_load_n(&shm->slots[i].owner,
+                                            __ATOMIC_RELAXED);
+
+    __atomic_store_n(&shm->slots[i].owner,
+                     OWNER(OWNER_GEN(owner), 0, SLOT_FREE), __ATOMIC_RELEASE);
+#ifdef F_OFD_SETLK
+    /*
+     * after the slot is free, such that the publisher never sees an
+     * owned slot without its lock
+     */
+    slot_lock(shm, i, F_OFD_SETLK, F_UNLCK);
+#endif
+}
+
+int
+rrd_shm_del_src(RRD_SHM * shm, RRD_SOURCE * source)
+{
+    assert(shm);
+    assert(source);
+
+    for (size_t i = 0; i < shm->n_own; i++) {
+        if (shm->own[i].source == source) {
+            release(shm, shm->own[i].slot);
+            shm->own[i] = shm->own[--shm->n_own];
+            return RRD_OK;
+        }
+    }
+    return RRD_NO_SUCH_SOURCE;
+}
+
+int
+rrd_shm_sample(RRD_SHM * shm)
+{
+    assert(shm);
+
+    for (size_t i = 0; i < shm->n_own; i++) {
+        RRD_SOURCE     *source = shm->own[i].source;
+        rrd_value_t     v = source->sample(source->userdata);
+        __atomic_store_n(&shm->slots[shm->own[i].slot].value, v.int64,
+                         __ATOMIC_RELAXED);
+    }
+    return RRD_OK;
+}
+
+static          rrd_value_t
+shm_value(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = __atomic_load_n((int64_t *) userdata, __ATOMIC_RELAXED);
+    return v;
+}
+
+/*
+ * Copy the description of a ready slot into its mirror. Returns 0 if
+ * the slot did not change while being copied.
+ */
+static int
+mirror_copy(struct rrd_shm_slot *slot, struct rrd_shm_mirror *m,
+            uint64_t owner)
+{
+    struct rrd_shm_slot *c = &m->copy;
+    uint32_t        nulls;
+
+    memcpy(c, slot, sizeof(*c));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->owner, __ATOMIC_RELAXED) != owner)
+        return -1;
+    nulls = c->nulls;
+    c->name[SHM_NAME - 1] = 0;
+    c->description[SHM_DESCRIPTION - 1] = 0;
+    c->owner_uuid[SHM_SHORT - 1] = 0;
+    c->units[SHM_SHORT - 1] = 0;
+    c->min[SHM_SHORT - 1] = 0;
+    c->max[SHM_SHORT - 1] = 0;
+    m->source.name = c->name;
+    m->source.description = nulls & 1 << 1 ? NULL : c->description;
+    m->source.owner_uuid = nulls & 1 << 2 ? NULL : c->owner_uuid;
+    m->source.rrd_units = nulls & 1 << 3 ? NULL : c->units;
+    m->source.min = nulls & 1 << 4 ? NULL : c->min;
+    m->source.max = nulls & 1 << 5 ? NULL : c->max;
+    m->source.owner = c->owner_type;
+    m->source.rrd_default = c->rrd_default;
+    m->source.scale = c->scale;
+    m->source.type = c->type;
+    m->source.sample = shm_value;
+    m->source.userdata = &slot->value;
+    return 0;
+}
+
+/*
+ * Returns the error of the first slot that could not be mirrored; such
+ * slots are tried again by the next call.
+ */
+int
+rrd_shm_sync(RRD_SHM * shm, RRD_PLUGIN * plugin)
+{
+    assert(shm);
+    assert(plugin);
+    int             rc = RRD_OK;
+    int             err;
+
+    if (!shm->mirror) {
+        shm->mirror = calloc(shm->n, sizeof(struct rrd_shm_mirror));
+        if (!shm->mirror)
+            return RRD_ERROR;
+    }
+    for (size_t i = 0; i < shm->n; i++) {
+        struct rrd_shm_slot *slot = &shm->slots[i];
+        struct rrd_shm_mirror *m = &shm->mirror[i];
+        uint64_t        owner = __atomic_load_n(&slot->owner,
+                                                __ATOMIC_ACQUIRE);
+
+        if (OWNER_STATE(owner) != SLOT_FREE && !owner_alive(shm, i, owner)) {
+            /*
+             * the owner died; free the slot unless it changed
+             */
+            uint64_t        freed = OWNER(OWNER_GEN(owner), 0, SLOT_FREE);
+            __atomic_compare_exchange_n(&slot->owner, &owner, freed, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            owner = freed;
+        }
+        if (m->owner != 0 && m->owner != owner) {
+            err = rrd_del_src_handle(plugin, m->handle);
+            if (err != RRD_OK) {
+                /*
+                 * the plugin still uses the mirror
+                 */
+                rc = rc == RRD_OK ? err : rc;
+                continue;
+            }
+            m->owner = 0;
+        }
+        if (m->owner == 0 && OWNER_STATE(owner) == SLOT_READY
+            && mirror_copy(slot, m, owner) == 0) {
+            err = rrd_add_src_handle(plugin, &m->source, &m->handle);
+            if (err == RRD_OK)
+                m->owner = owner;
+            else if (rc == RRD_OK)
+                rc = err;
+        }
+    }
+    return rc;
+}
+
+int
+rrd_shm_close(RRD_SHM * shm)
+{
+    assert(shm);
+
+    for (size_t i = 0; i < shm->n_own; i++)
+        release(shm, shm->own[i].slot);
+    munmap(shm->header, shm->size);
+    close(shm->fd);
+    free(shm->own);
+    free(shm->mirror);
+    free(shm);
+    return RRD_OK;
+}
+
+int
+rrd_shm_unlink(const char *name)
+{
+    assert(name);
+    return shm_unlink(name) == 0 ? RRD_OK : RRD_FILE_ERROR;
+}
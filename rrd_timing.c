@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Timing of sample() functions. When enabled, rrd_sample() calls
+ * rrd_timing_sample() instead of sample() directly, which reads a
+ * monotonic clock before and after the call and updates the statistics
+ * of the slot. The clock is read through the vDSO and does not enter
+ * the kernel.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "librrd_private.h"
+
+#define EWMA_SHIFT 3            /* weight of a new value is 1/8 */
+
+struct rrd_watch {
+    clockid_t       clock;
+    uint64_t        threshold;  /* ns, 0: no watchdog */
+    rrd_watchdog_t  hook;
+    void           *userdata;   /* passed to hook */
+    RRD_TIMING     *stats;      /* per slot */
+    size_t          capacity;   /* number of elements in stats */
+};
+
+static inline uint64_t
+now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+rrd_set_timing(RRD_PLUGIN * plugin, int mode)
+{
+    assert(plugin);
+
+    switch (mode) {
+    case RRD_TIMING_OFF:
+        if (plugin->watch)
+            free(plugin->watch->stats);
+        free(plugin->watch);
+        plugin->watch = NULL;
+        return RRD_OK;
+    case RRD_TIMING_PRECISE:
+    case RRD_TIMING_COARSE:
+        break;
+    default:
+        return RRD_ERROR;
+    }
+    if (!plugin->watch) {
+        plugin->watch = calloc(1, sizeof(struct rrd_watch));
+        if (!plugin->watch) {
+            return RRD_ERROR;
+        }
+        if (rrd_timing_resize(plugin, plugin->capacity) != 0) {
+            free(plugin->watch);
+            plugin->watch = NULL;
+            return RRD_ERROR;
+        }
+    }
+    plugin->watch->clock = CLOCK_MONOTONIC;
+#ifdef CLOCK_MONOTONIC_COARSE
+    if (mode == RRD_TIMING_COARSE)
+        plugin->watch->clock = CLOCK_MONOTONIC_COARSE;
+#endif
+    return RRD_OK;
+}
+
+int
+rrd_set_watchdog(RRD_PLUGIN * plugin, uint64_t threshold,
+                 rrd_watchdog_t hook, void *userdata)
+{
+    assert(plugin);
+
+    if (!plugin->watch) {
+        return RRD_ERROR;
+    }
+    plugin->watch->threshold = hook ? threshold : 0;
+    plugin->watch->hook = hook;
+    plugin->watch->userdata = userdata;
+    return RRD_OK;
+}
+
+int
+rrd_get_timing(RRD_PLUGIN * plugin, RRD_SOURCE * source, RRD_TIMING * timing)
+{
+    assert(plugin);
+    assert(source);
+    assert(timing);
+
+    int32_t         i;
+
+    if (!plugin->watch) {
+        return RRD_ERROR;
+    }
+    i = rrd_index_find(plugin, source->name);
+    if (i < 0 || plugin->sources[i] != source) {
+        return RRD_NO_SUCH_SOURCE;
+    }
+    *timing = plugin->watch->stats[i];
+    return RRD_OK;
+}
+
+int
+rrd_timing_resize(RRD_PLUGIN * plugin, size_t capacity)
+{
+    struct rrd_watch *watch = plugin->watch;
+    RRD_TIMING     *stats;
+
+    stats = realloc(watch->stats, capacity * sizeof(RRD_TIMING));
+    if (!stats)
+        return -1;
+    if (capacity > watch->capacity)
+        memset(stats + watch->capacity, 0,
+               (capacity - watch->capacity) * sizeof(RRD_TIMING));
+    watch->stats = stats;
+    watch->capacity = capacity;
+    return 0;
+}
+
+/*
+ * clear the statistics of a slot when it is assigned a new source
+ */
+void
+rrd_timing_reset(RRD_PLUGIN * plugin, size_t slot)
+{
+    memset(&plugin->watch->stats[slot], 0, sizeof(RRD_TIMING));
+}
+
+/*
+ * sample a source through its entry in the live array, which is all
+ * that is read unless the watchdog fires
+ */
+rrd_value_t
+rrd_timing_sample(RRD_PLUGIN * plugin, const struct rrd_live *live)
+{
+    struct rrd_watch *watch = plugin->watch;
+    RRD_TIMING     *stats = &watch->stats[live->slot];
+    uint64_t        start;
+    uint64_t        ns;
+    rrd_value_t     v;
+
+    start = now_ns(watch->clock);
+    v = live->sample(live->userdata);
+    ns = now_ns(watch->clock) - start;
+
+    if (stats->count == 0) {
+        stats->min = ns;
+        stats->max = ns;
+        stats->ewma = ns;
+    } else {
+        if (ns < stats->min)
+            stats->min = ns;
+        if (ns > stats->max)
+            stats->max = ns;
+        stats->ewma += ((int64_t) ns - (int64_t) stats->ewma) >> EWMA_SHIFT;
+    }
+    stats->last = ns;
+    stats->count++;
+
+    if (watch->threshold && ns > watch->threshold)
+        watch->hook(plugin, plugin->sources[live->slot], ns,
+                    watch->userdata);
+    return v;
+}
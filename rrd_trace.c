@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Sample traces record what happened to a plugin - sources added and
+ * removed, and the values of every sample - such that it can be
+ * replayed later through rrd_sample_at(). A trace starts with
+ * TRACE_MAGIC and a version byte, followed by records that start with
+ * a tag byte:
+ *
+ * 'A' id name description owner_uuid units min max owner default
+ *     scale type - the source was added as id
+ * 'D' id - source id was removed
+ * 'S' timestamp value... - a sample
+ *
+ * Integers are LEB128 varints. A string is the varint of its length
+ * plus one, 0 for NULL, followed by its bytes. The timestamp of a
+ * sample is in microseconds and stored as the zigzag encoded difference
+ * to that of the previous sample. It is followed by the values of the
+ * sources in ascending order of their id, each the zigzag encoded
+ * difference of its 64 bits (a double as its bit pattern) to its value
+ * in the previous sample. A value that did not change takes one byte,
+ * a slowly changing counter two or three.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "librrd_private.h"
+
+#define TRACE_MAGIC     "RRDTRACE"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION   1
+#define TRACE_MAX_IDS   (1 << 24)       /* bounds a corrupt trace */
+#define TRACE_STRINGS   6
+#define TRACE_BUFFER    (1 << 20)
+
+struct rrd_trace {
+    FILE           *file;
+    char           *buffer;     /* of file */
+    uint32_t        ids;        /* number of elements in live, values */
+    uint8_t        *live;       /* per id: source was added */
+    int64_t        *values;     /* per id: in the previous sample */
+    int64_t         usec;       /* timestamp of the previous sample */
+    char           *strings[TRACE_STRINGS];     /* of source */
+    RRD_SOURCE      source;     /* of the last 'A' read */
+};
+
+static          uint64_t
+zigzag(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static          int64_t
+unzigzag(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static void
+put_varint(FILE * file, uint64_t v)
+{
+    while (v >= 0x80) {
+        putc_unlocked((int) (v & 0x7f) | 0x80, file);
+        v >>= 7;
+    }
+    putc_unlocked((int) v, file);
+}
+
+static int
+get_varint(FILE * file, uint64_t * v)
+{
+    int             c;
+
+    *v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if ((c = getc_unlocked(file)) == EOF)
+            return -1;
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+static void
+put_string(FILE * file, const char *s)
+{
+    size_t          len;
+
+    if (!s) {
+        put_varint(file, 0);
+        return;
+    }
+    len = strlen(s);
+    put_varint(file, len + 1);
+    fwrite(s, 1, len, file);
+}
+
+static int
+get_string(FILE * file, char **s)
+{
+    uint64_t        len;
+
+    free(*s);
+    *s = NULL;
+    if (get_varint(file, &len) != 0 || len > TRACE_BUFFER)
+        return -1;
+    if (len == 0)
+        return 0;
+    *s = malloc(len);
+    if (!*s || fread(*s, 1, len - 1, file) != len - 1)
+        return -1;
+    (*s)[len - 1] = '\0';
+    return 0;
+}
+
+/*
+ * make room for id
+ */
+static int
+reserve(RRD_TRACE * trace, uint64_t id)
+{
+    uint32_t        ids = trace->ids ? trace->ids : 64;
+    uint8_t        *live;
+    int64_t        *values;
+
+    if (id < trace->ids)
+        return 0;
+    if (id >= TRACE_MAX_IDS)
+        return -1;
+    while (ids <= id)
+        ids *= 2;
+    live = realloc(trace->live, ids);
+    if (!live)
+        return -1;
+    trace->live = live;
+    values = realloc(trace->values, ids * sizeof(int64_t));
+    if (!values)
+        return -1;
+    trace->values = values;
+    memset(trace->live + trace->ids, 0, ids - trace->ids);
+    trace->ids = ids;
+    return 0;
+}
+
+static RRD_TRACE *
+trace_open(const char *path, const char *mode)
+{
+    RRD_TRACE      *trace = calloc(1, sizeof(RRD_TRACE));
+
+    if (!trace)
+        return NULL;
+    trace->buffer = malloc(TRACE_BUFFER);
+    trace->file = fopen(path, mode);
+    if (!trace->buffer || !trace->file) {
+        if (trace->file)
+            fclose(trace->file);
+        free(trace->buffer);
+        free(trace);
+        return NULL;
+    }
+    setvbuf(trace->file, trace->buffer, _IOFBF, TRACE_BUFFER);
+    return trace;
+}
+
+RRD_TRACE      *
+rrd_trace_create(const char *path)
+{
+    assert(path);
+    RRD_TRACE      *trace = trace_open(path, "w");
+
+    if (!trace)
+        return NULL;
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, trace->file);
+    putc_unlocked(TRACE_VERSION, trace->file);
+    return trace;
+}
+
+RRD_TRACE      *
+rrd_trace_open(const char *path)
+{
+    assert(path);
+    RRD_TRACE      *trace = trace_open(path, "r");
+    char            magic[TRACE_MAGIC_SIZE];
+
+    if (!trace)
+        return NULL;
+    if (fread(magic, 1, TRACE_MAGIC_SIZE, trace->file) != TRACE_MAGIC_SIZE
+        || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0
+        || getc_unlocked(trace->file) != TRACE_VERSION) {
+        rrd_trace_close(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+int
+rrd_trace_close(RRD_TRACE * trace)
+{
+    assert(trace);
+    int             rc = fclose(trace->file) == 0 ? RRD_OK : RRD_FILE_ERROR;
+
+    for (int i = 0; i < TRACE_STRINGS; i++) {
+        free(trace->strings[i]);
+    }
+    free(trace->buffer);
+    free(trace->live);
+    free(trace->values);
+    free(trace);
+    return rc;
+}
+
+int
+rrd_trace_add(RRD_TRACE * trace, uint32_t id, RRD_SOURCE * source)
+{
+    assert(trace);
+    assert(source);
+
+    if (reserve(trace, id) != 0)
+        return RRD_ERROR;
+    if (trace->live[id])
+        return RRD_DUPLICATE_SOURCE;
+    trace->live[id] = 1;
+    trace->values[id] = 0;
+
+    putc_unlocked(RRD_TRACE_ADD, trace->file);
+    put_varint(trace->file, id);
+    put_string(trace->file, source->name);
+    put_string(trace->file, source->description);
+    put_string(trace->file, source->owner_uuid);
+    put_string(trace->file, source->rrd_units);
+    put_string(trace->file, source->min);
+    put_string(trace->file, source->max);
+    put_varint(trace->file, source->owner);
+    put_varint(trace->file, source->rrd_default);
+    put_varint(trace->file, source->scale);
+    put_varint(trace->file, source->type);
+    return ferror(trace->file) ? RRD_FILE_ERROR : RRD_OK;
+}
+
+int
+rrd_trace_del(RRD_TRACE * trace, uint32_t id)
+{
+    assert(trace);
+
+    if (id >= trace->ids || !trace->live[id])
+        return RRD_NO_SUCH_SOURCE;
+    trace->live[id] = 0;
+
+    putc_unlocked(RRD_TRACE_DEL, trace->file);
+    put_varint(trace->file, id);
+    return ferror(trace->file) ? RRD_FILE_ERROR : RRD_OK;
+}
+
+int
+rrd_trace_sample(RRD_TRACE * trace, double timestamp, const int64_t * values)
+{
+    assert(trace);
+    int64_t         usec = llround(timestamp * 1e6);
+
+    putc_unlocked(RRD_TRACE_SAMPLE, trace->file);
+    put_varint(trace->file, zigzag(usec - trace->usec));
+    trace->usec = usec;
+    for (uint32_t id = 0; id < trace->ids; id++) {
+        if (!trace->live[id])
+            continue;
+        put_varint(trace->file,
+                   zigzag((int64_t) ((uint64_t) values[id]
+                                     - (uint64_t) trace->values[id])));
+        trace->values[id] = values[id];
+    }
+    return ferror(trace->file) ? RRD_FILE_ERROR : RRD_OK;
+}
+
+static int
+next_add(RRD_TRACE * trace, struct rrd_trace_event *event)
+{
+    RRD_SOURCE     *source = &trace->source;
+    uint64_t        id;
+    uint64_t        v[4];
+
+    if (get_varint(trace->file, &id) != 0 || reserve(trace, id) != 0
+        || trace->live[id])
+        return -1;
+    for (int i = 0; i < TRACE_STRINGS; i++) {
+        if (get_string(trace->file, &trace->strings[i]) != 0)
+            return -1;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (get_varint(trace->file, &v[i]) != 0)
+            return -1;
+    }
+    if (!trace->strings[0])
+        return -1;
+    memset(source, 0, sizeof(RRD_SOURCE));
+    source->name = trace->strings[0];
+    source->description = trace->strings[1];
+    source->owner_uuid = trace->strings[2];
+    source->rrd_units = trace->strings[3];
+    source->min = trace->strings[4];
+    source->max = trace->strings[5];
+    source->owner = (rrd_owner_t) v[0];
+    source->rrd_default = (int32_t) v[1];
+    source->scale = (rrd_scale_t) v[2];
+    source->type = (rrd_type_t) v[3];
+    trace->live[id] = 1;
+    trace->values[id] = 0;
+    event->id = (uint32_t) id;
+    event->source = source;
+    return 1;
+}
+
+static int
+next_sample(RRD_TRACE * trace, struct rrd_trace_event *event)
+{
+    uint64_t        v;
+
+    if (get_varint(trace->file, &v) != 0)
+        return -1;
+    trace->usec += unzigzag(v);
+    for (uint32_t id = 0; id < trace->ids; id++) {
+        if (!trace->live[id])
+            continue;
+        if (get_varint(trace->file, &v) != 0)
+            return -1;
+        trace->values[id] = (int64_t) ((uint64_t) trace->values[id]
+                                       + (uint64_t) unzigzag(v));
+    }
+    event->timestamp = trace->usec / 1e6;
+    event->values = trace->values;
+    event->ids = trace->ids;
+    return 1;
+}
+
+/*
+ * Read the next record of a trace into event. Returns 1 when an event
+ * was read, 0 at the end of the trace, and -1 when the trace is
+ * malformed or can't be read.
+ */
+int
+rrd_trace_next(RRD_TRACE * trace, struct rrd_trace_event *event)
+{
+    assert(trace);
+    assert(event);
+    uint64_t        id;
+    int             tag = getc_unlocked(trace->file);
+
+    memset(event, 0, sizeof(*event));
+    event->type = tag;
+    switch (tag) {
+    case EOF:
+        return ferror(trace->file) ? -1 : 0;
+    case RRD_TRACE_ADD:
+        return next_add(trace, event);
+    case RRD_TRACE_DEL:
+        if (get_varint(trace->file, &id) != 0 || id >= trace->ids
+            || !trace->live[id])
+            return -1;
+        trace->live[id] = 0;
+        event->id = (uint32_t) id;
+        return 1;
+    case RRD_TRACE_SAMPLE:
+        return next_sample(trace, event);
+    default:
+        return -1;
+    }
+}
@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Micro benchmarks for the library. Every benchmark prints one line per
+ * configuration with the time per operation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "librrd_private.h"
+
+#define PATH "rrdbench.rrd"
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static          rrd_value_t
+sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = (int64_t) (intptr_t) userdata;
+    return v;
+}
+
+/*
+ * Create n sources with distinct names.
+ */
+static RRD_SOURCE *
+make_sources(size_t n, char **names)
+{
+    RRD_SOURCE     *src = calloc(n, sizeof(RRD_SOURCE));
+    *names = malloc(n * 32);
+    assert(src && *names);
+
+    for (size_t i = 0; i < n; i++) {
+        src[i].name = *names + i * 32;
+        snprintf(src[i].name, 32, "source-%zu", i);
+        src[i].description = "benchmark source";
+        src[i].owner = RRD_HOST;
+        src[i].owner_uuid = NULL;
+        src[i].rrd_units = "points";
+        src[i].scale = RRD_GAUGE;
+        src[i].type = RRD_INT64;
+        src[i].min = "-inf";
+        src[i].max = "inf";
+        src[i].rrd_default = 1;
+        src[i].sample = sample;
+        src[i].userdata = (void *)(intptr_t) i;
+    }
+    return src;
+}
+
+/*
+ * Add n sources, publish the meta data with a first sample, sample
+ * repeatedly, and remove all sources again.
+ */
+static void
+bench_sources(size_t n)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE     *src;
+    char           *names;
+    double          t0, t1, t2, t3, t4;
+    int             samples = 100;
+    int             rc;
+
+    src = make_sources(n, &names);
+    plugin = rrd_open_sized("rrdbench", RRD_LOCAL_DOMAIN, PATH, n);
+    assert(plugin);
+
+    t0 = now();
+    for (size_t i = 0; i < n; i++) {
+        rc = rrd_add_src(plugin, &src[i]);
+        assert(rc == RRD_OK);
+    }
+    t1 = now();
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    t2 = now();
+    for (int i = 0; i < samples; i++) {
+        rc = rrd_sample(plugin, NULL);
+        assert(rc == RRD_OK);
+    }
+    t3 = now();
+    for (size_t i = 0; i < n; i++) {
+        rc = rrd_del_src(plugin, &src[i]);
+        assert(rc == RRD_OK);
+    }
+    t4 = now();
+
+    printf("sources %6zu: add %8.3f us/src, publish %9.3f ms, "
+           "sample %9.3f us, del %8.3f us/src\n", n,
+           (t1 - t0) * 1e6 / n, (t2 - t1) * 1e3,
+           (t3 - t2) * 1e6 / samples, (t4 - t3) * 1e6 / n);
+
+    rrd_close(plugin);
+    free(src);
+    free(names);
+}
+
+static          rrd_value_t
+sample_value(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = *(int64_t *) userdata;
+    return v;
+}
+
+/*
+ * Update the checksum of a sample of n values as rrd_sample() does,
+ * with every implementation the CPU supports: over all values, and
+ * incrementally, which costs a pass converting the values to big-endian
+ * plus an update per changed value. The break-even is the number of
+ * changed values at which both cost the same; the incremental update
+ * is also timed with as many changes as librrd.c allows (4 in 1024).
+ * Times are the best of a few runs.
+ */
+static void
+bench_checksum(size_t n)
+{
+    const struct rrd_crc_impl *impl;
+    int64_t        *values = calloc(n, sizeof(int64_t));
+    unsigned char  *dst = malloc(n * sizeof(int64_t));
+    uint32_t       *zeros = malloc((n + 1) * sizeof(uint32_t));
+    size_t          limit = n / 1024 * 4;
+    int             rounds = 200;
+    int             updates = 100000;
+    uint32_t        crc = 0;
+    uint64_t        delta = 1;
+    double          t0, t[4], best[4];
+
+    assert(values && dst && zeros);
+    for (size_t i = 0; i <= n; i++) {
+        zeros[i] = rrd_crc32_zeros(8 * (n - i));
+    }
+    for (impl = rrd_crc_impls; impl->name; impl++) {
+        if (!impl->supported())
+            continue;
+        for (int run = 0; run < 5; run++) {
+            t0 = now();
+            for (int r = 0; r < rounds; r++) {
+                crc = impl->crc32(0, &delta, sizeof(delta));
+                crc = impl->crc32_bswap64(crc, dst, values, n);
+            }
+            t[0] = (now() - t0) * 1e6 / rounds;
+            t0 = now();
+            for (int r = 0; r < rounds; r++) {
+                impl->bswap64(dst, values, n);
+            }
+            t[1] = (now() - t0) * 1e6 / rounds;
+            t0 = now();
+            for (int u = 0; u < updates; u++) {
+                crc ^= rrd_crc32_mult(zeros[u % n + 1],
+                                      ~impl->crc32(~0u, &delta, 8));
+            }
+            t[2] = (now() - t0) * 1e6 / updates;
+            t0 = now();
+            for (int r = 0; r < rounds; r++) {
+                for (size_t c = 0; c <= limit; c++) {
+                    crc ^= rrd_crc32_mult(zeros[(c * 7919 + r) % n + 1],
+                                          ~impl->crc32(~0u, &delta, 8));
+                }
+                impl->bswap64(dst, values, n);
+            }
+            t[3] = (now() - t0) * 1e6 / rounds;
+            for (int k = 0; k < 4; k++) {
+                if (run == 0 || t[k] < best[k])
+                    best[k] = t[k];
+            }
+        }
+        printf("checksum %6zu values: %-10s full %7.2f us, incremental "
+               "%6.2f us + %5.3f us/change (%6.2f us at %zu), "
+               "break-even %4.0f\n", n, impl->name, best[0], best[1],
+               best[2], best[3], limit, (best[0] - best[1]) / best[2]);
+    }
+    free(values);
+    free(dst);
+    free(zeros);
+    (void)crc;
+}
+
+/*
+ * Sample n sources without and with recording the samples.
+ */
+static void
+bench_record(size_t n)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE     *src;
+    char           *names;
+    int             samples = 1000;
+    double          t[2];
+    int             rc;
+
+    src = make_sources(n, &names);
+    for (int mode = 0; mode < 2; mode++) {
+        plugin = rrd_open_sized("rrdbench", RRD_LOCAL_DOMAIN, PATH, n);
+        assert(plugin);
+        for (size_t i = 0; i < n; i++) {
+            rc = rrd_add_src(plugin, &src[i]);
+            assert(rc == RRD_OK);
+        }
+        if (mode) {
+            rc = rrd_record_start(plugin, "rrdbench.record", 0);
+            assert(rc == RRD_OK);
+        }
+        rc = rrd_sample(plugin, NULL);
+        assert(rc == RRD_OK);
+        t[mode] = now();
+        for (int s = 0; s < samples; s++) {
+            rc = rrd_sample(plugin, NULL);
+            assert(rc == RRD_OK);
+        }
+        t[mode] = (now() - t[mode]) * 1e6 / samples;
+        rrd_close(plugin);
+    }
+    unlink("rrdbench.record");
+    printf("record %6zu sources: sample %8.3f us, recorded %8.3f us\n", n,
+           t[0], t[1]);
+    free(src);
+    free(names);
+}
+
+/*
+ * Keep two hours of history of n sources sampled every 5 s: a third of
+ * them constant, a third counters, and a third gauges that move in
+ * small steps. Reports the cost of a sample with and without history,
+ * and the bits per sample compressed and allocated.
+ */
+static void
+bench_history(size_t n)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE     *src;
+    char           *names;
+    int64_t        *values = calloc(n, sizeof(int64_t));
+    double         *gauges = calloc(n, sizeof(double));
+    int             samples = 1440;
+    size_t          kept, bits, bytes;
+    double          t[2];
+    int             rc;
+
+    assert(values && gauges);
+    src = make_sources(n, &names);
+    for (int mode = 0; mode < 2; mode++) {
+        plugin = rrd_open_sized("rrdbench", RRD_LOCAL_DOMAIN, PATH, n);
+        assert(plugin);
+        for (size_t i = 0; i < n; i++) {
+            src[i].sample = sample_value;
+            src[i].userdata = &values[i];
+            rc = rrd_add_src(plugin, &src[i]);
+            assert(rc == RRD_OK);
+        }
+        if (mode) {
+            rc = rrd_set_history(plugin, 2 * 3600);
+            assert(rc == RRD_OK);
+        }
+        srand(1);
+        t[mode] = 0;
+        for (int s = 0; s < samples; s++) {
+            double          t0;
+            for (size_t i = 0; i < n; i++) {
+                if (i % 3 == 1) {
+                    values[i] += rand() % 100;
+                } else if (i % 3 == 2) {
+                    gauges[i] += (rand() % 3 - 1) * 0.25;
+                    memcpy(&values[i], &gauges[i], sizeof(double));
+                }
+            }
+            t0 = now();
+            rc = rrd_sample_at(plugin, 1476870000 + s * 5
+                               + (rand() % 5) / 1e3);
+            assert(rc == RRD_OK);
+            t[mode] += now() - t0;
+        }
+        t[mode] = t[mode] * 1e6 / samples;
+        if (mode)
+            rrd_history_usage(plugin, &kept, &bits, &bytes);
+        rrd_close(plugin);
+    }
+    printf("history %6zu sources: sample %8.3f us, with history %8.3f us, "
+           "%5.2f bytes/sample (%5.2f allocated)\n", n, t[0], t[1],
+           bits / 8.0 / kept, (double)bytes / kept);
+    free(src);
+    free(names);
+    free(values);
+    free(gauges);
+}
+
+/*
+ * CRC-32 throughput of every implementation the CPU supports; the one
+ * in use is marked.
+ */
+static void
+bench_crc(size_t len)
+{
+    const struct rrd_crc_impl *impl;
+    unsigned char  *buf = malloc(len);
+    unsigned char  *dst = malloc(len);
+    size_t          rounds = (64 << 20) / len;
+    uint32_t        crc = 0;
+    double          t0, t1;
+
+    assert(buf && dst);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (unsigned char)i;
+    }
+    for (impl = rrd_crc_impls; impl->name; impl++) {
+        if (!impl->supported())
+            continue;
+        t0 = now();
+        for (size_t i = 0; i < rounds; i++) {
+            crc = impl->crc32(crc, buf, len);
+        }
+        t1 = now();
+        printf("crc32 %7zu bytes: %-10s %8.1f MB/s%s\n", len, impl->name,
+               rounds * len / (t1 - t0) / 1e6,
+               impl == rrd_crc32_impl()? " *" : "");
+        t0 = now();
+        for (size_t i = 0; i < rounds; i++) {
+            crc = impl->crc32_bswap64(crc, dst, (int64_t *) buf, len / 8);
+        }
+        t1 = now();
+        printf("crc32 %7zu bytes: %-10s %8.1f MB/s with byte swap\n", len,
+               impl->name, rounds * len / (t1 - t0) / 1e6);
+    }
+    free(buf);
+    free(dst);
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t          sizes[] = { 16, 100, 1000, 10000 };
+
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s\n", basename(argv[0]));
+        exit(1);
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_sources(sizes[i]);
+    }
+    bench_checksum(10000);
+    bench_checksum(100000);
+    bench_record(100);
+    bench_record(10000);
+    bench_history(1000);
+    bench_crc(64);
+    bench_crc(4096);
+    bench_crc(1 << 20);
+    return 0;
+}
@@ -75,8 +75,6 @@ main(int argc, char **argv)
         fprintf(stderr, "can't open %s\n", argv[1]);
         exit(1);
     }
-    rrd_add_src(plugin, &src);
-
     src.name = "stdin";
     src.description = "integers read from stdin";
     src.owner = RRD_VM;
@@ -89,6 +87,7 @@ main(int argc, char **argv)
     src.rrd_default = 0;
     src.sample = sample;
     src.userdata = NULL;
+    rrd_add_src(plugin, &src);
 
     int             rc;
     while (fgets(line, sizeof(line), stdin) != NULL) {
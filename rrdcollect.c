@@ -0,0 +1,661 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * A stand-in for the RRD daemon to load test plugins without it: every
+ * interval, read all plugin files in a directory with librrdreader and
+ * report what it took. A file is a plugin file when it validates; new
+ * files are picked up and removed ones dropped by scanning the
+ * directory every round. For every source the value of the last read
+ * is kept, as the daemon does to compute rates; the state of a file is
+ * reset when its meta data changes. The values are converted from the
+ * mapping of the file after the read validated them; when the plugin
+ * rewrote them meanwhile, the file is read again, as a retry. The
+ * staleness of a file is the age
+ * of its last sample when it is read. With -p, the program also creates
+ * plugins in the directory and samples them from an RRD_LOOP, with
+ * their phases spread over the interval.
+ *
+ * A round is read by a pool of threads. Each worker owns a range of
+ * the files, which it takes from the front one at a time. A worker
+ * that runs out steals the back half of the range of another worker.
+ * A range is a single 64-bit word, such that both are a compare and
+ * swap. Only one worker reads a file in a round; the barriers between
+ * rounds order the accesses to the state of a file.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "librrd.h"
+#include "librrdreader.h"
+
+#define NAME_SIZE       24      /* of the sources of -p */
+#define CACHE_LINE      64
+
+struct file {
+    char           *name;
+    RRD_READER     *reader;
+    RRD_READER_STATS stats;     /* of reader at the previous read */
+    uint32_t        n;          /* number of sources in last */
+    int64_t        *last;       /* per source, of the previous read */
+    int64_t        *next;       /* per source, of this read */
+    uint32_t        size;       /* capacity of last and next */
+    double          timestamp;  /* of the previous read */
+};
+
+/*
+ * totals of a round
+ */
+struct round {
+    size_t          files;      /* read successfully */
+    size_t          failed;     /* not read */
+    size_t          unchanged;  /* timestamp did not advance */
+    size_t          values;
+    size_t          changed;    /* values that changed */
+    uint64_t        retries;
+    uint64_t        parses;
+    uint64_t        bytes;
+    double          stale;      /* sum over all files */
+    double          stale_max;
+    size_t          steals;
+};
+
+/*
+ * files not taken yet are those from lo to hi (excluding), where range
+ * is lo << 32 | hi
+ */
+struct worker {
+    uint64_t        range;
+    struct round    round;
+    pthread_t       thread;
+} __attribute__ ((aligned(CACHE_LINE)));
+
+static struct pool {
+    struct worker  *workers;
+    unsigned        n;
+    int             quit;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+} pool;
+
+static struct file *files;      /* sorted by name */
+static size_t   n_files;
+static volatile sig_atomic_t stop;
+
+/*
+ * plugins created with -p
+ */
+static struct plugins {
+    RRD_LOOP       *loop;
+    pthread_t       thread;
+    RRD_PLUGIN    **plugin;
+    RRD_SOURCE     *sources;
+    int64_t        *values;
+    char           *names;
+    char           *paths;      /* kept by the plugins */
+    unsigned        n;
+    unsigned        sources_per_plugin;
+} plugins;
+
+static void
+usage(char *argv0)
+{
+    fprintf(stderr, "usage: %s [-i interval] [-n rounds] [-t threads] "
+            "[-p plugins:sources] dir\n", basename(argv0));
+    exit(1);
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+on_signal(int sig)
+{
+    stop = 1;
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void
+file_free(struct file *f)
+{
+    free(f->name);
+    free(f->last);
+    free(f->next);
+    if (f->reader)
+        rrd_reader_close(f->reader);
+}
+
+/*
+ * Update the files from the directory, keeping the state of those that
+ * are still there. Returns -1 when the directory can't be read.
+ */
+static int
+scan(const char *dir)
+{
+    DIR            *d = opendir(dir);
+    struct dirent  *e;
+    char          **names = NULL;
+    size_t          n = 0;
+    size_t          size = 0;
+    struct file    *next;
+    size_t          i = 0;
+    size_t          j = 0;
+    size_t          k = 0;
+
+    if (!d)
+        return -1;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.')
+            continue;
+        if (n == size) {
+            size = size ? 2 * size : 64;
+            names = realloc(names, size * sizeof(char *));
+            if (!names)
+                goto oom;
+        }
+        names[n] = strdup(e->d_name);
+        if (!names[n])
+            goto oom;
+        n++;
+    }
+    closedir(d);
+    qsort(names, n, sizeof(char *), cmp_name);
+
+    /*
+     * merge the sorted names into the sorted files
+     */
+    next = calloc(n ? n : 1, sizeof(struct file));
+    if (!next)
+        goto oom;
+    while (j < n) {
+        int             c = i < n_files ? strcmp(files[i].name, names[j]) : 1;
+        if (c < 0) {
+            file_free(&files[i++]);
+        } else if (c == 0) {
+            next[k++] = files[i++];
+            free(names[j++]);
+        } else {
+            char           *path = malloc(strlen(dir) + strlen(names[j]) + 2);
+            if (!path)
+                goto oom;
+            sprintf(path, "%s/%s", dir, names[j]);
+            next[k].name = names[j++];
+            next[k].reader = rrd_reader_open(path);
+            free(path);
+            if (!next[k].reader)
+                goto oom;
+            k++;
+        }
+    }
+    while (i < n_files)
+        file_free(&files[i++]);
+    free(files);
+    free(names);
+    files = next;
+    n_files = k;
+    return 0;
+  oom:
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+}
+
+/*
+ * Read a file and update its state and the totals of the round.
+ */
+static void
+collect(struct file *f, struct round *r)
+{
+    RRD_READER_VIEW view;
+    RRD_READER_STATS stats;
+    double          stale;
+    int64_t        *swap;
+    int             stable = 0;
+    int             rc = RRD_OK;
+
+    for (int i = 0; i < RRD_READER_RETRIES && rc == RRD_OK && !stable; i++) {
+        if (i > 0)
+            r->retries++;
+        rc = rrd_reader_read(f->reader, &view);
+        if (rc != RRD_OK)
+            break;
+        if (view.n > f->size) {
+            int64_t        *last = realloc(f->last, view.n * sizeof(int64_t));
+            int64_t        *next = last ? realloc(f->next,
+                                                  view.n * sizeof(int64_t))
+                : NULL;
+            if (last)
+                f->last = last;
+            if (!next) {
+                rc = RRD_ERROR;
+                break;
+            }
+            f->next = next;
+            f->size = view.n;
+        }
+        for (uint32_t i = 0; i < view.n; i++)
+            f->next[i] = rrd_reader_value(&view, i).int64;
+        stable = rrd_reader_stable(f->reader);
+    }
+    rrd_reader_stats(f->reader, &stats);
+    r->retries += stats.retries - f->stats.retries;
+    r->parses += stats.parses - f->stats.parses;
+    r->bytes += stats.bytes - f->stats.bytes;
+    if (rc != RRD_OK || !stable) {
+        f->stats = stats;
+        r->failed++;
+        return;
+    }
+    if (stats.parses == f->stats.parses && view.n == f->n) {
+        for (uint32_t i = 0; i < view.n; i++)
+            r->changed += f->next[i] != f->last[i];
+    }
+    swap = f->last;
+    f->last = f->next;
+    f->next = swap;
+    f->n = view.n;
+    f->stats = stats;
+    r->files++;
+    r->values += view.n;
+    r->unchanged += view.timestamp == f->timestamp;
+    f->timestamp = view.timestamp;
+    stale = rrd_clock(RRD_CLOCK_PRECISE) - view.timestamp;
+    r->stale += stale;
+    if (stale > r->stale_max)
+        r->stale_max = stale;
+}
+
+static void
+report(const char *label, struct round *r, double t)
+{
+    printf("%s: %zu files in %.3f ms, %.0f files/s, %.3f MB, "
+           "%zu values (%zu changed), %" PRIu64 " retries, %" PRIu64
+           " parses, %zu failed, %zu unchanged, %zu steals, "
+           "stale %.3f s avg %.3f s max\n",
+           label, r->files, t * 1e3, r->files / t, r->bytes / 1e6, r->values,
+           r->changed, r->retries, r->parses, r->failed, r->unchanged,
+           r->steals, r->files ? r->stale / r->files : 0, r->stale_max);
+    fflush(stdout);
+}
+
+static void
+add_round(struct round *total, const struct round *r)
+{
+    total->files += r->files;
+    total->failed += r->failed;
+    total->unchanged += r->unchanged;
+    total->values += r->values;
+    total->changed += r->changed;
+    total->retries += r->retries;
+    total->parses += r->parses;
+    total->bytes += r->bytes;
+    total->stale += r->stale;
+    if (r->stale_max > total->stale_max)
+        total->stale_max = r->stale_max;
+    total->steals += r->steals;
+}
+
+/*
+ * Take the next file from the front of the range of a worker. Returns
+ * -1 when the range is empty.
+ */
+static int64_t
+take(struct worker *w)
+{
+    uint64_t        range = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        uint32_t        lo = range >> 32;
+        uint32_t        hi = (uint32_t) range;
+        if (lo >= hi)
+            return -1;
+        if (__atomic_compare_exchange_n(&w->range, &range,
+                                        (uint64_t) (lo + 1) << 32 | hi, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return lo;
+    }
+}
+
+/*
+ * Move the back half of the range of another worker to the empty range
+ * of w. Returns -1 when all ranges are empty.
+ */
+static int
+steal(struct worker *w)
+{
+    unsigned        self = w - pool.workers;
+
+    for (unsigned k = 1; k < pool.n; k++) {
+        struct worker  *victim = &pool.workers[(self + k) % pool.n];
+        uint64_t        range = __atomic_load_n(&victim->range,
+                                                __ATOMIC_ACQUIRE);
+        for (;;) {
+            uint32_t        lo = range >> 32;
+            uint32_t        hi = (uint32_t) range;
+            uint32_t        half = (hi - lo + 1) / 2;
+            if (lo >= hi)
+                break;
+            if (__atomic_compare_exchange_n(&victim->range, &range,
+                                            (uint64_t) lo << 32 | (hi - half),
+                                            0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&w->range,
+                                 (uint64_t) (hi - half) << 32 | hi,
+                                 __ATOMIC_RELEASE);
+                w->round.steals++;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+static void
+work(struct worker *w)
+{
+    int64_t         i;
+
+    memset(&w->round, 0, sizeof(w->round));
+    do {
+        while ((i = take(w)) >= 0)
+            collect(&files[i], &w->round);
+    } while (steal(w) == 0);
+}
+
+static void    *
+run_worker(void *arg)
+{
+    struct worker  *w = arg;
+
+    for (;;) {
+        pthread_barrier_wait(&pool.start);
+        if (pool.quit)
+            return NULL;
+        work(w);
+        pthread_barrier_wait(&pool.done);
+    }
+}
+
+/*
+ * Start n - 1 threads; the main thread is the first worker.
+ */
+static void
+start_pool(unsigned n)
+{
+    pool.n = n;
+    pool.workers = aligned_alloc(CACHE_LINE, n * sizeof(struct worker));
+    if (!pool.workers
+        || pthread_barrier_init(&pool.start, NULL, n) != 0
+        || pthread_barrier_init(&pool.done, NULL, n) != 0) {
+        fprintf(stderr, "can't create threads\n");
+        exit(1);
+    }
+    memset(pool.workers, 0, n * sizeof(struct worker));
+    for (unsigned i = 1; i < n; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, run_worker,
+                           &pool.workers[i]) != 0) {
+            fprintf(stderr, "can't create threads\n");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * Read all files, initially split evenly between the workers, and sum
+ * up the totals of the workers in r.
+ */
+static void
+collect_all(struct round *r)
+{
+    for (unsigned i = 0; i < pool.n; i++) {
+        uint64_t        lo = n_files * i / pool.n;
+        uint64_t        hi = n_files * (i + 1) / pool.n;
+        pool.workers[i].range = lo << 32 | hi;
+    }
+    pthread_barrier_wait(&pool.start);
+    work(&pool.workers[0]);
+    pthread_barrier_wait(&pool.done);
+    memset(r, 0, sizeof(*r));
+    for (unsigned i = 0; i < pool.n; i++)
+        add_round(r, &pool.workers[i].round);
+}
+
+static void
+stop_pool(void)
+{
+    pool.quit = 1;
+    pthread_barrier_wait(&pool.start);
+    for (unsigned i = 1; i < pool.n; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+    pthread_barrier_destroy(&pool.start);
+    pthread_barrier_destroy(&pool.done);
+    free(pool.workers);
+}
+
+static          rrd_value_t
+plugin_sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = (*(int64_t *) userdata) += 1 + rand() % 100;
+    return v;
+}
+
+static void    *
+run_loop(void *arg)
+{
+    rrd_loop_run(plugins.loop);
+    return NULL;
+}
+
+/*
+ * Create n plugins of s sources each in dir and sample them every
+ * interval from a thread.
+ */
+static void
+start_plugins(const char *dir, unsigned n, unsigned s, double interval)
+{
+    size_t          len = strlen(dir) + 32;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror(dir);
+        exit(1);
+    }
+    plugins.n = n;
+    plugins.sources_per_plugin = s;
+    plugins.loop = rrd_loop_open();
+    plugins.plugin = calloc(n, sizeof(RRD_PLUGIN *));
+    plugins.sources = calloc((size_t) n * s, sizeof(RRD_SOURCE));
+    plugins.values = calloc((size_t) n * s, sizeof(int64_t));
+    plugins.names = malloc((size_t) s * NAME_SIZE);
+    plugins.paths = malloc(n * len);
+    if (!plugins.loop || !plugins.plugin || !plugins.sources
+        || !plugins.values || !plugins.names || !plugins.paths) {
+        fprintf(stderr, "can't create plugins\n");
+        exit(1);
+    }
+    for (unsigned j = 0; j < s; j++)
+        snprintf(plugins.names + j * NAME_SIZE, NAME_SIZE, "source-%u", j);
+    for (unsigned i = 0; i < n; i++) {
+        char           *path = plugins.paths + i * len;
+        snprintf(path, len, "%s/plugin-%u", dir, i);
+        plugins.plugin[i] = rrd_open_sized("rrdcollect", RRD_LOCAL_DOMAIN,
+                                           path, s);
+        if (!plugins.plugin[i]) {
+            fprintf(stderr, "can't open plugin %s\n", path);
+            exit(1);
+        }
+        for (unsigned j = 0; j < s; j++) {
+            RRD_SOURCE     *src = &plugins.sources[(size_t) i * s + j];
+            src->name = plugins.names + j * NAME_SIZE;
+            src->description = "load test source";
+            src->owner = RRD_HOST;
+            src->rrd_units = "points";
+            src->scale = RRD_DERIVE;
+            src->type = RRD_INT64;
+            src->min = "0";
+            src->max = "inf";
+            src->rrd_default = 1;
+            src->sample = plugin_sample;
+            src->userdata = &plugins.values[(size_t) i * s + j];
+            if (rrd_add_src(plugins.plugin[i], src) != RRD_OK) {
+                fprintf(stderr, "can't add source to %s\n", path);
+                exit(1);
+            }
+        }
+        if (rrd_sample(plugins.plugin[i], NULL) != RRD_OK
+            || rrd_loop_add(plugins.loop, plugins.plugin[i], interval,
+                            interval * i / n) != RRD_OK) {
+            fprintf(stderr, "can't sample plugin %s\n", path);
+            exit(1);
+        }
+    }
+    if (pthread_create(&plugins.thread, NULL, run_loop, NULL) != 0) {
+        fprintf(stderr, "can't start plugins\n");
+        exit(1);
+    }
+}
+
+static void
+stop_plugins(const char *dir)
+{
+    rrd_loop_stop(plugins.loop);
+    pthread_join(plugins.thread, NULL);
+    for (unsigned i = 0; i < plugins.n; i++) {
+        rrd_loop_del(plugins.loop, plugins.plugin[i]);
+        rrd_close(plugins.plugin[i]);
+    }
+    rrd_loop_close(plugins.loop);
+    rmdir(dir);
+    free(plugins.plugin);
+    free(plugins.sources);
+    free(plugins.values);
+    free(plugins.names);
+    free(plugins.paths);
+}
+
+int
+main(int argc, char **argv)
+{
+    double          interval = 5;
+    unsigned        rounds = 0;
+    unsigned        n = 0;
+    unsigned        s = 0;
+    long            threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct round    total;
+    double          busy = 0;
+    double          start;
+    unsigned        k;
+    int             opt;
+
+    while ((opt = getopt(argc, argv, "i:n:t:p:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 't':
+            threads = atol(optarg);
+            if (threads <= 0)
+                usage(argv[0]);
+            break;
+        case 'p':
+            if (sscanf(optarg, "%u:%u", &n, &s) != 2 || n == 0 || s == 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+        usage(argv[0]);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    if (n > 0)
+        start_plugins(argv[optind], n, s, interval);
+    start_pool(threads > 0 ? threads : 1);
+
+    memset(&total, 0, sizeof(total));
+    start = now();
+    for (k = 0; !stop && (rounds == 0 || k < rounds); k++) {
+        struct round    r;
+        struct timespec ts;
+        char            label[32];
+        double          t0;
+        double          wait;
+
+        wait = start + k * interval - now();
+        if (wait > 0) {
+            ts.tv_sec = (time_t) wait;
+            ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+            if (nanosleep(&ts, NULL) != 0 && stop)
+                break;
+        }
+        t0 = now();
+        if (scan(argv[optind]) != 0) {
+            perror(argv[optind]);
+            break;
+        }
+        collect_all(&r);
+        t0 = now() - t0;
+        busy += t0;
+        snprintf(label, sizeof(label), "round %u", k);
+        report(label, &r, t0);
+        add_round(&total, &r);
+    }
+    report("total", &total, busy);
+    stop_pool();
+
+    for (size_t i = 0; i < n_files; i++)
+        file_free(&files[i]);
+    free(files);
+    if (n > 0)
+        stop_plugins(argv[optind]);
+    return 0;
+}
@@ -0,0 +1,797 @@
+/*
+ * Copyright (c) 2016 Citrix
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Replay a sample trace through the library as fast as possible or at a
+ * speed-up of the recorded time, and report the throughput of the
+ * writer and of a reader that stands in for the RRD daemon: a thread
+ * that reads the file with librrdreader continuously or at a given
+ * rate. A read that does not validate raced with a write and is
+ * retried. With -g, a synthetic trace is written instead. With -o, the
+ * replay is recorded by rrd_record_start().
+ *
+ * A recording made by rrd_record_start() is replayed like a trace. Its
+ * samples are copies of the file, which librrdreader reads from memory
+ * when the meta data changed; sources are matched by name with those of
+ * the previous meta data, and those that are gone or differ become
+ * removals, new ones additions, before the sample.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#ifdef __APPLE__
+#include <libkern/OSByteOrder.h>
+#define be32toh(x) OSSwapBigToHostInt32(x)
+#define be64toh(x) OSSwapBigToHostInt64(x)
+#else
+#include <endian.h>
+#endif
+
+#include "librrd_private.h"
+#include "librrdreader.h"
+
+#define CAPACITY        1024    /* initial capacity of the plugin */
+#define GEN_START       1476870000.0    /* first timestamp of -g */
+#define GEN_INTERVAL    5.0
+#define GEN_CHURN       100     /* a source is replaced every GEN_CHURN
+                                 * samples */
+#define RECORD_MAGIC    "RRDREC01"
+#define RECORD_MAGIC_SIZE 8
+#define RECORD_HEADER   5       /* size and tag of a record */
+#define RECORD_SAMPLE   20      /* checksums, count, and timestamp */
+
+static const int64_t *current;  /* values of the sample being replayed */
+
+static struct reader {
+    const char     *path;
+    double          rate;       /* reads per second, 0: continuously */
+    int             done;
+    size_t          failed;     /* reads that did not validate */
+    size_t          changed;    /* values rewritten while converted */
+    RRD_READER_STATS stats;
+} reader;
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usage(char *argv0)
+{
+    fprintf(stderr, "usage: %s [-x speedup] [-r reads/s] [-o recording] "
+            "trace|recording file.rrd\n"
+            "       %s -g sources:samples trace\n",
+            basename(argv0), basename(argv0));
+    exit(1);
+}
+
+static          rrd_value_t
+replay_sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = current[(uintptr_t) userdata];
+    return v;
+}
+
+static char    *
+copy(const char *s)
+{
+    char           *c = s ? strdup(s) : NULL;
+    if (s && !c) {
+        perror("strdup");
+        exit(1);
+    }
+    return c;
+}
+
+static RRD_SOURCE *
+copy_source(const RRD_SOURCE * source, uint32_t id)
+{
+    RRD_SOURCE     *c = malloc(sizeof(RRD_SOURCE));
+
+    if (!c) {
+        perror("malloc");
+        exit(1);
+    }
+    *c = *source;
+    c->name = copy(source->name);
+    c->description = copy(source->description);
+    c->owner_uuid = copy(source->owner_uuid);
+    c->rrd_units = copy(source->rrd_units);
+    c->min = copy(source->min);
+    c->max = copy(source->max);
+    c->sample = replay_sample;
+    c->userdata = (void *)(uintptr_t) id;
+    return c;
+}
+
+static void
+free_source(RRD_SOURCE * source)
+{
+    if (!source)
+        return;
+    free(source->name);
+    free(source->description);
+    free(source->owner_uuid);
+    free(source->rrd_units);
+    free(source->min);
+    free(source->max);
+    free(source);
+}
+
+/*
+ * A recording read as trace events. The events of a sample are queued:
+ * removals, additions, and the sample itself.
+ */
+struct recording {
+    FILE           *file;
+    RRD_READER     *reader;     /* of the meta data */
+    unsigned char  *record;     /* contents of the last record */
+    size_t          record_size;        /* capacity of record */
+    unsigned char  *meta;       /* meta data section of the last 'M' */
+    size_t          meta_len;
+    size_t          meta_size;  /* capacity of meta */
+    int             meta_new;   /* not yet matched with the sources */
+    unsigned char  *image;      /* a sample and its meta data as a file */
+    size_t          image_size; /* capacity of image */
+    uint32_t        ids;        /* number of elements in sources, values,
+                                 * kept */
+    RRD_SOURCE    **sources;    /* per id, NULL: free */
+    int64_t        *values;     /* per id */
+    uint8_t        *kept;       /* per id: in the new meta data */
+    uint32_t       *pos;        /* id of the value at each position */
+    uint32_t        n;          /* number of positions */
+    struct rrd_trace_event *pending;
+    size_t          n_pending;
+    size_t          size_pending;       /* capacity of pending */
+    size_t          next;       /* next pending event */
+};
+
+struct by_name {
+    const char     *name;
+    uint32_t        id;
+};
+
+static void    *
+resize(void *p, size_t n, size_t size)
+{
+    void           *q = realloc(p, n * size);
+
+    if (!q && n > 0) {
+        perror("realloc");
+        exit(1);
+    }
+    return q;
+}
+
+static void
+recording_close(struct recording *rec)
+{
+    if (rec->file)
+        fclose(rec->file);
+    if (rec->reader)
+        rrd_reader_close(rec->reader);
+    for (uint32_t id = 0; id < rec->ids; id++)
+        free_source(rec->sources[id]);
+    free(rec->record);
+    free(rec->meta);
+    free(rec->image);
+    free(rec->sources);
+    free(rec->values);
+    free(rec->kept);
+    free(rec->pos);
+    free(rec->pending);
+    free(rec);
+}
+
+static struct recording *
+recording_open(const char *path)
+{
+    struct recording *rec = calloc(1, sizeof(struct recording));
+    char            magic[RECORD_MAGIC_SIZE];
+
+    if (!rec) {
+        perror("calloc");
+        exit(1);
+    }
+    rec->file = fopen(path, "r");
+    rec->reader = rrd_reader_open(path);
+    if (!rec->file || !rec->reader
+        || fread(magic, 1, RECORD_MAGIC_SIZE, rec->file) != RECORD_MAGIC_SIZE
+        || memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+        recording_close(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+/*
+ * Read the next record into rec->record. Returns 1 when a record was
+ * read, 0 at the end of the recording, and -1 when it is malformed.
+ */
+static int
+read_record(struct recording *rec, int *tag, size_t *len)
+{
+    uint32_t        size;
+
+    if (fread(&size, sizeof(size), 1, rec->file) != 1)
+        return ferror(rec->file) ? -1 : 0;
+    size = be32toh(size);
+    if (size == 0)
+        return 0;
+    if (size < RECORD_HEADER || (*tag = getc(rec->file)) == EOF)
+        return -1;
+    *len = size - RECORD_HEADER;
+    if (*len > rec->record_size) {
+        rec->record = resize(rec->record, *len, 1);
+        rec->record_size = *len;
+    }
+    if (fread(rec->record, 1, *len, rec->file) != *len)
+        return -1;
+    return 1;
+}
+
+/*
+ * A source as described by the meta data. Returns -1 when its owner or
+ * type is not one written by librrd.
+ */
+static int
+to_source(const RRD_READER_SOURCE * r, RRD_SOURCE * source)
+{
+    memset(source, 0, sizeof(RRD_SOURCE));
+    source->name = (char *)r->name;
+    source->description = (char *)r->description;
+    source->rrd_units = (char *)r->units;
+    source->min = (char *)r->min;
+    source->max = (char *)r->max;
+    source->rrd_default = r->rrd_default;
+    source->type = r->value_type;
+    if (!r->owner || !r->type)
+        return -1;
+    if (strcmp(r->owner, "host") == 0) {
+        source->owner = RRD_HOST;
+    } else if (strncmp(r->owner, "vm ", 3) == 0) {
+        source->owner = RRD_VM;
+        source->owner_uuid = (char *)r->owner + 3;
+    } else if (strncmp(r->owner, "sr ", 3) == 0) {
+        source->owner = RRD_SR;
+        source->owner_uuid = (char *)r->owner + 3;
+    } else {
+        return -1;
+    }
+    if (strcmp(r->type, "gauge") == 0)
+        source->scale = RRD_GAUGE;
+    else if (strcmp(r->type, "absolute") == 0)
+        source->scale = RRD_ABSOLUTE;
+    else if (strcmp(r->type, "derive") == 0)
+        source->scale = RRD_DERIVE;
+    else
+        return -1;
+    return 0;
+}
+
+static int
+same_string(const char *a, const char *b)
+{
+    return a && b ? strcmp(a, b) == 0 : a == b;
+}
+
+static int
+same_source(const RRD_SOURCE * a, const RRD_SOURCE * b)
+{
+    return same_string(a->name, b->name)
+        && same_string(a->description, b->description)
+        && same_string(a->owner_uuid, b->owner_uuid)
+        && same_string(a->rrd_units, b->rrd_units)
+        && same_string(a->min, b->min) && same_string(a->max, b->max)
+        && a->owner == b->owner && a->rrd_default == b->rrd_default
+        && a->scale == b->scale && a->type == b->type;
+}
+
+static int
+by_name_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct by_name *)a)->name,
+                  ((const struct by_name *)b)->name);
+}
+
+static void
+queue(struct recording *rec, int type, uint32_t id)
+{
+    struct rrd_trace_event *event;
+
+    if (rec->n_pending == rec->size_pending) {
+        rec->size_pending = rec->size_pending ? 2 * rec->size_pending : 64;
+        rec->pending = resize(rec->pending, rec->size_pending,
+                              sizeof(struct rrd_trace_event));
+    }
+    event = &rec->pending[rec->n_pending++];
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    event->id = id;
+    event->source = type == RRD_TRACE_ADD ? rec->sources[id] : NULL;
+}
+
+/*
+ * Queue the removals and additions that turn the sources of the last
+ * meta data into those of view, and map the positions of its values to
+ * ids. A source keeps its id unless its description changed. Returns
+ * -1 when view describes a source librrd can't write.
+ */
+static int
+match(struct recording *rec, const RRD_READER_VIEW * view)
+{
+    struct by_name *old = resize(NULL, rec->n, sizeof(struct by_name));
+    struct by_name key;
+    struct by_name *found;
+    RRD_SOURCE      source;
+    uint32_t        id = 0;
+
+    for (uint32_t i = 0; i < rec->n; i++) {
+        old[i].name = rec->sources[rec->pos[i]]->name;
+        old[i].id = rec->pos[i];
+        rec->kept[rec->pos[i]] = 0;
+    }
+    qsort(old, rec->n, sizeof(struct by_name), by_name_cmp);
+    rec->pos = resize(rec->pos, view->n, sizeof(uint32_t));
+    for (uint32_t p = 0; p < view->n; p++) {
+        if (to_source(&view->sources[p], &source) != 0) {
+            free(old);
+            return -1;
+        }
+        key.name = source.name;
+        found = rec->n ? bsearch(&key, old, rec->n, sizeof(struct by_name),
+                                 by_name_cmp) : NULL;
+        rec->pos[p] = UINT32_MAX;
+        if (found && !rec->kept[found->id]
+            && same_source(rec->sources[found->id], &source)) {
+            rec->pos[p] = found->id;
+            rec->kept[found->id] = 1;
+        }
+    }
+    for (uint32_t i = 0; i < rec->n; i++) {
+        if (rec->kept[old[i].id])
+            continue;
+        queue(rec, RRD_TRACE_DEL, old[i].id);
+        free_source(rec->sources[old[i].id]);
+        rec->sources[old[i].id] = NULL;
+    }
+    free(old);
+    for (uint32_t p = 0; p < view->n; p++) {
+        if (rec->pos[p] != UINT32_MAX)
+            continue;
+        while (id < rec->ids && rec->sources[id])
+            id++;
+        if (id == rec->ids) {
+            uint32_t        ids = rec->ids ? 2 * rec->ids : 64;
+            rec->sources = resize(rec->sources, ids, sizeof(RRD_SOURCE *));
+            rec->values = resize(rec->values, ids, sizeof(int64_t));
+            rec->kept = resize(rec->kept, ids, 1);
+            memset(rec->sources + rec->ids, 0,
+                   (ids - rec->ids) * sizeof(RRD_SOURCE *));
+            memset(rec->kept + rec->ids, 0, ids - rec->ids);
+            rec->ids = ids;
+        }
+        to_source(&view->sources[p], &source);
+        rec->sources[id] = copy_source(&source, id);
+        rec->values[id] = 0;
+        rec->pos[p] = id;
+        queue(rec, RRD_TRACE_ADD, id);
+    }
+    rec->n = view->n;
+    return 0;
+}
+
+/*
+ * Like rrd_trace_next() for a recording.
+ */
+static int
+recording_next(struct recording *rec, struct rrd_trace_event *event)
+{
+    RRD_READER_VIEW view;
+    const unsigned char *r;
+    uint64_t        bits;
+    uint32_t        n;
+    size_t          len;
+    int             tag;
+    int             rc;
+
+    while (rec->next == rec->n_pending) {
+        rec->next = rec->n_pending = 0;
+        rc = read_record(rec, &tag, &len);
+        if (rc <= 0)
+            return rc;
+        r = rec->record;
+        if (tag == 'M') {
+            /*
+             * the checksum of the meta data, then its section
+             */
+            if (len < sizeof(uint32_t))
+                return -1;
+            len -= sizeof(uint32_t);
+            if (len > rec->meta_size) {
+                rec->meta = resize(rec->meta, len, 1);
+                rec->meta_size = len;
+            }
+            memcpy(rec->meta, r + sizeof(uint32_t), len);
+            rec->meta_len = len;
+            rec->meta_new = 1;
+            continue;
+        }
+        if (tag != 'S' || len < RECORD_SAMPLE)
+            return -1;
+        memcpy(&n, r + 8, sizeof(n));
+        n = be32toh(n);
+        if (len != RECORD_SAMPLE + (size_t) n * sizeof(int64_t))
+            return -1;
+        if (rec->meta_new) {
+            size_t          size = MAGIC_SIZE + len + rec->meta_len;
+            if (size > rec->image_size) {
+                rec->image = resize(rec->image, size, 1);
+                rec->image_size = size;
+            }
+            memcpy(rec->image, MAGIC, MAGIC_SIZE);
+            memcpy(rec->image + MAGIC_SIZE, r, len);
+            memcpy(rec->image + MAGIC_SIZE + len, rec->meta,
+                   rec->meta_len);
+            if (rrd_reader_image(rec->reader, rec->image, size, &view)
+                != RRD_OK || match(rec, &view) != 0)
+                return -1;
+            rec->meta_new = 0;
+        }
+        if (n != rec->n)
+            return -1;
+        for (uint32_t p = 0; p < n; p++) {
+            memcpy(&bits, r + RECORD_SAMPLE + p * sizeof(int64_t),
+                   sizeof(bits));
+            rec->values[rec->pos[p]] = (int64_t) be64toh(bits);
+        }
+        queue(rec, RRD_TRACE_SAMPLE, 0);
+        memcpy(&bits, r + 12, sizeof(bits));
+        bits = be64toh(bits);
+        memcpy(&rec->pending[rec->n_pending - 1].timestamp, &bits,
+               sizeof(bits));
+        rec->pending[rec->n_pending - 1].values = rec->values;
+        rec->pending[rec->n_pending - 1].ids = rec->ids;
+    }
+    *event = rec->pending[rec->next++];
+    return 1;
+}
+
+/*
+ * Read the file and convert all values until the replay is done.
+ */
+static void    *
+read_file(void *arg)
+{
+    RRD_READER     *r = rrd_reader_open(reader.path);
+    RRD_READER_VIEW view;
+    int64_t         sum = 0;
+
+    if (!r) {
+        fprintf(stderr, "can't create reader\n");
+        return NULL;
+    }
+    while (!__atomic_load_n(&reader.done, __ATOMIC_RELAXED)) {
+        switch (rrd_reader_read(r, &view)) {
+        case RRD_OK:
+            for (uint32_t i = 0; i < view.n; i++)
+                sum += rrd_reader_value(&view, i).int64;
+            if (!rrd_reader_stable(r))
+                reader.changed++;
+            break;
+        case RRD_FILE_ERROR:
+            break;
+        default:
+            reader.failed++;
+        }
+        if (reader.rate > 0) {
+            struct timespec ts;
+            ts.tv_sec = (time_t) (1 / reader.rate);
+            ts.tv_nsec = (long) ((1 / reader.rate - ts.tv_sec) * 1e9);
+            nanosleep(&ts, NULL);
+        } else {
+            sched_yield();
+        }
+    }
+    rrd_reader_stats(r, &reader.stats);
+    rrd_reader_close(r);
+    return (void *)(intptr_t) sum;
+}
+
+/*
+ * sleep until the time of a sample, speeded up
+ */
+static void
+pace(double start, double first, double timestamp, double speedup)
+{
+    double          due = start + (timestamp - first) / speedup;
+    struct timespec ts;
+
+#ifdef __APPLE__
+    /*
+     * there is no clock_nanosleep(); sleep for what is left
+     */
+    due -= now();
+    if (due <= 0)
+        return;
+    ts.tv_sec = (time_t) due;
+    ts.tv_nsec = (long) ((due - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+#else
+    ts.tv_sec = (time_t) due;
+    ts.tv_nsec = (long) ((due - ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+           == EINTR);
+#endif
+}
+
+/*
+ * the next event of a trace or a recording
+ */
+static int
+next_event(RRD_TRACE * trace, struct recording *rec,
+           struct rrd_trace_event *event)
+{
+    return trace ? rrd_trace_next(trace, event)
+        : recording_next(rec, event);
+}
+
+static int
+replay(const char *trace_path, const char *path, double speedup,
+       const char *record_path)
+{
+    RRD_TRACE      *trace;
+    struct recording *rec = NULL;
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE    **sources = NULL;
+    uint32_t        ids = 0;
+    size_t          live = 0;
+    struct rrd_trace_event event;
+    pthread_t       thread;
+    size_t          samples = 0;
+    size_t          values = 0;
+    size_t          changes = 0;
+    double          first = 0;
+    double          t0, t1;
+    int             rc;
+
+    trace = rrd_trace_open(trace_path);
+    if (!trace)
+        rec = recording_open(trace_path);
+    if (!trace && !rec) {
+        fprintf(stderr, "can't read trace %s\n", trace_path);
+        return 1;
+    }
+    plugin = rrd_open_sized("rrdreplay", RRD_LOCAL_DOMAIN, (char *)path,
+                            CAPACITY);
+    if (!plugin) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+    if (record_path && rrd_record_start(plugin, record_path, 0) != RRD_OK) {
+        fprintf(stderr, "can't record to %s\n", record_path);
+        return 1;
+    }
+    reader.path = path;
+    if (pthread_create(&thread, NULL, read_file, NULL) != 0) {
+        fprintf(stderr, "can't start reader\n");
+        return 1;
+    }
+
+    t0 = now();
+    while ((rc = next_event(trace, rec, &event)) == 1) {
+        switch (event.type) {
+        case RRD_TRACE_ADD:
+            if (event.id >= ids) {
+                uint32_t        n = event.id + 1 > 2 * ids
+                    ? event.id + 1 : 2 * ids;
+                sources = realloc(sources, n * sizeof(RRD_SOURCE *));
+                if (!sources) {
+                    perror("realloc");
+                    exit(1);
+                }
+                memset(sources + ids, 0, (n - ids) * sizeof(RRD_SOURCE *));
+                ids = n;
+            }
+            sources[event.id] = copy_source(event.source, event.id);
+            rc = rrd_add_src(plugin, sources[event.id]);
+            live++;
+            changes++;
+            break;
+        case RRD_TRACE_DEL:
+            rc = rrd_del_src(plugin, sources[event.id]);
+            free_source(sources[event.id]);
+            sources[event.id] = NULL;
+            live--;
+            changes++;
+            break;
+        case RRD_TRACE_SAMPLE:
+            if (samples == 0)
+                first = event.timestamp;
+            else if (speedup > 0)
+                pace(t0, first, event.timestamp, speedup);
+            current = event.values;
+            rc = rrd_sample_at(plugin, event.timestamp);
+            samples++;
+            values += live;
+            break;
+        }
+        if (rc != RRD_OK) {
+            fprintf(stderr, "replay failed with error %d at event %c\n", rc,
+                    event.type);
+            break;
+        }
+    }
+    t1 = now();
+    __atomic_store_n(&reader.done, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+    if (rc < 0)
+        fprintf(stderr, "trace %s is malformed\n", trace_path);
+
+    printf("writer: %zu samples, %zu values, %zu changes in %.3f s: "
+           "%.0f samples/s, %.3f M values/s\n", samples, values, changes,
+           t1 - t0, samples / (t1 - t0), values / (t1 - t0) / 1e6);
+    printf("reader: %" PRIu64 " reads, %" PRIu64 " retries, %zu failed, "
+           "%zu changed, %" PRIu64 " parses in %.3f s: %.0f reads/s, "
+           "%.1f MB/s\n", reader.stats.reads, reader.stats.retries,
+           reader.failed, reader.changed, reader.stats.parses, t1 - t0,
+           reader.stats.reads / (t1 - t0),
+           reader.stats.bytes / (t1 - t0) / 1e6);
+
+    if (record_path && rrd_record_stop(plugin) != RRD_OK) {
+        fprintf(stderr, "can't record to %s\n", record_path);
+        rc = -1;
+    }
+    rrd_close(plugin);
+    if (trace)
+        rrd_trace_close(trace);
+    else
+        recording_close(rec);
+    for (uint32_t id = 0; id < ids; id++) {
+        free_source(sources[id]);
+    }
+    free(sources);
+    return rc == 0 ? 0 : 1;
+}
+
+/*
+ * Write a trace of n sources and the given number of samples. Every
+ * fourth source is a float gauge, the others are counters. Every
+ * GEN_CHURN samples, one source is replaced by a new one.
+ */
+static int
+generate(const char *trace_path, uint32_t n, size_t samples)
+{
+    RRD_TRACE      *trace = rrd_trace_create(trace_path);
+    int64_t        *values = calloc(n, sizeof(int64_t));
+    char            name[32];
+    RRD_SOURCE      source;
+    size_t          next_name = 0;
+    int             rc = RRD_OK;
+
+    if (!trace || !values) {
+        fprintf(stderr, "can't create trace %s\n", trace_path);
+        return 1;
+    }
+    memset(&source, 0, sizeof(source));
+    source.name = name;
+    source.description = "replayed source";
+    source.owner = RRD_HOST;
+    source.rrd_units = "points";
+    source.min = "-inf";
+    source.max = "inf";
+    source.rrd_default = 1;
+
+    srand(1);
+    for (uint32_t id = 0; id < n && rc == RRD_OK; id++) {
+        snprintf(name, sizeof(name), "source-%zu", next_name++);
+        source.type = id % 4 == 3 ? RRD_FLOAT64 : RRD_INT64;
+        source.scale = id % 4 == 3 ? RRD_GAUGE : RRD_DERIVE;
+        rc = rrd_trace_add(trace, id, &source);
+    }
+    for (size_t s = 0; s < samples && rc == RRD_OK; s++) {
+        if (s > 0 && s % GEN_CHURN == 0) {
+            uint32_t        id = rand() % n;
+            snprintf(name, sizeof(name), "source-%zu", next_name++);
+            source.type = id % 4 == 3 ? RRD_FLOAT64 : RRD_INT64;
+            source.scale = id % 4 == 3 ? RRD_GAUGE : RRD_DERIVE;
+            rc = rrd_trace_del(trace, id);
+            if (rc == RRD_OK)
+                rc = rrd_trace_add(trace, id, &source);
+            values[id] = 0;
+        }
+        for (uint32_t id = 0; id < n; id++) {
+            if (id % 4 == 3) {
+                double          d = (s + id) % 100 / 10.0;
+                memcpy(&values[id], &d, sizeof(d));
+            } else if (rand() % 2) {
+                values[id] += rand() % 1000;
+            }
+        }
+        if (rc == RRD_OK)
+            rc = rrd_trace_sample(trace, GEN_START + s * GEN_INTERVAL,
+                                  values);
+    }
+    free(values);
+    if (rrd_trace_close(trace) != RRD_OK || rc != RRD_OK) {
+        fprintf(stderr, "can't write trace %s\n", trace_path);
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    double          speedup = 0;
+    const char     *record_path = NULL;
+    unsigned        sources = 0;
+    size_t          samples = 0;
+    int             opt;
+
+    while ((opt = getopt(argc, argv, "x:r:g:o:")) != -1) {
+        switch (opt) {
+        case 'o':
+            record_path = optarg;
+            break;
+        case 'r':
+            reader.rate = atof(optarg);
+            if (reader.rate <= 0)
+                usage(argv[0]);
+            break;
+        case 'x':
+            speedup = atof(optarg);
+            if (speedup <= 0)
+                usage(argv[0]);
+            break;
+        case 'g':
+            if (sscanf(optarg, "%u:%zu", &sources, &samples) != 2
+                || sources == 0)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (sources > 0 && argc - optind == 1)
+        return generate(argv[optind], sources, samples);
+    if (sources == 0 && argc - optind == 2)
+        return replay(argv[optind], argv[optind + 1], speedup,
+                      record_path);
+    usage(argv[0]);
+    return 1;
+}
@@ -22,13 +22,39 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <libgen.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
-#include "librrd.h"
+#include <zlib.h>
+
+#ifdef __APPLE__
+#include <libkern/OSByteOrder.h>
+#define be32toh(x) OSSwapBigToHostInt32(x)
+#define be64toh(x) OSSwapBigToHostInt64(x)
+#define htobe64(x) OSSwapHostToBigInt64(x)
+#else
+#include <endian.h>
+#endif
+
+#include "librrd_private.h"
+#include "librrdreader.h"
 
 static int64_t  numbers[] =
     { 2, 16, 28, 29, 29, 34, 40, 48, 49, 52, 54, 55, 55, 57, 66, 67, 83,
@@ -55,17 +81,15 @@ sample(void *userdata)
 
 static RRD_SOURCE src[2];
 
-int
-main(int argc, char **argv)
+/*
+ * Add and remove sources and sample the plugin in between.
+ */
+static void
+test_sources(void)
 {
     RRD_PLUGIN     *plugin;
     int             rc;
 
-    if (argc != 1) {
-        fprintf(stderr, "usage: %s\n", basename(argv[0]));
-        exit(1);
-    }
-
     plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest.rrd");
     assert(plugin);
 
@@ -113,5 +137,1883 @@ main(int argc, char **argv)
     printf("removing source: %s\n", src[1].name);
     rrd_del_src(plugin, &src[1]);
     rrd_close(plugin);
+}
+
+/*
+ * Read the values of the first n sources from an RRD file.
+ */
+#define RRD_HEADER_SIZE 31
+
+static void
+read_values(char *path, rrd_value_t * values, size_t n)
+{
+    uint64_t        be[n];
+    int             fd = open(path, O_RDONLY);
+    ssize_t         len;
+
+    assert(fd >= 0);
+    len = pread(fd, be, sizeof(be), RRD_HEADER_SIZE);
+    assert(len == (ssize_t) sizeof(be));
+    close(fd);
+    for (size_t i = 0; i < n; i++) {
+        values[i].int64 = (int64_t) be64toh(be[i]);
+    }
+}
+
+/*
+ * read the checksum of the meta data, the number of sources, and the
+ * timestamp from the header of a file
+ */
+static void
+read_header(char *path, uint32_t * crc, uint32_t * n, uint64_t * timestamp)
+{
+    unsigned char   header[RRD_HEADER_SIZE];
+    int             fd = open(path, O_RDONLY);
+    ssize_t         len;
+
+    assert(fd >= 0);
+    len = pread(fd, header, sizeof(header), 0);
+    assert(len == (ssize_t) sizeof(header));
+    close(fd);
+    memcpy(crc, header + 15, sizeof(*crc));
+    memcpy(n, header + 19, sizeof(*n));
+    memcpy(timestamp, header + 23, sizeof(*timestamp));
+    *crc = be32toh(*crc);
+    *n = be32toh(*n);
+}
+
+static int64_t  hf_counter;
+
+static          rrd_value_t
+hf_sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = ++hf_counter;
+    return v;
+}
+
+/*
+ * A high-frequency source with all companions is ticked manually and by
+ * the sampler thread.
+ */
+static void
+test_hf(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      source = src[0];
+    rrd_value_t     v[4];
+    int             rc;
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-hf.rrd");
+    assert(plugin);
+
+    source.name = "hf";
+    source.scale = RRD_ABSOLUTE;
+    source.sample = hf_sample;
+    rc = rrd_add_hf_src(plugin, &source, RRD_HF_MIN);
+    assert(rc == RRD_ERROR);
+
+    source.scale = RRD_GAUGE;
+    rc = rrd_add_hf_src(plugin, &source,
+                        RRD_HF_MIN | RRD_HF_MAX | RRD_HF_MEAN);
+    assert(rc == RRD_OK);
+
+    for (int i = 0; i < 10; i++) {
+        rc = rrd_hf_tick(plugin);
+        assert(rc == RRD_OK);
+    }
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-hf.rrd", v, 4);
+    assert(v[0].int64 == 10);   /* last */
+    assert(v[1].int64 == 1);    /* min */
+    assert(v[2].int64 == 10);   /* max */
+    assert(v[3].float64 == 5.5);        /* mean */
+
+    /*
+     * without a tick, rrd_sample takes a single sample
+     */
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-hf.rrd", v, 4);
+    assert(v[0].int64 == 11 && v[1].int64 == 11 && v[2].int64 == 11);
+    assert(v[3].float64 == 11.0);
+
+    rc = rrd_hf_start(plugin, 0.001);
+    assert(rc == RRD_OK);
+    usleep(50000);
+    rc = rrd_hf_stop(plugin);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-hf.rrd", v, 4);
+    printf("hf samples: %" PRId64 "\n", v[0].int64 - v[1].int64 + 1);
+    assert(v[1].int64 == 12 && v[0].int64 > v[1].int64);
+    assert(v[2].int64 == v[0].int64);
+
+    rc = rrd_del_src(plugin, &source);
+    assert(rc == RRD_OK);
+    rc = rrd_del_src(plugin, &source);
+    assert(rc == RRD_NO_SUCH_SOURCE);
+
+    /*
+     * rrd_close releases remaining sources and stops the sampler
+     */
+    rc = rrd_add_hf_src(plugin, &source, RRD_HF_MAX);
+    assert(rc == RRD_OK);
+    rc = rrd_hf_start(plugin, 0.001);
+    assert(rc == RRD_OK);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+static RRD_HIST *hist;
+
+static void    *
+hist_recorder(void *arg)
+{
+    for (int i = 0; i < 1000; i++) {
+        for (uint64_t v = 1; v <= 100; v++)
+            rrd_hist_record(hist, v);
+    }
+    return NULL;
+}
+
+/*
+ * Record values 1..100 equally often from several threads and check the
+ * percentiles reported; values below 64 have exact buckets, above
+ * buckets are 2 wide.
+ */
+static void
+test_hist(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      source = src[0];
+    double          percentiles[] = { 99, 50, 95 };
+    pthread_t       thread[4];
+    rrd_value_t     v[3];
+    int             rc;
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-hist.rrd");
+    assert(plugin);
+    source.name = "latency";
+    hist = rrd_add_hist_src(plugin, &source, percentiles, 3, 1.0);
+    assert(hist == NULL);
+    hist = rrd_add_hist_src(plugin, &source, percentiles, 3, 0.0);
+    assert(hist);
+
+    for (int i = 0; i < 4; i++) {
+        rc = pthread_create(&thread[i], NULL, hist_recorder, NULL);
+        assert(rc == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-hist.rrd", v, 3);
+    printf("hist: p50=%" PRId64 " p95=%" PRId64 " p99=%" PRId64 "\n",
+           v[0].int64, v[1].int64, v[2].int64);
+    assert(v[0].int64 == 50 && v[1].int64 == 95 && v[2].int64 == 99);
+
+    /*
+     * nothing recorded in this interval and no decay
+     */
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-hist.rrd", v, 3);
+    assert(v[0].int64 == 0 && v[1].int64 == 0 && v[2].int64 == 0);
+
+    rc = rrd_del_src(plugin, &source);
+    assert(rc == RRD_OK);
+
+    /*
+     * large values in a float histogram
+     */
+    source.type = RRD_FLOAT64;
+    hist = rrd_add_hist_src(plugin, &source, percentiles, 1, 0.5);
+    assert(hist);
+    rrd_hist_record(hist, 1000000);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-hist.rrd", v, 1);
+    assert(fabs(v[0].float64 - 1000000) / 1000000 < 0.016);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+static RRD_COUNTER *counter;
+
+static void    *
+counter_adder(void *arg)
+{
+    for (int i = 0; i < 100000; i++) {
+        rrd_counter_add(counter, 3);
+        rrd_counter_add(counter, -1);
+    }
+    return NULL;
+}
+
+/*
+ * Update a counter from several threads.
+ */
+static void
+test_counter(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      source = src[1];
+    pthread_t       thread[4];
+    rrd_value_t     v;
+    int             rc;
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-counter.rrd");
+    assert(plugin);
+    source.name = "requests";
+    source.type = RRD_FLOAT64;
+    counter = rrd_add_counter_src(plugin, &source);
+    assert(counter == NULL);
+    source.type = RRD_INT64;
+    counter = rrd_add_counter_src(plugin, &source);
+    assert(counter);
+
+    for (int i = 0; i < 4; i++) {
+        rc = pthread_create(&thread[i], NULL, counter_adder, NULL);
+        assert(rc == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-counter.rrd", &v, 1);
+    assert(v.int64 == 4 * 100000 * 2);
+
+    rc = rrd_del_src(plugin, &source);
+    assert(rc == RRD_OK);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+static          rrd_value_t
+slow_sample(void *userdata)
+{
+    usleep(2000);
+    return sample(userdata);
+}
+
+static RRD_SOURCE *slow_source;
+static int      slow_calls;
+
+static void
+watchdog(RRD_PLUGIN * plugin, RRD_SOURCE * source, uint64_t duration,
+         void *userdata)
+{
+    assert(userdata == &slow_calls);
+    assert(source == slow_source);
+    assert(duration > 1000000);
+    slow_calls++;
+}
+
+/*
+ * Time a fast and a slow source; only the slow one triggers the
+ * watchdog.
+ */
+static void
+test_timing(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      source[2] = { src[0], src[1] };
+    RRD_TIMING      fast;
+    RRD_TIMING      slow;
+    int             rc;
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-timing.rrd");
+    assert(plugin);
+    source[0].userdata = &source[0];
+    source[1].userdata = &source[1];
+    source[1].sample = slow_sample;
+    slow_source = &source[1];
+    rc = rrd_add_src(plugin, &source[0]);
+    assert(rc == RRD_OK);
+    rc = rrd_add_src(plugin, &source[1]);
+    assert(rc == RRD_OK);
+
+    rc = rrd_get_timing(plugin, &source[0], &fast);
+    assert(rc == RRD_ERROR);
+    rc = rrd_set_watchdog(plugin, 1000000, watchdog, &slow_calls);
+    assert(rc == RRD_ERROR);
+    rc = rrd_set_timing(plugin, RRD_TIMING_PRECISE);
+    assert(rc == RRD_OK);
+    rc = rrd_set_watchdog(plugin, 1000000, watchdog, &slow_calls);
+    assert(rc == RRD_OK);
+
+    for (int i = 0; i < 3; i++) {
+        rc = rrd_sample(plugin, NULL);
+        assert(rc == RRD_OK);
+    }
+    rc = rrd_get_timing(plugin, &source[0], &fast);
+    assert(rc == RRD_OK);
+    rc = rrd_get_timing(plugin, &source[1], &slow);
+    assert(rc == RRD_OK);
+    printf("timing: fast ewma %" PRIu64 " ns, slow ewma %" PRIu64 " ns\n",
+           fast.ewma, slow.ewma);
+    assert(fast.count == 3 && slow.count == 3);
+    assert(slow.min >= 2000000 && slow.max >= slow.min);
+    assert(slow.ewma >= slow.min && slow.ewma <= slow.max);
+    assert(fast.max < slow.min);
+    assert(slow_calls == 3);
+
+    /*
+     * timed sampling calls sample() through the live array and does
+     * not read the RRD_SOURCE of the client
+     */
+    source[0].sample = NULL;
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    rc = rrd_get_timing(plugin, &source[0], &fast);
+    assert(rc == RRD_OK && fast.count == 4);
+
+    rc = rrd_del_src(plugin, &source[1]);
+    assert(rc == RRD_OK);
+    rc = rrd_get_timing(plugin, &source[1], &slow);
+    assert(rc == RRD_NO_SUCH_SOURCE);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+#define MANY_SOURCES 10000
+
+static RRD_SOURCE many[MANY_SOURCES];
+static rrd_handle_t many_handles[MANY_SOURCES];
+static char     seen[MANY_SOURCES];
+static char     many_names[MANY_SOURCES][16];
+
+static          rrd_value_t
+many_sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = (RRD_SOURCE *) userdata - many;
+    return v;
+}
+
+/*
+ * Grow a plugin from 16 to more than 10,000 sources and remove them
+ * again, half of them by handle. Names must remain unique.
+ */
+static void
+test_many(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      dup;
+    rrd_value_t    *v = calloc(MANY_SOURCES, sizeof(rrd_value_t));
+    uint32_t        n;
+    int             fd;
+    int             rc;
+
+    assert(rrd_open_sized("rrdtest", RRD_LOCAL_DOMAIN, "x.rrd", 0) == NULL);
+    plugin = rrd_open_sized("rrdtest", RRD_LOCAL_DOMAIN,
+                            "rrdtest-many.rrd", 16);
+    assert(plugin);
+    for (int i = 0; i < MANY_SOURCES; i++) {
+        snprintf(many_names[i], sizeof(many_names[i]), "many-%d", i);
+        many[i] = src[0];
+        many[i].name = many_names[i];
+        many[i].sample = many_sample;
+        many[i].userdata = &many[i];
+        rc = rrd_add_src_handle(plugin, &many[i], &many_handles[i]);
+        assert(rc == RRD_OK);
+        assert(many_handles[i] == i);
+    }
+    dup = many[1234];
+    rc = rrd_add_src(plugin, &dup);
+    assert(rc == RRD_DUPLICATE_SOURCE);
+    assert(rrd_find_src(plugin, "many-1234") == &many[1234]);
+    assert(rrd_find_src(plugin, "many") == NULL);
+    rc = rrd_del_src(plugin, &dup);
+    assert(rc == RRD_NO_SUCH_SOURCE);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+
+    read_values("rrdtest-many.rrd", v, MANY_SOURCES);
+    for (int i = 0; i < MANY_SOURCES; i++) {
+        assert(v[i].int64 == i);
+    }
+    fd = open("rrdtest-many.rrd", O_RDONLY);
+    assert(fd >= 0);
+    rc = pread(fd, &n, sizeof(n), 19);
+    assert(rc == sizeof(n));
+    assert(be32toh(n) == MANY_SOURCES);
+    close(fd);
+
+    for (int i = 0; i < MANY_SOURCES; i += 2) {
+        rc = rrd_del_src_handle(plugin, many_handles[i]);
+        assert(rc == RRD_OK);
+        rc = rrd_del_src_handle(plugin, many_handles[i]);
+        assert(rc == RRD_NO_SUCH_SOURCE);
+    }
+    rc = rrd_del_src_handle(plugin, -1);
+    assert(rc == RRD_NO_SUCH_SOURCE);
+
+    /*
+     * the remaining sources are packed densely, each value once
+     */
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_values("rrdtest-many.rrd", v, MANY_SOURCES / 2);
+    memset(seen, 0, sizeof(seen));
+    for (int i = 0; i < MANY_SOURCES / 2; i++) {
+        assert(v[i].int64 % 2 == 1 && !seen[v[i].int64]);
+        seen[v[i].int64] = 1;
+    }
+    rc = rrd_add_src_handle(plugin, &many[0], &many_handles[0]);
+    assert(rc == RRD_OK);
+    assert(many_handles[0] == MANY_SOURCES - 2);
+    rc = rrd_del_src_handle(plugin, many_handles[0]);
+    assert(rc == RRD_OK);
+    for (int i = 1; i < MANY_SOURCES; i += 2) {
+        assert(rrd_find_src(plugin, many_names[i]) == &many[i]);
+        rc = rrd_del_src(plugin, &many[i]);
+        assert(rc == RRD_OK);
+        assert(rrd_find_src(plugin, many_names[i]) == NULL);
+    }
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+    free(v);
+}
+
+/*
+ * whether the file at path contains the string s
+ */
+static int
+file_contains(char *path, const char *s)
+{
+    static char     buf[65536];
+    int             fd = open(path, O_RDONLY);
+    ssize_t         len;
+
+    assert(fd >= 0);
+    len = read(fd, buf, sizeof(buf));
+    assert(len > 0);
+    close(fd);
+    return memmem(buf, len, s, strlen(s)) != NULL;
+}
+
+/*
+ * A group sharing the file of its plugin and one with a file of its own.
+ * Changes to the latter leave the file of the plugin alone.
+ */
+static void
+test_group(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_GROUP      *shared;
+    RRD_GROUP      *own;
+    RRD_SOURCE      vm[3];
+    uint32_t        crc, crc2, n;
+    uint64_t        timestamp, timestamp2;
+    int             rc;
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-group.rrd");
+    assert(plugin);
+    rc = rrd_add_src(plugin, &src[0]);
+    assert(rc == RRD_OK);
+
+    shared = rrd_group_open(plugin, "vm-a");
+    assert(shared);
+    for (int i = 0; i < 3; i++) {
+        vm[i] = many[i];
+        vm[i].owner = RRD_VM;
+        vm[i].owner_uuid = NULL;
+    }
+    rc = rrd_group_add_src(shared, &vm[0]);
+    assert(rc == RRD_OK);
+    rc = rrd_group_add_src(shared, &vm[1]);
+    assert(rc == RRD_OK);
+    rc = rrd_group_add_src(shared, &src[0]);
+    assert(rc == RRD_DUPLICATE_SOURCE);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_header("rrdtest-group.rrd", &crc, &n, &timestamp);
+    assert(n == 3);
+    assert(file_contains("rrdtest-group.rrd", "\"vm vm-a\""));
+
+    /*
+     * a source removed behind the back of the group whose slot is
+     * reused is not removed again
+     */
+    rc = rrd_del_src(plugin, &vm[1]);
+    assert(rc == RRD_OK);
+    rc = rrd_add_src(plugin, &many[5]);
+    assert(rc == RRD_OK);
+    rc = rrd_group_del_src(shared, &vm[1]);
+    assert(rc == RRD_NO_SUCH_SOURCE);
+    rc = rrd_del_src(plugin, &many[5]);
+    assert(rc == RRD_OK);
+    rc = rrd_group_add_src(shared, &vm[1]);
+    assert(rc == RRD_OK);
+
+    own = rrd_group_open_file(plugin, "vm-b", "rrdtest-group-b.rrd");
+    assert(own);
+    rc = rrd_group_add_src(own, &vm[2]);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_header("rrdtest-group.rrd", &crc2, &n, &timestamp);
+    assert(crc2 == crc && n == 3);
+    read_header("rrdtest-group-b.rrd", &crc2, &n, &timestamp2);
+    assert(n == 1 && timestamp2 == timestamp);
+    assert(file_contains("rrdtest-group-b.rrd", "\"vm vm-b\""));
+    rc = rrd_group_del_src(own, &vm[0]);
+    assert(rc == RRD_NO_SUCH_SOURCE);
+
+    rc = rrd_group_close(shared);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_header("rrdtest-group.rrd", &crc2, &n, &timestamp);
+    assert(n == 1);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+    assert(access("rrdtest-group-b.rrd", F_OK) != 0);
+}
+
+#define CHURN 2000
+
+static int      sampler_stop;
+
+static void    *
+sampler(void *arg)
+{
+    RRD_PLUGIN     *plugin = arg;
+    int             samples = 0;
+
+    while (!__atomic_load_n(&sampler_stop, __ATOMIC_RELAXED)) {
+        int             rc = rrd_sample(plugin, NULL);
+        assert(rc == RRD_OK);
+        samples++;
+    }
+    return (void *)(intptr_t) samples;
+}
+
+static          rrd_value_t
+heap_sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = *(int64_t *) userdata;
+    return v;
+}
+
+/*
+ * Add and remove sources, directly and through groups sharing the file,
+ * while another thread samples the plugin and a group with a file of
+ * its own. A removed source and its userdata are freed right away.
+ */
+static void
+test_concurrent(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_GROUP      *own;
+    pthread_t       thread;
+    void           *samples;
+    uint32_t        crc, n;
+    uint64_t        timestamp;
+    int             rc;
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-rcu.rrd");
+    assert(plugin);
+    rc = rrd_add_src(plugin, &src[0]);
+    assert(rc == RRD_OK);
+    own = rrd_group_open_file(plugin, NULL, "rrdtest-rcu-b.rrd");
+    assert(own);
+    rc = rrd_group_add_src(own, &many[40]);
+    assert(rc == RRD_OK);
+    rc = rrd_set_concurrent(plugin, 1);
+    assert(rc == RRD_OK);
+    rc = pthread_create(&thread, NULL, sampler, plugin);
+    assert(rc == 0);
+
+    for (int i = 0; i < CHURN; i++) {
+        RRD_SOURCE     *source = malloc(sizeof(RRD_SOURCE));
+        int64_t        *value = malloc(sizeof(int64_t));
+        rrd_handle_t    handle;
+
+        assert(source && value);
+        *value = i;
+        *source = many[i % 32];
+        source->sample = heap_sample;
+        source->userdata = value;
+        if (i % 4 == 3) {
+            RRD_GROUP      *group = rrd_group_open(plugin, NULL);
+            assert(group);
+            rc = rrd_group_add_src(group, source);
+            assert(rc == RRD_OK);
+            assert(rrd_find_src(plugin, source->name) == source);
+            rc = rrd_group_close(group);
+            assert(rc == RRD_OK);
+            assert(rrd_find_src(plugin, source->name) == NULL);
+            free(source);
+            free(value);
+            continue;
+        }
+        rc = rrd_add_src_handle(plugin, source, &handle);
+        assert(rc == RRD_OK);
+        assert(rrd_find_src(plugin, source->name) == source);
+        if (i % 2)
+            rc = rrd_del_src(plugin, source);
+        else
+            rc = rrd_del_src_handle(plugin, handle);
+        assert(rc == RRD_OK);
+        free(source);
+        free(value);
+    }
+    __atomic_store_n(&sampler_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, &samples);
+    printf("concurrent samples: %d\n", (int)(intptr_t) samples);
+
+    rc = rrd_set_concurrent(plugin, 0);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_header("rrdtest-rcu.rrd", &crc, &n, &timestamp);
+    assert(n == 1);
+    read_header("rrdtest-rcu-b.rrd", &crc, &n, &timestamp);
+    assert(n == 1);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+    assert(access("rrdtest-rcu-b.rrd", F_OK) != 0);
+}
+
+static          rrd_value_t
+seven(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = 7;
+    return v;
+}
+
+/*
+ * A child process contributes two sources through shared memory and
+ * terminates without removing them. The publisher frees their slots.
+ */
+static void
+test_shm(void)
+{
+    RRD_SHM        *shm;
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      child_src[2];
+    char            long_description[257];
+    char            name[32];
+    int             up[2], down[2];
+    char            c;
+    rrd_value_t     v[3];
+    uint32_t        crc, n;
+    uint64_t        timestamp;
+    pid_t           pid;
+    int             status;
+    int             rc;
+
+    snprintf(name, sizeof(name), "/rrdtest-%d", (int)getpid());
+    shm = rrd_shm_open(name, 8);
+    assert(shm);
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-shm.rrd");
+    assert(plugin);
+    rc = rrd_shm_add_src(shm, &src[0]);
+    assert(rc == RRD_OK);
+    assert(pipe(up) == 0 && pipe(down) == 0);
+
+    /*
+     * strings that don't fit into a slot are rejected, not cut
+     */
+    child_src[0] = src[1];
+    child_src[0].description = long_description;
+    memset(long_description, 'd', 256);
+    long_description[255] = 0;
+    long_description[256] = 0;
+    rc = rrd_shm_add_src(shm, &child_src[0]);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_del_src(shm, &child_src[0]);
+    assert(rc == RRD_OK);
+    long_description[255] = 'd';
+    rc = rrd_shm_add_src(shm, &child_src[0]);
+    assert(rc == RRD_ERROR);
+    child_src[0].description = src[1].description;
+    child_src[0].rrd_units = long_description + 256 - 48;
+    rc = rrd_shm_add_src(shm, &child_src[0]);
+    assert(rc == RRD_ERROR);
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        RRD_SHM        *child = rrd_shm_open(name, 0);
+        assert(child);
+        for (int i = 0; i < 2; i++) {
+            child_src[i] = many[i];
+            child_src[i].sample = seven;
+            rc = rrd_shm_add_src(child, &child_src[i]);
+            assert(rc == RRD_OK);
+        }
+        rc = rrd_shm_sample(child);
+        assert(rc == RRD_OK);
+        assert(write(up[1], "x", 1) == 1);
+        assert(read(down[0], &c, 1) == 1);
+        _exit(0);
+    }
+    assert(read(up[0], &c, 1) == 1);
+    rc = rrd_shm_sync(shm, plugin);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_header("rrdtest-shm.rrd", &crc, &n, &timestamp);
+    assert(n == 3);
+    read_values("rrdtest-shm.rrd", v, 3);
+    assert(v[1].int64 == 7 && v[2].int64 == 7);
+    assert(rrd_find_src(plugin, many_names[1]) != NULL);
+
+    assert(write(down[1], "x", 1) == 1);
+    assert(waitpid(pid, &status, 0) == pid);
+    rc = rrd_shm_sync(shm, plugin);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    read_header("rrdtest-shm.rrd", &crc, &n, &timestamp);
+    assert(n == 1);
+
+    /*
+     * the last slot claimed by pid 1, which exists, without holding its
+     * lock: the owner is gone and the slot is freed
+     */
+    struct stat     st;
+    uint64_t       *owner;
+    size_t          last;
+    int             fd = shm_open(name, O_RDWR, 0);
+    assert(fd >= 0 && fstat(fd, &st) == 0);
+    owner = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    assert(owner != MAP_FAILED);
+    close(fd);
+    /*
+     * a header of two words and 8 slots, each starting with its owner
+     */
+    last = 2 + (st.st_size - 16) / 8 / 8 * 7;
+    owner[last] = 1ull << 32 | 1 << 8 | 2;
+    rc = rrd_shm_sync(shm, plugin);
+    assert(rc == RRD_OK);
+    assert((owner[last] & 0xff) == 0);
+    assert(rrd_find_src(plugin, "") == NULL);
+    munmap(owner, st.st_size);
+
+    /*
+     * a slot whose name is taken is mirrored once the name is free
+     */
+    rc = rrd_add_src(plugin, &src[1]);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_add_src(shm, &src[1]);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_sync(shm, plugin);
+    assert(rc == RRD_DUPLICATE_SOURCE);
+    rc = rrd_del_src(plugin, &src[1]);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_sync(shm, plugin);
+    assert(rc == RRD_OK);
+    assert(rrd_find_src(plugin, src[1].name) != NULL);
+    rc = rrd_shm_del_src(shm, &src[1]);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_sync(shm, plugin);
+    assert(rc == RRD_OK);
+    assert(rrd_find_src(plugin, src[1].name) == NULL);
+
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_close(shm);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_unlink(name);
+    assert(rc == RRD_OK);
+    for (int i = 0; i < 2; i++) {
+        close(up[i]);
+        close(down[i]);
+    }
+
+    /*
+     * a segment whose creator died before setting the magic
+     */
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    assert(fd >= 0);
+    assert(ftruncate(fd, 4096) == 0);
+    close(fd);
+    assert(rrd_shm_open(name, 0) == NULL);
+    rc = rrd_shm_unlink(name);
+    assert(rc == RRD_OK);
+}
+
+#define SHM_STRESS 20000
+
+/*
+ * A child process claims and releases the same slot again and again,
+ * each time with other strings, while the publisher mirrors it. A
+ * mirrored source never mixes the strings of two claims.
+ */
+static void
+test_shm_stress(void)
+{
+    RRD_SHM        *shm;
+    RRD_PLUGIN     *plugin;
+    char            name[32];
+    size_t          syncs = 0;
+    size_t          mirrored = 0;
+    pid_t           pid;
+    int             status;
+    int             rc;
+
+    snprintf(name, sizeof(name), "/rrdtest-stress-%d", (int)getpid());
+    shm = rrd_shm_open(name, 4);
+    assert(shm);
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-shm.rrd");
+    assert(plugin);
+
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        RRD_SHM        *child = rrd_shm_open(name, 0);
+        RRD_SOURCE      source = many[0];
+        char            text[3][32];
+
+        assert(child);
+        source.sample = seven;
+        source.name = text[0];
+        source.description = text[1];
+        source.rrd_units = text[2];
+        for (int i = 0; i < SHM_STRESS; i++) {
+            snprintf(text[0], sizeof(text[0]), "stress-%d", i);
+            snprintf(text[1], sizeof(text[1]), "%d", i);
+            snprintf(text[2], sizeof(text[2]), "%d", i);
+            rc = rrd_shm_add_src(child, &source);
+            assert(rc == RRD_OK);
+            if (i % 2)
+                sched_yield();
+            rc = rrd_shm_del_src(child, &source);
+            assert(rc == RRD_OK);
+        }
+        rrd_shm_close(child);
+        _exit(0);
+    }
+    do {
+        rc = rrd_shm_sync(shm, plugin);
+        assert(rc == RRD_OK);
+        syncs++;
+        for (size_t i = 0; i < plugin->capacity; i++) {
+            RRD_SOURCE     *source = plugin->sources[i];
+            if (!source)
+                continue;
+            assert(strncmp(source->name, "stress-", 7) == 0);
+            assert(strcmp(source->name + 7, source->description) == 0);
+            assert(strcmp(source->description, source->rrd_units) == 0);
+            mirrored++;
+        }
+        sched_yield();
+    } while (waitpid(pid, &status, WNOHANG) == 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    rc = rrd_shm_sync(shm, plugin);
+    assert(rc == RRD_OK);
+    assert(plugin->n == 0);
+    printf("shm stress: %zu syncs, %zu sources mirrored\n", syncs,
+           mirrored);
+
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_close(shm);
+    assert(rc == RRD_OK);
+    rc = rrd_shm_unlink(name);
+    assert(rc == RRD_OK);
+}
+
+/*
+ * Every CRC-32 implementation the CPU supports computes the same CRC as
+ * zlib for all lengths and alignments around its block sizes, and
+ * converts values to big-endian like htobe64().
+ */
+static void
+test_crc(void)
+{
+    static unsigned char buf[1 << 16];
+    static int64_t  native[1000];
+    static uint64_t be[1001];
+    static uint64_t out[1001];
+    const struct rrd_crc_impl *impl;
+    uint32_t        crc;
+
+    for (size_t i = 0; i < sizeof buf; i++) {
+        buf[i] = (unsigned char)rand();
+    }
+    for (impl = rrd_crc_impls; impl->name; impl++) {
+        if (!impl->supported())
+            continue;
+        for (size_t len = 0; len < 1100; len++) {
+            for (size_t off = 0; off < 4; off++) {
+                crc = crc32(len, buf + off, len);
+                assert(impl->crc32(len, buf + off, len) == crc);
+            }
+        }
+        crc = crc32(0, buf, sizeof buf);
+        assert(impl->crc32(0, buf, sizeof buf) == crc);
+        assert(impl->crc32(0, buf, 0) == 0);
+
+        memcpy(native, buf, sizeof native);
+        for (size_t n = 0; n < 1000; n = n < 300 ? n + 1 : n + 97) {
+            /*
+             * dst need not be aligned
+             */
+            for (size_t i = 0; i < n; i++) {
+                be[i] = htobe64((uint64_t) native[i]);
+            }
+            crc = crc32(n, (unsigned char *)be, n * 8);
+            memset(out, 0, sizeof out);
+            assert(impl->crc32_bswap64(n, (char *)out + 3, native, n)
+                   == crc);
+            assert(memcmp((char *)out + 3, be, n * 8) == 0);
+            memset(out, 0, sizeof out);
+            impl->bswap64((char *)out + 5, native, n);
+            assert(memcmp((char *)out + 5, be, n * 8) == 0);
+            assert(((char *)out)[5 + n * 8] == 0);
+        }
+    }
+    assert(rrd_crc32_impl()->supported());
+    assert(rrd_crc32(0, buf, sizeof buf) == crc32(0, buf, sizeof buf));
+}
+
+#define CRC_SOURCES 3000
+
+static int64_t  crc_values[CRC_SOURCES];
+static RRD_SOURCE crc_src[CRC_SOURCES];
+static char     crc_names[CRC_SOURCES][16];
+
+static          rrd_value_t
+crc_sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.int64 = *(int64_t *) userdata;
+    return v;
+}
+
+/*
+ * Compare the checksum of the values in a file with one computed over
+ * the timestamp and n values.
+ */
+static void
+check_value_crc(char *path, uint32_t n)
+{
+    size_t          len = (n + 1) * sizeof(int64_t);
+    unsigned char  *buf = malloc(RRD_HEADER_SIZE + len);
+    uint32_t        crc;
+    int             fd = open(path, O_RDONLY);
+
+    assert(buf && fd >= 0);
+    assert(pread(fd, buf, RRD_HEADER_SIZE + len, 0)
+           == (ssize_t) (RRD_HEADER_SIZE + len));
+    close(fd);
+    memcpy(&crc, buf + 11, sizeof(crc));
+    assert(be32toh(crc) == crc32(0, buf + 23, len));
+    free(buf);
+}
+
+/*
+ * The incremental checksum equals a full one when no, few, and many
+ * values change, and after sources were added and removed.
+ */
+static void
+test_checksum(void)
+{
+    RRD_PLUGIN     *plugin;
+    uint32_t        n = CRC_SOURCES;
+    int             rc;
+
+    plugin = rrd_open_sized("rrdtest", RRD_LOCAL_DOMAIN,
+                            "rrdtest-crc.rrd", CRC_SOURCES);
+    assert(plugin);
+    assert(rrd_set_checksum(plugin, 2) == RRD_ERROR);
+    rc = rrd_set_checksum(plugin, RRD_CHECKSUM_INCREMENTAL);
+    assert(rc == RRD_OK);
+    for (int i = 0; i < CRC_SOURCES; i++) {
+        snprintf(crc_names[i], sizeof(crc_names[i]), "crc-%d", i);
+        crc_src[i] = src[0];
+        crc_src[i].name = crc_names[i];
+        crc_src[i].sample = crc_sample;
+        crc_src[i].userdata = &crc_values[i];
+        rc = rrd_add_src(plugin, &crc_src[i]);
+        assert(rc == RRD_OK);
+    }
+    for (int s = 0; s < 40; s++) {
+        /*
+         * none, one, a few, and all values change
+         */
+        int             changes = s % 4 == 0 ? 0 : s % 4 == 1 ? 1
+            : s % 4 == 2 ? 7 : CRC_SOURCES;
+        for (int i = 0; i < changes; i++) {
+            crc_values[(i * 7919 + s) % CRC_SOURCES] += s * 0x0101010101LL;
+        }
+        if (s == 20) {
+            rc = rrd_del_src(plugin, &crc_src[17]);
+            assert(rc == RRD_OK);
+            n--;
+        }
+        rc = rrd_sample(plugin, NULL);
+        assert(rc == RRD_OK);
+        check_value_crc("rrdtest-crc.rrd", n);
+    }
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+/*
+ * timestamp in the header of a file in seconds since the epoch
+ */
+static double
+file_timestamp(char *path)
+{
+    uint32_t        crc;
+    uint32_t        n;
+    uint64_t        bits;
+    double          timestamp;
+
+    read_header(path, &crc, &n, &bits);
+    bits = be64toh(bits);
+    memcpy(&timestamp, &bits, sizeof(timestamp));
+    return timestamp;
+}
+
+/*
+ * Two plugins sampled with rrd_sample_at() report the same timestamp;
+ * a plugin using the coarse clock reports the current time. Uses the
+ * sources of test_many().
+ */
+static void
+test_clock(void)
+{
+    RRD_PLUGIN     *plugin[2];
+    char           *path[2] = { "rrdtest-clock.rrd", "rrdtest-clock-b.rrd" };
+    double          timestamp = 1476870000.25;
+    double          now;
+    int             rc;
+
+    for (int i = 0; i < 2; i++) {
+        plugin[i] = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, path[i]);
+        assert(plugin[i]);
+        rc = rrd_add_src(plugin[i], &many[i]);
+        assert(rc == RRD_OK);
+        rc = rrd_sample_at(plugin[i], timestamp);
+        assert(rc == RRD_OK);
+        assert(file_timestamp(path[i]) == timestamp);
+    }
+
+    assert(rrd_set_clock(plugin[0], 2) == RRD_ERROR);
+    rc = rrd_set_clock(plugin[0], RRD_CLOCK_COARSE);
+    assert(rc == RRD_OK);
+    now = rrd_clock(RRD_CLOCK_PRECISE);
+    assert(fabs(rrd_clock(RRD_CLOCK_COARSE) - now) < 1);
+    rc = rrd_sample(plugin[0], NULL);
+    assert(rc == RRD_OK);
+    assert(fabs(file_timestamp(path[0]) - now) < 1);
+
+    for (int i = 0; i < 2; i++) {
+        rc = rrd_close(plugin[i]);
+        assert(rc == RRD_OK);
+    }
+}
+
+static          rrd_value_t
+reader_sample(void *userdata)
+{
+    rrd_value_t     v;
+    v.float64 = 0.5;
+    return v;
+}
+
+/*
+ * Read a plugin with more sources than parson can parse through
+ * librrdreader: the meta data is parsed only when it changed, a copy
+ * with a corrupted value fails its checksum, and a file that was
+ * removed can't be read. Uses the sources of test_many().
+ */
+static void
+test_reader(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_READER     *reader;
+    RRD_READER_VIEW view;
+    RRD_READER_STATS stats;
+    RRD_SOURCE      odd = src[0];
+    char           *path = "rrdtest-reader.rrd";
+    char           *bad = "rrdtest-reader-bad.rrd";
+    double          timestamp = 1476870000.5;
+    unsigned char  *buf;
+    ssize_t         len;
+    int             fd;
+    int             rc;
+
+    plugin = rrd_open_sized("rrdtest", RRD_LOCAL_DOMAIN, path, 1024);
+    assert(plugin);
+    odd.name = "odd \"name\"";
+    odd.description = "tab\tand\x01 \xc3\xa9\xff";
+    odd.owner = RRD_VM;
+    odd.scale = RRD_DERIVE;
+    odd.type = RRD_FLOAT64;
+    odd.rrd_default = 0;
+    odd.sample = reader_sample;
+    rc = rrd_add_src(plugin, &odd);
+    assert(rc == RRD_OK);
+    for (int i = 0; i < 1000; i++) {
+        rc = rrd_add_src(plugin, &many[i]);
+        assert(rc == RRD_OK);
+    }
+    rc = rrd_sample_at(plugin, timestamp);
+    assert(rc == RRD_OK);
+
+    reader = rrd_reader_open(path);
+    assert(reader);
+    rc = rrd_reader_read(reader, &view);
+    assert(rc == RRD_OK);
+    assert(view.timestamp == timestamp);
+    assert(view.n == 1001);
+    assert(strcmp(view.sources[0].name, "odd \"name\"") == 0);
+    /*
+     * the invalid byte is replaced by U+FFFD
+     */
+    assert(strcmp(view.sources[0].description,
+                  "tab\tand\x01 \xc3\xa9\xef\xbf\xbd") == 0);
+    assert(strcmp(view.sources[0].owner,
+                  "vm 4cc1f2e0-5405-11e6-8c2f-572fc76ac144") == 0);
+    assert(strcmp(view.sources[0].type, "derive") == 0);
+    assert(view.sources[0].value_type == RRD_FLOAT64);
+    assert(!view.sources[0].rrd_default);
+    assert(rrd_reader_value(&view, 0).float64 == 0.5);
+    for (uint32_t i = 1; i < view.n; i++) {
+        assert(strcmp(view.sources[i].name, many_names[i - 1]) == 0);
+        assert(strcmp(view.sources[i].units, "points") == 0);
+        assert(strcmp(view.sources[i].owner, "host") == 0);
+        assert(view.sources[i].value_type == RRD_INT64);
+        assert(view.sources[i].rrd_default);
+        assert(rrd_reader_value(&view, i).int64 == i - 1);
+    }
+    assert(rrd_reader_stable(reader));
+
+    rc = rrd_sample_at(plugin, timestamp + 5);
+    assert(rc == RRD_OK);
+    rc = rrd_reader_read(reader, &view);
+    assert(rc == RRD_OK);
+    assert(view.timestamp == timestamp + 5);
+    rrd_reader_stats(reader, &stats);
+    assert(stats.reads == 2 && stats.parses == 1 && stats.retries == 0);
+
+    rc = rrd_del_src(plugin, &odd);
+    assert(rc == RRD_OK);
+    rc = rrd_sample_at(plugin, timestamp + 10);
+    assert(rc == RRD_OK);
+    assert(!rrd_reader_stable(reader));
+    rc = rrd_reader_read(reader, &view);
+    assert(rc == RRD_OK);
+    assert(view.n == 1000);
+    rrd_reader_stats(reader, &stats);
+    assert(stats.parses == 2);
+
+    /*
+     * flip a bit of the last value in a copy of the file
+     */
+    buf = malloc(1 << 20);
+    fd = open(path, O_RDONLY);
+    assert(buf && fd >= 0);
+    len = read(fd, buf, 1 << 20);
+    assert(len > RRD_HEADER_SIZE + 1000 * 8);
+    close(fd);
+    buf[RRD_HEADER_SIZE + 999 * 8 + 7] ^= 1;
+    fd = open(bad, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(write(fd, buf, len) == len);
+    close(fd);
+    free(buf);
+
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+    rc = rrd_reader_read(reader, &view);
+    assert(rc == RRD_FILE_ERROR);
+    rc = rrd_reader_close(reader);
+    assert(rc == RRD_OK);
+
+    reader = rrd_reader_open(bad);
+    assert(reader);
+    rc = rrd_reader_read(reader, &view);
+    assert(rc == RRD_CHECKSUM_ERROR);
+    rrd_reader_stats(reader, &stats);
+    assert(stats.reads == 0 && stats.retries == RRD_READER_RETRIES - 1);
+    rc = rrd_reader_close(reader);
+    assert(rc == RRD_OK);
+    unlink(bad);
+}
+
+/*
+ * Write a trace with sources added and removed between samples, read it
+ * back, and check that a truncated trace is detected. Uses the sources
+ * of test_many().
+ */
+static void
+test_trace(void)
+{
+    RRD_TRACE      *trace;
+    struct rrd_trace_event event;
+    int64_t         values[3] = { 0, 0, 0 };
+    double          d = -0.5;
+    struct stat     st;
+    int             rc;
+
+    trace = rrd_trace_create("rrdtest.trace");
+    assert(trace);
+    assert(rrd_trace_add(trace, 0, &many[0]) == RRD_OK);
+    assert(rrd_trace_add(trace, 2, &many[2]) == RRD_OK);
+    assert(rrd_trace_add(trace, 2, &many[2]) == RRD_DUPLICATE_SOURCE);
+    assert(rrd_trace_del(trace, 1) == RRD_NO_SUCH_SOURCE);
+    for (int s = 0; s < 3; s++) {
+        values[0] = INT64_MIN + s;
+        memcpy(&values[2], &d, sizeof(d));
+        d *= 3;
+        assert(rrd_trace_sample(trace, 1476870000.5 + s * 5, values)
+               == RRD_OK);
+    }
+    assert(rrd_trace_del(trace, 0) == RRD_OK);
+    assert(rrd_trace_sample(trace, 1476870020.25, values) == RRD_OK);
+    assert(rrd_trace_close(trace) == RRD_OK);
+
+    trace = rrd_trace_open("rrdtest.trace");
+    assert(trace);
+    for (int id = 0; id <= 2; id += 2) {
+        assert(rrd_trace_next(trace, &event) == 1);
+        assert(event.type == RRD_TRACE_ADD && event.id == (uint32_t) id);
+        assert(strcmp(event.source->name, many[id].name) == 0);
+        assert(strcmp(event.source->description, many[id].description)
+               == 0);
+        assert(strcmp(event.source->owner_uuid, many[id].owner_uuid) == 0);
+        assert(event.source->type == many[id].type);
+        assert(event.source->scale == many[id].scale);
+    }
+    d = -0.5;
+    for (int s = 0; s < 3; s++) {
+        assert(rrd_trace_next(trace, &event) == 1);
+        assert(event.type == RRD_TRACE_SAMPLE);
+        assert(event.timestamp == 1476870000.5 + s * 5);
+        assert(event.values[0] == INT64_MIN + s);
+        assert(memcmp(&event.values[2], &d, sizeof(d)) == 0);
+        d *= 3;
+    }
+    assert(rrd_trace_next(trace, &event) == 1);
+    assert(event.type == RRD_TRACE_DEL && event.id == 0);
+    assert(rrd_trace_next(trace, &event) == 1);
+    assert(event.type == RRD_TRACE_SAMPLE);
+    assert(event.timestamp == 1476870020.25);
+    assert(rrd_trace_next(trace, &event) == 0);
+    assert(rrd_trace_close(trace) == RRD_OK);
+
+    /*
+     * the last sample is cut short
+     */
+    rc = stat("rrdtest.trace", &st);
+    assert(rc == 0);
+    rc = truncate("rrdtest.trace", st.st_size - 1);
+    assert(rc == 0);
+    trace = rrd_trace_open("rrdtest.trace");
+    assert(trace);
+    for (int i = 0; i < 6; i++) {
+        assert(rrd_trace_next(trace, &event) == 1);
+    }
+    assert(rrd_trace_next(trace, &event) == -1);
+    assert(rrd_trace_close(trace) == RRD_OK);
+    unlink("rrdtest.trace");
+}
+
+/*
+ * Record samples of a plugin, enough to move the window of the
+ * recording, with a change of the meta data, and check every record.
+ * Uses the sources of test_many().
+ */
+#define RECORD_SOURCES 3000
+#define RECORD_SAMPLES 60
+
+static void
+test_record(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_READER     *reader;
+    RRD_READER_VIEW view;
+    unsigned char  *buf;
+    unsigned char  *meta = NULL;
+    unsigned char  *image;
+    size_t          meta_len = 0;
+    size_t          off = 8;
+    uint32_t        meta_crc = 0;
+    int             metas = 0;
+    int             samples = 0;
+    struct stat     st;
+    int             fd;
+    int             rc;
+
+    plugin = rrd_open_sized("rrdtest", RRD_LOCAL_DOMAIN,
+                            "rrdtest-record.rrd", RECORD_SOURCES);
+    assert(plugin);
+    for (int i = 0; i < RECORD_SOURCES; i++) {
+        rc = rrd_add_src(plugin, &many[i]);
+        assert(rc == RRD_OK);
+    }
+    assert(rrd_record_stop(plugin) == RRD_ERROR);
+    assert(rrd_record_start(plugin, "rrdtest.record", -1) == RRD_ERROR);
+    rc = rrd_record_start(plugin, "rrdtest.record", 60);
+    assert(rc == RRD_OK);
+    assert(rrd_record_start(plugin, "rrdtest.record", 60) == RRD_ERROR);
+    for (int s = 0; s < RECORD_SAMPLES; s++) {
+        if (s == RECORD_SAMPLES / 2) {
+            rc = rrd_del_src(plugin, &many[RECORD_SOURCES - 1]);
+            assert(rc == RRD_OK);
+        }
+        rc = rrd_sample_at(plugin, 1476870000 + s * 5);
+        assert(rc == RRD_OK);
+    }
+    rc = rrd_record_stop(plugin);
+    assert(rc == RRD_OK);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+
+    fd = open("rrdtest.record", O_RDONLY);
+    assert(fd >= 0);
+    assert(fstat(fd, &st) == 0);
+    assert(st.st_size > 1 << 20);
+    buf = malloc(st.st_size);
+    assert(buf);
+    assert(read(fd, buf, st.st_size) == st.st_size);
+    close(fd);
+    assert(memcmp(buf, "RRDREC01", 8) == 0);
+    reader = rrd_reader_open("rrdtest.record");
+    assert(reader);
+    while (off < (size_t) st.st_size) {
+        unsigned char  *r = buf + off;
+        uint32_t        size;
+        uint32_t        crc;
+        uint32_t        n;
+        uint64_t        bits;
+        double          timestamp;
+
+        memcpy(&size, r, sizeof(size));
+        size = be32toh(size);
+        assert(size > 5 && off + size <= (size_t) st.st_size);
+        if (r[4] == 'M') {
+            memcpy(&meta_crc, r + 5, sizeof(meta_crc));
+            assert(crc32(0, r + 13, size - 13) == be32toh(meta_crc));
+            meta = r + 9;
+            meta_len = size - 9;
+            metas++;
+        } else {
+            assert(r[4] == 'S');
+            n = samples < RECORD_SAMPLES / 2 ? RECORD_SOURCES
+                : RECORD_SOURCES - 1;
+            assert(size == 5 + 20 + n * sizeof(int64_t));
+            assert(memcmp(r + 9, &meta_crc, sizeof(meta_crc)) == 0);
+            memcpy(&crc, r + 5, sizeof(crc));
+            assert(crc32(0, r + 17, (n + 1) * sizeof(int64_t))
+                   == be32toh(crc));
+            memcpy(&n, r + 13, sizeof(n));
+            assert(be32toh(n) == size / 8 - 3);
+            memcpy(&bits, r + 17, sizeof(bits));
+            bits = be64toh(bits);
+            memcpy(&timestamp, &bits, sizeof(timestamp));
+            assert(timestamp == 1476870000 + samples * 5);
+            memcpy(&bits, r + 25 + 7 * sizeof(int64_t), sizeof(bits));
+            assert(be64toh(bits) == 7);
+
+            /*
+             * the sample and its meta data make up the file
+             */
+            image = malloc(11 + size - 5 + meta_len);
+            assert(image);
+            memcpy(image, "DATASOURCES", 11);
+            memcpy(image + 11, r + 5, size - 5);
+            memcpy(image + 11 + size - 5, meta, meta_len);
+            rc = rrd_reader_image(reader, image, 11 + size - 5 + meta_len,
+                                  &view);
+            assert(rc == RRD_OK);
+            assert(view.n == size / 8 - 3 && view.timestamp == timestamp);
+            assert(strcmp(view.sources[7].name, "many-7") == 0);
+            assert(rrd_reader_value(&view, 7).int64 == 7);
+            image[11 + 20] ^= 1;
+            rc = rrd_reader_image(reader, image, 11 + size - 5 + meta_len,
+                                  &view);
+            assert(rc == RRD_CHECKSUM_ERROR);
+            free(image);
+            samples++;
+        }
+        off += size;
+    }
+    assert(off == (size_t) st.st_size);
+    assert(metas == 2 && samples == RECORD_SAMPLES);
+    rrd_reader_close(reader);
+    free(buf);
+    unlink("rrdtest.record");
+}
+
+/*
+ * Keep a history of a counter and a float and query it back, with
+ * jitter and gaps in the timestamps.
+ */
+#define HISTORY_SAMPLES 3000
+#define HISTORY_SPAN    3600
+
+static rrd_value_t history_values[2];
+static double   history_t[HISTORY_SAMPLES];
+static rrd_value_t history_v[2][HISTORY_SAMPLES];
+
+static          rrd_value_t
+history_sample(void *userdata)
+{
+    return *(rrd_value_t *) userdata;
+}
+
+struct history_query {
+    int             source;     /* index into history_v */
+    int             next;       /* sample expected next, -1: any */
+    int             first;      /* sample returned first */
+    int             stop;       /* sample to stop at or -1 */
+};
+
+static int
+history_check(double timestamp, rrd_value_t value, void *userdata)
+{
+    struct history_query *q = userdata;
+
+    if (q->next < 0) {
+        q->next = 0;
+        while (history_t[q->next] < timestamp - 5e-4)
+            q->next++;
+        q->first = q->next;
+    }
+    assert(fabs(timestamp - history_t[q->next]) < 5e-4);
+    assert(value.int64 == history_v[q->source][q->next].int64);
+    return q->next++ == q->stop;
+}
+
+static void
+test_history(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      source[2];
+    struct history_query q;
+    double          t = 1476870000.123;
+    size_t          samples, bits, bytes;
+    int             first;
+    int             rc;
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-history.rrd");
+    assert(plugin);
+    for (int i = 0; i < 2; i++) {
+        source[i] = src[0];
+        source[i].name = i ? "history-float" : "history-int";
+        source[i].type = i ? RRD_FLOAT64 : RRD_INT64;
+        source[i].sample = history_sample;
+        source[i].userdata = &history_values[i];
+        rc = rrd_add_src(plugin, &source[i]);
+        assert(rc == RRD_OK);
+    }
+    assert(rrd_history_query(plugin, "history-int", 0, 1e10,
+                             history_check, &q) == RRD_ERROR);
+    assert(rrd_set_history(plugin, -1) == RRD_ERROR);
+    rc = rrd_set_history(plugin, HISTORY_SPAN);
+    assert(rc == RRD_OK);
+
+    srand(7);
+    for (int s = 0; s < HISTORY_SAMPLES; s++) {
+        /*
+         * jitter of up to a second, and a gap of a month
+         */
+        t += 5 + (rand() % 1000 - 500) / 1e3 + (s == 1000 ? 2.6e6 : 0);
+        history_values[0].int64 += rand() % 200;
+        history_values[1].float64 = s % 7 == 0 ? 0.25 * (s % 50) :
+            rand() / (double) RAND_MAX;
+        history_t[s] = t;
+        history_v[0][s] = history_values[0];
+        history_v[1][s] = history_values[1];
+        rc = rrd_sample_at(plugin, t);
+        assert(rc == RRD_OK);
+    }
+    rrd_history_usage(plugin, &samples, &bits, &bytes);
+    assert(samples < HISTORY_SAMPLES && bits < samples * 64);
+    assert(bytes * 8 > bits);
+
+    /*
+     * all samples of the last HISTORY_SPAN seconds, in order
+     */
+    for (int i = 0; i < 2; i++) {
+        q.source = i;
+        q.next = -1;
+        q.stop = -1;
+        rc = rrd_history_query(plugin, source[i].name, 0, 1e10,
+                               history_check, &q);
+        assert(rc == RRD_OK);
+        assert(q.next == HISTORY_SAMPLES);
+        assert(history_t[q.first] <= t - HISTORY_SPAN);
+        assert(q.first > 1000);
+        if (i == 0)
+            first = q.first;
+    }
+
+    /*
+     * a range, and stopping early
+     */
+    q.source = 0;
+    q.next = HISTORY_SAMPLES - 100;
+    q.stop = -1;
+    rc = rrd_history_query(plugin, "history-int", history_t[q.next],
+                           history_t[HISTORY_SAMPLES - 51], history_check,
+                           &q);
+    assert(rc == RRD_OK && q.next == HISTORY_SAMPLES - 50);
+    q.next = first;
+    q.stop = first + 10;
+    rc = rrd_history_query(plugin, "history-int", 0, 1e10, history_check,
+                           &q);
+    assert(rc == RRD_OK && q.next == first + 11);
+
+    assert(rrd_history_query(plugin, "nothing", 0, 1e10, history_check,
+                             &q) == RRD_NO_SUCH_SOURCE);
+    rc = rrd_del_src(plugin, &source[0]);
+    assert(rc == RRD_OK);
+    rc = rrd_add_src(plugin, &source[0]);
+    assert(rc == RRD_OK);
+    q.next = 0;
+    rc = rrd_history_query(plugin, "history-int", 0, 1e10, history_check,
+                           &q);
+    assert(rc == RRD_OK && q.next == 0);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+#define STATIC_SOURCES 8
+
+static char     storage[RRD_STATIC_SIZE(STATIC_SOURCES)];
+
+/*
+ * bytes allocated on the heap, or 0 where we can't tell
+ */
+static size_t
+heap_in_use(void)
+{
+#ifdef __GLIBC__
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * A plugin grown to 64 slots takes as much memory as one opened with
+ * them: the slots it started with are freed. One opened with rrd_open()
+ * does not grow. Uses the sources of test_many().
+ */
+static void
+test_grow(void)
+{
+    RRD_PLUGIN     *plugin;
+    size_t          heap = heap_in_use();
+    size_t          used[2];
+    size_t          capacity[2] = { 1, 64 };
+    int             rc;
+
+    for (int k = 0; k < 2; k++) {
+        plugin = rrd_open_sized("rrdtest", RRD_LOCAL_DOMAIN,
+                                "rrdtest-grow.rrd", capacity[k]);
+        assert(plugin);
+        for (int i = 0; i < 64; i++) {
+            rc = rrd_add_src(plugin, &many[i]);
+            assert(rc == RRD_OK);
+        }
+        assert(plugin->capacity == 64);
+        used[k] = heap_in_use() - heap;
+        rc = rrd_close(plugin);
+        assert(rc == RRD_OK);
+    }
+    assert(used[0] == used[1]);
+
+    plugin = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, "rrdtest-grow.rrd");
+    assert(plugin);
+    for (int i = 0; i < RRD_MAX_SOURCES; i++) {
+        rc = rrd_add_src(plugin, &many[i]);
+        assert(rc == RRD_OK);
+    }
+    rc = rrd_add_src(plugin, &many[RRD_MAX_SOURCES]);
+    assert(rc == RRD_TOO_MANY_SOURCES);
+    assert(plugin->capacity == RRD_MAX_SOURCES);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+/*
+ * A plugin in static storage has a fixed capacity and does not allocate
+ * memory when sources are added, removed, and sampled. Uses the sources
+ * of test_many().
+ */
+static void
+test_static(void)
+{
+    RRD_PLUGIN     *plugin;
+    RRD_SOURCE      big;
+    char            description[RRD_STATIC_JSON];
+    rrd_value_t     v[STATIC_SOURCES];
+    size_t          heap;
+    int             rc;
+
+    assert(rrd_open_static("rrdtest", RRD_LOCAL_DOMAIN, "x.rrd", storage,
+                           RRD_STATIC_SIZE(1) - 1) == NULL);
+
+    /*
+     * nothing is written past the storage, even if it is not aligned
+     */
+    memset(storage, 0xa5, sizeof storage);
+    plugin = rrd_open_static("rrdtest", RRD_LOCAL_DOMAIN,
+                             "rrdtest-static.rrd", storage + 1,
+                             RRD_STATIC_SIZE(1));
+    assert(plugin);
+    for (size_t i = RRD_STATIC_SIZE(1) + 1; i < sizeof storage; i++) {
+        assert((unsigned char)storage[i] == 0xa5);
+    }
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+
+    plugin = rrd_open_static("rrdtest", RRD_LOCAL_DOMAIN,
+                             "rrdtest-static.rrd", storage, sizeof storage);
+    assert(plugin);
+
+    heap = heap_in_use();
+    for (int i = 0; i < STATIC_SOURCES; i++) {
+        rc = rrd_add_src(plugin, &many[i]);
+        assert(rc == RRD_OK);
+    }
+    rc = rrd_add_src(plugin, &many[STATIC_SOURCES]);
+    assert(rc == RRD_TOO_MANY_SOURCES);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    rc = rrd_del_src(plugin, &many[0]);
+    assert(rc == RRD_OK);
+    rc = rrd_add_src(plugin, &many[STATIC_SOURCES]);
+    assert(rc == RRD_OK);
+    rc = rrd_sample(plugin, NULL);
+    assert(rc == RRD_OK);
+    assert(heap_in_use() == heap);
+
+    /*
+     * the last source took the place of the removed one
+     */
+    read_values("rrdtest-static.rrd", v, STATIC_SOURCES);
+    assert(v[0].int64 == STATIC_SOURCES - 1);
+    for (int i = 1; i < STATIC_SOURCES - 1; i++) {
+        assert(v[i].int64 == i);
+    }
+    assert(v[STATIC_SOURCES - 1].int64 == STATIC_SOURCES);
+    assert(file_contains("rrdtest-static.rrd", "many-8"));
+
+    /*
+     * meta data of a source must fit into its slot
+     */
+    rc = rrd_del_src(plugin, &many[1]);
+    assert(rc == RRD_OK);
+    memset(description, 'x', sizeof description - 1);
+    description[sizeof description - 1] = 0;
+    big = many[1];
+    big.description = description;
+    rc = rrd_add_src(plugin, &big);
+    assert(rc == RRD_ERROR);
+    assert(rrd_find_src(plugin, "many-1") == NULL);
+    rc = rrd_add_src(plugin, &many[1]);
+    assert(rc == RRD_OK);
+
+    assert(rrd_set_concurrent(plugin, 1) == RRD_ERROR);
+    rc = rrd_close(plugin);
+    assert(rc == RRD_OK);
+}
+
+#define SHARDS 4
+#define SHARD_SOURCES 100
+
+/*
+ * Spread sources over the shards of a plugin. All shards report the
+ * same timestamp and adding a source changes the meta data of only one
+ * shard.
+ */
+static void
+test_shard(void)
+{
+    RRD_SHARDED    *sharded;
+    RRD_SOURCE      extra;
+    char            path[SHARDS][32];
+    uint32_t        crc[SHARDS];
+    uint32_t        n[SHARDS];
+    uint64_t        timestamp[SHARDS];
+    uint32_t        total = 0;
+    int             changed = 0;
+    int             rc;
+
+    assert(rrd_shard_open("rrdtest", RRD_LOCAL_DOMAIN, "x.rrd", 0) == NULL);
+    sharded = rrd_shard_open("rrdtest", RRD_LOCAL_DOMAIN,
+                             "rrdtest-shard.rrd", SHARDS);
+    assert(sharded);
+    assert(rrd_shard_get(sharded, SHARDS) == NULL);
+    for (int i = 0; i < SHARD_SOURCES; i++) {
+        rc = rrd_shard_add_src(sharded, &many[i]);
+        assert(rc == RRD_OK);
+        assert(rrd_find_src(rrd_shard_of(sharded, many_names[i]),
+                            many_names[i]) == &many[i]);
+    }
+    rc = rrd_shard_sample(sharded, NULL);
+    assert(rc == RRD_OK);
+    for (int i = 0; i < SHARDS; i++) {
+        snprintf(path[i], sizeof(path[i]), "rrdtest-shard.rrd.%d", i);
+        read_header(path[i], &crc[i], &n[i], &timestamp[i]);
+        assert(n[i] > 0);
+        assert(timestamp[i] == timestamp[0]);
+        total += n[i];
+    }
+    assert(total == SHARD_SOURCES);
+
+    extra = many[SHARD_SOURCES];
+    rc = rrd_shard_add_src(sharded, &extra);
+    assert(rc == RRD_OK);
+    rc = rrd_shard_sample(sharded, NULL);
+    assert(rc == RRD_OK);
+    for (int i = 0; i < SHARDS; i++) {
+        uint32_t        c;
+        read_header(path[i], &c, &n[i], &timestamp[i]);
+        changed += c != crc[i];
+    }
+    assert(changed == 1);
+
+    rc = rrd_shard_del_src(sharded, &extra);
+    assert(rc == RRD_OK);
+    rc = rrd_shard_del_src(sharded, &extra);
+    assert(rc == RRD_NO_SUCH_SOURCE);
+    rc = rrd_shard_close(sharded);
+    assert(rc == RRD_OK);
+}
+
+#ifdef __linux__
+/*
+ * Drive three plugins with different intervals from one loop. The
+ * sample function of the fastest plugin stops the loop after a number
+ * of samples; the others must have been sampled proportionally. Then
+ * the clock is set back by an hour: the loop must be due again within
+ * an interval after the next dispatch and sample as before.
+ */
+
+#define LOOP_PLUGINS 3
+
+static RRD_LOOP *loop;
+static int      loop_samples[LOOP_PLUGINS];
+
+static          rrd_value_t
+loop_sample(void *userdata)
+{
+    rrd_value_t     v;
+    int             i = (int)(intptr_t) userdata;
+
+    v.int64 = ++loop_samples[i];
+    if (i == 0 && loop_samples[i] == 12)
+        rrd_loop_stop(loop);
+    return v;
+}
+
+static void
+test_loop(void)
+{
+    RRD_PLUGIN     *plugin[LOOP_PLUGINS];
+    RRD_SOURCE      source[LOOP_PLUGINS];
+    char            path[LOOP_PLUGINS][32];
+    double          interval[LOOP_PLUGINS] = { 0.02, 0.04, 0.08 };
+    int             rc;
+
+    loop = rrd_loop_open();
+    assert(loop);
+    assert(rrd_loop_fd(loop) >= 0);
+
+    for (int i = 0; i < LOOP_PLUGINS; i++) {
+        snprintf(path[i], sizeof(path[i]), "rrdtest-loop-%d.rrd", i);
+        plugin[i] = rrd_open("rrdtest", RRD_LOCAL_DOMAIN, path[i]);
+        assert(plugin[i]);
+
+        source[i] = src[0];
+        source[i].sample = loop_sample;
+        source[i].userdata = (void *)(intptr_t) i;
+        rc = rrd_add_src(plugin[i], &source[i]);
+        assert(rc == RRD_OK);
+
+        rc = rrd_loop_add(loop, plugin[i], interval[i], interval[i] / 2);
+        assert(rc == RRD_OK);
+    }
+    rc = rrd_loop_add(loop, plugin[0], 1.0, 1.0);
+    assert(rc == RRD_ERROR);
+
+    rc = rrd_loop_run(loop);
+    assert(rc == RRD_OK);
+    printf("loop samples: %d %d %d\n",
+           loop_samples[0], loop_samples[1], loop_samples[2]);
+    assert(loop_samples[0] == 12);
+    assert(loop_samples[1] >= 4 && loop_samples[1] <= 7);
+    assert(loop_samples[2] >= 1 && loop_samples[2] <= 4);
+
+    struct pollfd   pfd = { rrd_loop_fd(loop), POLLIN, 0 };
+    rrd_loop_skew(loop, 3600);
+    rc = rrd_loop_dispatch(loop);
+    assert(rc == RRD_OK);
+    assert(poll(&pfd, 1, 1000) == 1);
+    memset(loop_samples, 0, sizeof(loop_samples));
+    rc = rrd_loop_run(loop);
+    assert(rc == RRD_OK);
+    assert(loop_samples[0] == 12);
+    assert(loop_samples[1] >= 4 && loop_samples[1] <= 7);
+
+    for (int i = 0; i < LOOP_PLUGINS; i++) {
+        rc = rrd_loop_del(loop, plugin[i]);
+        assert(rc == RRD_OK);
+        rc = rrd_loop_del(loop, plugin[i]);
+        assert(rc == RRD_NO_SUCH_PLUGIN);
+        rrd_close(plugin[i]);
+    }
+    rc = rrd_loop_close(loop);
+    assert(rc == RRD_OK);
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+    if (argc != 1) {
+        fprintf(stderr, "usage: %s\n", basename(argv[0]));
+        exit(1);
+    }
+
+    test_sources();
+    test_hf();
+    test_hist();
+    test_counter();
+    test_timing();
+    test_many();
+    test_grow();
+    test_static();
+    test_crc();
+    test_checksum();
+    test_clock();
+    test_reader();
+    test_trace();
+    test_record();
+    test_history();
+    test_shard();
+    test_group();
+    test_concurrent();
+    test_shm();
+    test_shm_stress();
+#ifdef __linux__
+    test_loop();
+#endif
     return 0;
 }